@@ -0,0 +1,394 @@
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <map>
+#include <string>
+#include <vector>
+
+// Timed runs of each script when --runs is not given
+#define BENCH_DEFAULT_RUNS 10
+// Median slowdown against the baseline, in percent, reported as a regression
+#define BENCH_DEFAULT_THRESHOLD 5.0
+// Directory holding the scripts when none is given
+#define BENCH_DEFAULT_CORPUS "bench"
+// Directory, next to the scripts, their imports are found in
+#define BENCH_MODULES "modules"
+
+/**
+ * @brief Measures of one script over all its runs
+ *
+ */
+struct Result {
+    double medianMs = 0;
+    double p99Ms = 0;
+    long peakRssKb = 0;
+    //! Instructions dispatched, -1 when the interpreter can't count them
+    long long instructions = -1;
+};
+
+/**
+ * @brief Run [izi] [options] on [script] from the directory of the script
+ *
+ * The script's output is discarded. [stderrText] receives what it writes
+ * on stderr when not null. False if the interpreter could not run or
+ * failed.
+ */
+static bool runScript(const std::string &izi, const std::vector<std::string> &options, const std::filesystem::path &script,
+                      double *ms, long *rssKb, std::string *stderrText) {
+    int pipeFds[2];
+    if (stderrText != nullptr && pipe(pipeFds) != 0)
+        return false;
+
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid < 0)
+        return false;
+    if (pid == 0) {
+        int devNull = open("/dev/null", O_WRONLY);
+        dup2(devNull, STDOUT_FILENO);
+        if (stderrText != nullptr) {
+            dup2(pipeFds[1], STDERR_FILENO);
+            close(pipeFds[0]);
+            close(pipeFds[1]);
+        }
+        if (chdir(script.parent_path().c_str()) != 0)
+            _exit(127);
+
+        std::string file = script.filename().string();
+        std::vector<char *> argv;
+        argv.push_back((char *)izi.c_str());
+        for (const std::string &option : options) {
+            argv.push_back((char *)option.c_str());
+        }
+        argv.push_back((char *)"-I");
+        argv.push_back((char *)BENCH_MODULES);
+        argv.push_back((char *)file.c_str());
+        argv.push_back(nullptr);
+        execv(izi.c_str(), argv.data());
+        _exit(127);
+    }
+
+    if (stderrText != nullptr) {
+        close(pipeFds[1]);
+        char buffer[4096];
+        ssize_t count;
+        while ((count = read(pipeFds[0], buffer, sizeof(buffer))) > 0) {
+            stderrText->append(buffer, count);
+        }
+        close(pipeFds[0]);
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0)
+        return false;
+    *ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+#ifdef __APPLE__
+    *rssKb = usage.ru_maxrss / 1024;
+#else
+    *rssKb = usage.ru_maxrss;
+#endif
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/**
+ * @brief Instructions [izi] dispatches running [script], -1 if it is not
+ * an Opstats build
+ *
+ */
+static long long countInstructions(const std::string &izi, std::vector<std::string> options,
+                                   const std::filesystem::path &script) {
+    std::string stats;
+    double ms;
+    long rssKb;
+    options.push_back("--opstats");
+    if (!runScript(izi, options, script, &ms, &rssKb, &stats))
+        return -1;
+    size_t key = stats.find("\"instructions\":");
+    if (key == std::string::npos)
+        return -1;
+    return atoll(stats.c_str() + key + strlen("\"instructions\":"));
+}
+
+/**
+ * @brief Value of [sorted] below which [fraction] of the values lie,
+ * nearest rank
+ *
+ */
+static double percentile(const std::vector<double> &sorted, double fraction) {
+    size_t rank = (size_t)std::ceil(fraction * sorted.size());
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static double median(const std::vector<double> &sorted) {
+    size_t middle = sorted.size() / 2;
+    return sorted.size() % 2 == 1 ? sorted[middle] : (sorted[middle - 1] + sorted[middle]) / 2;
+}
+
+/**
+ * @brief Minimal reader for the JSON files written by saveResults()
+ *
+ * Only objects, numbers, strings and null are understood; numbers are
+ * kept by object path, as in `scripts.fib.median_ms`.
+ */
+struct JsonReader {
+    const char *current;
+    std::map<std::string, double> numbers;
+
+    void skipSpace() {
+        while (*current == ' ' || *current == '\n' || *current == '\r' || *current == '\t') {
+            current++;
+        }
+    }
+
+    bool string(std::string *text) {
+        if (*current != '"')
+            return false;
+        current++;
+        while (*current != '"') {
+            if (*current == '\0')
+                return false;
+            if (*current == '\\' && current[1] != '\0')
+                current++;
+            *text += *current++;
+        }
+        current++;
+        return true;
+    }
+
+    bool value(const std::string &path) {
+        skipSpace();
+        if (*current == '{') {
+            current++;
+            skipSpace();
+            if (*current == '}') {
+                current++;
+                return true;
+            }
+            for (;;) {
+                skipSpace();
+                std::string key;
+                if (!string(&key))
+                    return false;
+                skipSpace();
+                if (*current++ != ':')
+                    return false;
+                if (!value(path.empty() ? key : path + "." + key))
+                    return false;
+                skipSpace();
+                if (*current == ',') {
+                    current++;
+                } else if (*current == '}') {
+                    current++;
+                    return true;
+                } else {
+                    return false;
+                }
+            }
+        }
+        if (*current == '"') {
+            std::string ignored;
+            return string(&ignored);
+        }
+        if (strncmp(current, "null", 4) == 0) {
+            current += 4;
+            return true;
+        }
+        char *end;
+        double number = strtod(current, &end);
+        if (end == current)
+            return false;
+        numbers[path] = number;
+        current = end;
+        return true;
+    }
+};
+
+/**
+ * @brief Read the numbers of the results saved in [path]
+ *
+ */
+static bool loadResults(const char *path, std::map<std::string, double> *numbers) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return false;
+    std::string text;
+    char buffer[4096];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        text.append(buffer, count);
+    }
+    fclose(file);
+
+    JsonReader reader{text.c_str()};
+    if (!reader.value(""))
+        return false;
+    *numbers = reader.numbers;
+    return true;
+}
+
+static bool saveResults(const char *path, int runs, const std::map<std::string, Result> &results) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+        return false;
+    fprintf(file, "{\n  \"runs\": %d,\n  \"scripts\": {", runs);
+    const char *separator = "\n";
+    for (auto &[name, result] : results) {
+        fprintf(file, "%s    \"%s\": {\"median_ms\": %.3f, \"p99_ms\": %.3f, \"peak_rss_kb\": %ld, \"instructions\": ", separator,
+                name.c_str(), result.medianMs, result.p99Ms, result.peakRssKb);
+        if (result.instructions < 0)
+            fprintf(file, "null}");
+        else
+            fprintf(file, "%lld}", result.instructions);
+        separator = ",\n";
+    }
+    fprintf(file, "\n  }\n}\n");
+    return fclose(file) == 0;
+}
+
+/**
+ * @brief Scripts given on the command line, the .izi files of directories
+ * in name order
+ *
+ */
+static std::vector<std::filesystem::path> findScripts(const std::vector<std::string> &paths) {
+    std::vector<std::filesystem::path> scripts;
+    for (const std::string &path : paths) {
+        std::error_code error;
+        if (!std::filesystem::is_directory(path, error)) {
+            scripts.push_back(std::filesystem::absolute(path));
+            continue;
+        }
+        std::vector<std::filesystem::path> found;
+        for (auto &entry : std::filesystem::directory_iterator(path, error)) {
+            if (entry.is_regular_file() && entry.path().extension() == ".izi")
+                found.push_back(std::filesystem::absolute(entry.path()));
+        }
+        std::sort(found.begin(), found.end());
+        scripts.insert(scripts.end(), found.begin(), found.end());
+    }
+    return scripts;
+}
+
+static void usage() {
+    fprintf(stderr,
+            "Usage: izi-bench [--izi path] [--counts-izi path] [--arg option]... [--runs n] [--baseline file]\n"
+            "                 [--save file] [--threshold percent] [script or directory]...\n");
+    exit(64);
+}
+
+int main(int argc, const char *argv[]) {
+    // The interpreter is built next to the harness.
+    std::string izi = (std::filesystem::absolute(argv[0]).parent_path() / "izi").string();
+    std::string countsIzi;
+    int runs = BENCH_DEFAULT_RUNS;
+    double threshold = BENCH_DEFAULT_THRESHOLD;
+    const char *baselinePath = NULL;
+    const char *savePath = NULL;
+    // Passed to izi before the script, --arg --registers times the register loop
+    std::vector<std::string> options;
+    std::vector<std::string> paths;
+
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = i + 1 < argc;
+        if (strcmp(argv[i], "--izi") == 0 && hasValue) {
+            izi = std::filesystem::absolute(argv[++i]).string();
+        } else if (strcmp(argv[i], "--counts-izi") == 0 && hasValue) {
+            countsIzi = std::filesystem::absolute(argv[++i]).string();
+        } else if (strcmp(argv[i], "--arg") == 0 && hasValue) {
+            options.push_back(argv[++i]);
+        } else if (strcmp(argv[i], "--runs") == 0 && hasValue && atoi(argv[i + 1]) > 0) {
+            runs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--baseline") == 0 && hasValue) {
+            baselinePath = argv[++i];
+        } else if (strcmp(argv[i], "--save") == 0 && hasValue) {
+            savePath = argv[++i];
+        } else if (strcmp(argv[i], "--threshold") == 0 && hasValue) {
+            threshold = atof(argv[++i]);
+        } else if (argv[i][0] != '-') {
+            paths.push_back(argv[i]);
+        } else {
+            usage();
+        }
+    }
+    if (paths.empty())
+        paths.push_back(BENCH_DEFAULT_CORPUS);
+    if (countsIzi.empty())
+        countsIzi = izi;
+
+    std::map<std::string, double> baseline;
+    if (baselinePath != NULL && !loadResults(baselinePath, &baseline)) {
+        fprintf(stderr, "Could not read baseline \"%s\".\n", baselinePath);
+        exit(74);
+    }
+
+    std::vector<std::filesystem::path> scripts = findScripts(paths);
+    if (scripts.empty()) {
+        fprintf(stderr, "No script to run.\n");
+        exit(66);
+    }
+
+    printf("%-14s %10s %10s %10s %14s %10s\n", "script", "median ms", "p99 ms", "rss KB", "instructions", "baseline");
+    std::map<std::string, Result> results;
+    bool failed = false;
+    bool regressed = false;
+    for (const std::filesystem::path &script : scripts) {
+        std::string name = script.stem().string();
+        Result result;
+        std::vector<double> times;
+        double ms;
+        long rssKb;
+
+        // Warm the file cache.
+        bool ok = runScript(izi, options, script, &ms, &rssKb, nullptr);
+        for (int run = 0; ok && run < runs; run++) {
+            ok = runScript(izi, options, script, &ms, &rssKb, nullptr);
+            times.push_back(ms);
+            result.peakRssKb = std::max(result.peakRssKb, rssKb);
+        }
+        if (!ok) {
+            printf("%-14s failed\n", name.c_str());
+            failed = true;
+            continue;
+        }
+
+        std::sort(times.begin(), times.end());
+        result.medianMs = median(times);
+        result.p99Ms = percentile(times, 0.99);
+        result.instructions = countInstructions(countsIzi, options, script);
+        results[name] = result;
+
+        printf("%-14s %10.2f %10.2f %10ld ", name.c_str(), result.medianMs, result.p99Ms, result.peakRssKb);
+        if (result.instructions < 0)
+            printf("%14s ", "-");
+        else
+            printf("%14lld ", result.instructions);
+
+        auto base = baseline.find("scripts." + name + ".median_ms");
+        if (base == baseline.end() || base->second <= 0) {
+            printf("%10s\n", "-");
+            continue;
+        }
+        double change = (result.medianMs - base->second) / base->second * 100;
+        bool slower = change > threshold;
+        regressed = regressed || slower;
+        printf("%+9.1f%%%s\n", change, slower ? "  regression" : "");
+    }
+
+    if (savePath != NULL && !saveResults(savePath, runs, results)) {
+        fprintf(stderr, "Could not write results \"%s\".\n", savePath);
+        exit(74);
+    }
+    if (failed)
+        return 70;
+    return regressed ? 1 : 0;
+}
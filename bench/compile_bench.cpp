@@ -0,0 +1,205 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "../compiler.h"
+#include "../optimize.h"
+#include "../scanner.h"
+
+// Seconds each benchmark runs for when --min-time is not given
+#define BENCH_DEFAULT_MIN_TIME 0.5
+// Functions, cases or literals generated in one chunk, below its 256
+// constants
+#define BENCH_PER_CHUNK 100
+
+/**
+ * @brief Blocks, ifs and parentheses nested [depth] deep, [count] times
+ *
+ */
+static std::string deepNesting(int depth, int count) {
+    std::string source;
+    for (int i = 0; i < count; i++) {
+        source += "fun nested" + std::to_string(i) + "(a) {\n";
+        for (int level = 0; level < depth; level++) {
+            source += std::string(level + 1, ' ') + "if (a > 0) {\n";
+        }
+        source += "a = ";
+        for (int level = 0; level < depth; level++) {
+            source += "(a + ";
+        }
+        source += "1";
+        for (int level = 0; level < depth; level++) {
+            source += ")";
+        }
+        source += ";\n";
+        for (int level = 0; level < depth; level++) {
+            source += "}\n";
+        }
+        source += "return a;\n}\n";
+    }
+    return source;
+}
+
+/**
+ * @brief [count] small functions, grouped as locals of outer functions
+ *
+ */
+static std::string manyFunctions(int count) {
+    std::string source;
+    for (int i = 0; i < count; i++) {
+        if (i % BENCH_PER_CHUNK == 0)
+            source += "fun group" + std::to_string(i / BENCH_PER_CHUNK) + "() {\n";
+        std::string name = "f" + std::to_string(i);
+        source += "    fun " + name + "(a, b) {\n        var c = a * b + a;\n        if (c > b) return c - b;\n"
+                  "        return " + name + "(b, c);\n    }\n";
+        if (i % BENCH_PER_CHUNK == BENCH_PER_CHUNK - 1 || i == count - 1)
+            source += "}\n";
+    }
+    return source;
+}
+
+/**
+ * @brief [count] string literals of [length] characters
+ *
+ */
+static std::string longStrings(int count, int length) {
+    std::string source;
+    std::string text;
+    for (int i = 0; i < length; i++) {
+        text += (char)('a' + i % 26);
+    }
+    for (int i = 0; i < count; i++) {
+        if (i % BENCH_PER_CHUNK == 0)
+            source += "fun strings" + std::to_string(i / BENCH_PER_CHUNK) + "() {\n";
+        source += "    var s" + std::to_string(i % BENCH_PER_CHUNK) + " = \"" + text + "\";\n";
+        if (i % BENCH_PER_CHUNK == BENCH_PER_CHUNK - 1 || i == count - 1)
+            source += "}\n";
+    }
+    return source;
+}
+
+/**
+ * @brief [switches] functions, each switching over [cases] cases
+ *
+ */
+static std::string hugeSwitch(int switches, int cases) {
+    std::string source;
+    for (int i = 0; i < switches; i++) {
+        source += "fun choose" + std::to_string(i) + "(x) {\n    var y = x;\n    switch (x) {\n";
+        for (int c = 0; c < cases; c++) {
+            source += "        case " + std::to_string(c) + ":\n            y = x;\n            print y;\n";
+        }
+        source += "        default:\n            y = nil;\n    }\n    return y;\n}\n";
+    }
+    return source;
+}
+
+struct Input {
+    const char *name;
+    std::string source;
+    size_t tokens;
+};
+
+static size_t countTokens(const char *source) {
+    Scanner scanner(source);
+    size_t tokens = 0;
+    for (Token token = scanner.scanToken(); token.type != TOKEN_EOF; token = scanner.scanToken()) {
+        if (token.type == TOKEN_ERROR) {
+            fprintf(stderr, "Scan error: %.*s\n", token.length, token.start);
+            exit(70);
+        }
+        tokens++;
+    }
+    return tokens;
+}
+
+/**
+ * @brief Run [body] until [minTime] seconds went by, return the seconds
+ * of one run
+ *
+ */
+static double measure(const std::function<void()> &body, double minTime) {
+    using Clock = std::chrono::steady_clock;
+    body();
+    size_t iterations = 1;
+    for (;;) {
+        auto start = Clock::now();
+        for (size_t i = 0; i < iterations; i++) {
+            body();
+        }
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        if (seconds >= minTime)
+            return seconds / iterations;
+        // Aim a bit past the minimum time on the next try.
+        double scale = seconds > 0 ? minTime * 1.2 / seconds : 10;
+        iterations = std::max(iterations + 1, (size_t)(iterations * std::min(scale, 10.0)));
+    }
+}
+
+static void report(const char *kind, const Input &input, double seconds) {
+    char name[64];
+    snprintf(name, sizeof(name), "%s/%s", kind, input.name);
+    printf("%-24s %12.1f us %10.1f MB/s %10.2f Mtok/s\n", name, seconds * 1e6,
+           input.source.size() / seconds / 1e6, input.tokens / seconds / 1e6);
+}
+
+int main(int argc, const char *argv[]) {
+    double minTime = BENCH_DEFAULT_MIN_TIME;
+    const char *filter = "";
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) {
+            minTime = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (strncmp(argv[i], "-O", 2) == 0 && argv[i][2] >= '0' && argv[i][2] <= '0' + OPTIMIZE_MAX_LEVEL &&
+                   argv[i][3] == '\0') {
+            // Compile cost of each optimization level.
+            setOptimizationLevel(argv[i][2] - '0');
+        } else {
+            fprintf(stderr, "Usage: izi-compile-bench [--min-time seconds] [--filter text] [-O0|-O1|-O2]\n");
+            exit(64);
+        }
+    }
+
+    std::vector<Input> inputs = {
+        {"deep_nesting", deepNesting(40, 50)},
+        {"many_functions", manyFunctions(2000)},
+        {"long_strings", longStrings(500, 2000)},
+        {"huge_switch", hugeSwitch(20, 200)},
+    };
+
+    printf("%-24s %15s %15s %17s\n", "benchmark", "time", "bytes", "tokens");
+    for (Input &input : inputs) {
+        input.tokens = countTokens(input.source.c_str());
+        const char *source = input.source.c_str();
+        std::string scanName = std::string("scan/") + input.name;
+        std::string compileName = std::string("compile/") + input.name;
+
+        if (scanName.find(filter) != std::string::npos) {
+            double seconds = measure([source]() {
+                Scanner scanner(source);
+                while (scanner.scanToken().type != TOKEN_EOF) {
+                }
+            }, minTime);
+            report("scan", input, seconds);
+        }
+
+        if (compileName.find(filter) != std::string::npos) {
+            // A compiler per run, as when compiling a submitted script.
+            double seconds = measure([source]() {
+                Compiler compiler;
+                if (compiler.compile(source, std::make_shared<ObjModule>("bench")) == nullptr) {
+                    fprintf(stderr, "Benchmark input does not compile.\n");
+                    exit(70);
+                }
+            }, minTime);
+            report("compile", input, seconds);
+        }
+    }
+    return 0;
+}
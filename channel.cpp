@@ -0,0 +1,278 @@
+#include "channel.h"
+
+#include <unordered_map>
+
+#include "task.h"
+#include "vm.h"
+
+// Set once by stopChannels(), parked threads give up
+static std::atomic<bool> stopped(false);
+// Channels with parked threads, with how many
+static std::mutex parkedChannelsLock;
+static std::unordered_map<Channel *, int> parkedChannels;
+
+Channel::Channel(size_t capacity)
+    : capacity(capacity), sendPosition(0), receivePosition(0), closed(false), waiters(0) {
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    cells = std::make_unique<Cell[]>(size);
+    mask = size - 1;
+    for (size_t i = 0; i < size; i++) {
+        cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+/**
+ * @brief Move [value] into the channel unless it is full
+ *
+ * A cell is free for the sender at [position] when its sequence equals
+ * [position], and full for the receiver when it equals [position] + 1.
+ * The channel is full once [capacity] values wait, even with free cells.
+ */
+bool Channel::push(Value &value) {
+    size_t position = sendPosition.load(std::memory_order_relaxed);
+    for (;;) {
+        Cell &cell = cells[position & mask];
+        size_t sequence = cell.sequence.load(std::memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+        if (difference == 0) {
+            // A stale receive position only makes the channel look fuller.
+            if (position - receivePosition.load(std::memory_order_acquire) >= capacity)
+                return false;
+            if (sendPosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                cell.value = std::move(value);
+                cell.sequence.store(position + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (difference < 0) {
+            return false;
+        } else {
+            position = sendPosition.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+bool Channel::pop(Value *value) {
+    size_t position = receivePosition.load(std::memory_order_relaxed);
+    for (;;) {
+        Cell &cell = cells[position & mask];
+        size_t sequence = cell.sequence.load(std::memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+        if (difference == 0) {
+            if (receivePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                *value = std::move(cell.value);
+                cell.value = NIL_VAL;
+                // Free for the sender of the next lap.
+                cell.sequence.store(position + mask + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (difference < 0) {
+            return false;
+        } else {
+            position = receivePosition.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+void Channel::wakeWaiters() {
+    // Pairs with the fence of a parking thread: either it sees the change
+    // or we see it waiting.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiters.load(std::memory_order_relaxed) > 0) {
+        std::lock_guard<std::mutex> guard(parkLock);
+        parked.notify_all();
+    }
+}
+
+bool Channel::trySend(Value &value) {
+    if (closed.load() || !push(value))
+        return false;
+    wakeWaiters();
+    return true;
+}
+
+bool Channel::tryReceive(Value *value) {
+    if (!pop(value))
+        return false;
+    wakeWaiters();
+    return true;
+}
+
+/**
+ * @brief Sleep until [ready] holds or the channels are stopped
+ *
+ */
+void Channel::park(const std::function<bool()> &ready) {
+    // Another worker runs queued tasks meanwhile, one of them may be the
+    // peer we wait for.
+    TaskPool::blocking(true);
+    waiters.fetch_add(1);
+    {
+        std::lock_guard<std::mutex> guard(parkedChannelsLock);
+        parkedChannels[this]++;
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    {
+        std::unique_lock<std::mutex> guard(parkLock);
+        parked.wait(guard, [&] { return stopped.load() || ready(); });
+    }
+    {
+        std::lock_guard<std::mutex> guard(parkedChannelsLock);
+        if (--parkedChannels[this] == 0)
+            parkedChannels.erase(this);
+    }
+    waiters.fetch_sub(1);
+    TaskPool::blocking(false);
+}
+
+void stopChannels() {
+    stopped = true;
+    // A thread registering after this sees [stopped] and doesn't sleep.
+    std::lock_guard<std::mutex> guard(parkedChannelsLock);
+    for (auto &[channel, count] : parkedChannels) {
+        std::lock_guard<std::mutex> parkGuard(channel->parkLock);
+        channel->parked.notify_all();
+    }
+}
+
+/**
+ * @brief Move [value] into the channel, waiting for room, false once closed
+ * or stopped
+ *
+ */
+bool Channel::send(Value &value) {
+    for (;;) {
+        if (trySend(value))
+            return true;
+        if (closed.load())
+            return false;
+
+        bool sent = false;
+        park([&] { return closed.load() || (sent = push(value)); });
+        if (sent) {
+            wakeWaiters();
+            return true;
+        }
+        if (stopped.load())
+            return false;
+    }
+}
+
+/**
+ * @brief Take the oldest value, waiting for one, false once the channel is
+ * closed and drained or stopped
+ *
+ */
+bool Channel::receive(Value *value) {
+    for (;;) {
+        if (tryReceive(value))
+            return true;
+        if (closed.load())
+            return tryReceive(value);
+
+        bool received = false;
+        park([&] { return (received = pop(value)) || closed.load(); });
+        if (received) {
+            wakeWaiters();
+            return true;
+        }
+        if (stopped.load())
+            return false;
+    }
+}
+
+void Channel::close() {
+    {
+        std::lock_guard<std::mutex> guard(parkLock);
+        closed = true;
+    }
+    parked.notify_all();
+}
+
+static std::shared_ptr<Channel> channelOf(Value receiver) {
+    return std::static_pointer_cast<Channel>(AS_INSTANCE(receiver)->native);
+}
+
+/**
+ * @brief Channel(capacity), frozen so tasks share it instead of copying it
+ *
+ */
+static Value channelNew(VM *vm, Value receiver, int argCount, Value *args) {
+    if (!IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 1) {
+        vm->runtimeError("Channel capacity must be a positive number.");
+        return NIL_VAL;
+    }
+    Instance instance = AS_INSTANCE(receiver);
+    instance->native = std::make_shared<Channel>((size_t)AS_NUMBER(args[0]));
+    instance->frozen = true;
+    return receiver;
+}
+
+/**
+ * @brief Copy of [value] the channel can own, strings and frozen instances
+ * are shared
+ *
+ */
+static bool transferable(VM *vm, Value value, Value *copy) {
+    CopyMap copies;
+    if (!copyValue(value, copy, copies)) {
+        vm->runtimeError("Can't send a fiber, module or task through a channel.");
+        return false;
+    }
+    return true;
+}
+
+static Value channelSend(VM *vm, Value receiver, int argCount, Value *args) {
+    Value copy;
+    if (!transferable(vm, args[0], &copy))
+        return NIL_VAL;
+    if (!channelOf(receiver)->send(copy))
+        vm->runtimeError("Can't send on a closed channel.");
+    return NIL_VAL;
+}
+
+static Value channelTrySend(VM *vm, Value receiver, int argCount, Value *args) {
+    Value copy;
+    if (!transferable(vm, args[0], &copy))
+        return NIL_VAL;
+    return BOOL_VAL(channelOf(receiver)->trySend(copy));
+}
+
+/**
+ * @brief receive() waits for a value, nil once the channel is closed and
+ * drained
+ *
+ */
+static Value channelReceive(VM *vm, Value receiver, int argCount, Value *args) {
+    Value value = NIL_VAL;
+    channelOf(receiver)->receive(&value);
+    return value;
+}
+
+static Value channelTryReceive(VM *vm, Value receiver, int argCount, Value *args) {
+    Value value = NIL_VAL;
+    channelOf(receiver)->tryReceive(&value);
+    return value;
+}
+
+static Value channelClose(VM *vm, Value receiver, int argCount, Value *args) {
+    channelOf(receiver)->close();
+    return NIL_VAL;
+}
+
+static Value channelIsClosed(VM *vm, Value receiver, int argCount, Value *args) {
+    return BOOL_VAL(channelOf(receiver)->isClosed());
+}
+
+void defineChannels(VM *vm) {
+    Value channel = vm->defineBuiltinClass("Channel", CLS_CHANNEL);
+    vm->defineNativeMethod(channel, channelNew, "new", 1, false);
+    vm->defineNativeMethod(channel, channelSend, "send", 1, false);
+    vm->defineNativeMethod(channel, channelTrySend, "trySend", 1, false);
+    vm->defineNativeMethod(channel, channelReceive, "receive", 0, false);
+    vm->defineNativeMethod(channel, channelTryReceive, "tryReceive", 0, false);
+    vm->defineNativeMethod(channel, channelClose, "close", 0, false);
+    vm->defineNativeMethod(channel, channelIsClosed, "isClosed", 0, false);
+}
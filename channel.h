@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+#include "value.h"
+
+struct VM;
+
+/**
+ * @brief Bounded multi-producer multi-consumer queue of values
+ *
+ * A ring buffer whose cells carry a sequence number telling whether the
+ * cell is free or full at the current lap, so senders and receivers only
+ * synchronise through atomics. Threads only park on a condition variable
+ * when the channel is full or empty. The ring is rounded up to a power of
+ * two but never holds more than the capacity asked for.
+ */
+struct Channel {
+    explicit Channel(size_t capacity);
+    bool trySend(Value &value);
+    bool tryReceive(Value *value);
+    bool send(Value &value);
+    bool receive(Value *value);
+    void close();
+    bool isClosed() { return closed.load(); }
+
+   private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        Value value;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    //! Values the channel holds at most
+    size_t capacity;
+    alignas(64) std::atomic<size_t> sendPosition;
+    alignas(64) std::atomic<size_t> receivePosition;
+    alignas(64) std::atomic<bool> closed;
+
+    //! Threads blocked on a full or empty channel
+    std::atomic<int> waiters;
+    std::mutex parkLock;
+    std::condition_variable parked;
+
+    bool push(Value &value);
+    bool pop(Value *value);
+    void wakeWaiters();
+    void park(const std::function<bool()> &ready);
+
+    friend void stopChannels();
+};
+
+/**
+ * @brief Wake every thread parked on a channel and make blocking sends and
+ * receives fail from now on
+ *
+ * Called as the process exits, before the task pool joins its workers.
+ */
+void stopChannels();
+
+/**
+ * @brief Register the Channel class
+ *
+ * @param vm the VM receiving the globals
+ */
+void defineChannels(VM *vm);
@@ -14,6 +14,7 @@ Chunk::Chunk() {
 void Chunk::write(uint8_t byte, int line) {
     code.push_back(byte);
     lines.push_back(line);
+    feedback.push_back(0);
 }
 
 int Chunk::addConstant(Value value) {
@@ -21,6 +22,134 @@ int Chunk::addConstant(Value value) {
     return constants.size() - 1;
 }
 
+static const char *opcodeNames[] = {
+    "CONSTANT",
+    "NIL",
+    "TRUE",
+    "FALSE",
+    "POP",
+    "DUP",
+    "GET_LOCAL",
+    "SET_LOCAL",
+    "GET_GLOBAL",
+    "DEFINE_GLOBAL",
+    "SET_GLOBAL",
+    "GET_UPVALUE",
+    "SET_UPVALUE",
+    "GET_PROPERTY",
+    "SET_PROPERTY",
+    "GET_SUPER",
+    "EQUAL",
+    "GREATER",
+    "LESS",
+    "ADD",
+    "SUBTRACT",
+    "MULTIPLY",
+    "DIVIDE",
+    "NOT",
+    "NEGATE",
+    "PRINT",
+    "JUMP",
+    "JUMP_IF_FALSE",
+    "LOOP",
+    "CALL",
+    "CLOSURE",
+    "CLOSE_UPVALUE",
+    "RETURN",
+    "CLASS",
+    "METHOD",
+    "INHERIT",
+    "IMPORT",
+    "END_MODULE",
+    "RANGE",
+    "ITER_INIT",
+    "ITER_NEXT",
+    "TAIL_CALL",
+    "ADD_NUM",
+    "SUBTRACT_NUM",
+    "MULTIPLY_NUM",
+    "DIVIDE_NUM",
+    "GREATER_NUM",
+    "LESS_NUM",
+};
+static_assert(sizeof(opcodeNames) / sizeof(opcodeNames[0]) == OPCODE_COUNT, "every opcode needs a name");
+
+/**
+ * @brief Name of [instruction] as written in the OpCode enum
+ *
+ */
+const char *opcodeName(uint8_t instruction) {
+    return instruction < OPCODE_COUNT ? opcodeNames[instruction] : "UNKNOWN";
+}
+
+size_t instructionLength(const Chunk &chunk, size_t offset) {
+    if (offset + 1 >= chunk.code.size())
+        return chunk.code[offset] == CLOSURE ? 0 : instructionLength(chunk, chunk.code[offset], 0);
+    return instructionLength(chunk, chunk.code[offset], chunk.code[offset + 1]);
+}
+
+size_t instructionLength(const Chunk &chunk, uint8_t op, uint8_t operand) {
+    switch ((OpCode)op) {
+        case NIL:
+        case TRUE:
+        case FALSE:
+        case POP:
+        case DUP:
+        case EQUAL:
+        case GREATER:
+        case LESS:
+        case ADD:
+        case SUBTRACT:
+        case MULTIPLY:
+        case DIVIDE:
+        case NOT:
+        case NEGATE:
+        case PRINT:
+        case CLOSE_UPVALUE:
+        case RETURN:
+        case INHERIT:
+        case END_MODULE:
+        case RANGE:
+        case ITER_INIT:
+        case ADD_NUM:
+        case SUBTRACT_NUM:
+        case MULTIPLY_NUM:
+        case DIVIDE_NUM:
+        case GREATER_NUM:
+        case LESS_NUM:
+            return 1;
+        case CONSTANT:
+        case GET_LOCAL:
+        case SET_LOCAL:
+        case GET_GLOBAL:
+        case DEFINE_GLOBAL:
+        case SET_GLOBAL:
+        case GET_UPVALUE:
+        case SET_UPVALUE:
+        case GET_PROPERTY:
+        case SET_PROPERTY:
+        case GET_SUPER:
+        case CALL:
+        case TAIL_CALL:
+        case CLASS:
+        case METHOD:
+        case IMPORT:
+            return 2;
+        case JUMP:
+        case JUMP_IF_FALSE:
+        case LOOP:
+            return 3;
+        case ITER_NEXT:
+            return 4;
+        case CLOSURE:
+            // One isLocal and index pair per upvalue of the function.
+            if (operand >= chunk.constants.size() || !IS_FUNCTION(chunk.constants[operand]))
+                return 0;
+            return 2 + 2 * (size_t)AS_FUNCTION(chunk.constants[operand])->upvalueCount;
+    }
+    return 0;
+}
+
 int Chunk::disassembleInstruction(int offset) {
     printf("%04d ", offset);
 
@@ -34,96 +163,167 @@ int Chunk::disassembleInstruction(int offset) {
     OpCode instruction = (OpCode)code[offset];
     switch (instruction) {
         case OpCode::CONSTANT:
-            return constantInstruction("OP_CONSTANT", offset);
+            constantInstruction("OP_CONSTANT", offset);
+            break;
         case OpCode::NIL:
-            return simpleInstruction("OP_NIL", offset);
+            simpleInstruction("OP_NIL", offset);
+            break;
         case OpCode::TRUE:
-            return simpleInstruction("OP_TRUE", offset);
+            simpleInstruction("OP_TRUE", offset);
+            break;
         case OpCode::FALSE:
-            return simpleInstruction("OP_FALSE", offset);
+            simpleInstruction("OP_FALSE", offset);
+            break;
         case OpCode::POP:
-            return simpleInstruction("OP_POP", offset);
+            simpleInstruction("OP_POP", offset);
+            break;
+        case DUP:
+            simpleInstruction("OP_DUP", offset);
+            break;
         case GET_LOCAL:
-            return byteInstruction("OP_GET_LOCAL", offset);
+            byteInstruction("OP_GET_LOCAL", offset);
+            break;
         case SET_LOCAL:
-            return byteInstruction("OP_SET_LOCAL", offset);
+            byteInstruction("OP_SET_LOCAL", offset);
+            break;
         case OpCode::GET_GLOBAL:
-            return constantInstruction("OP_GET_GLOBAL", offset);
+            constantInstruction("OP_GET_GLOBAL", offset);
+            break;
         case OpCode::DEFINE_GLOBAL:
-            return constantInstruction("OP_DEFINE_GLOBAL", offset);
+            constantInstruction("OP_DEFINE_GLOBAL", offset);
+            break;
         case OpCode::SET_GLOBAL:
-            return constantInstruction("OP_SET_GLOBAL", offset);
+            constantInstruction("OP_SET_GLOBAL", offset);
+            break;
         case GET_UPVALUE:
-            return byteInstruction("OP_GET_UPVALUE", offset);
+            byteInstruction("OP_GET_UPVALUE", offset);
+            break;
         case SET_UPVALUE:
-            return byteInstruction("OP_SET_UPVALUE", offset);
+            byteInstruction("OP_SET_UPVALUE", offset);
+            break;
         case GET_PROPERTY:
-            return constantInstruction("OP_GET_PROPERTY", offset);
+            constantInstruction("OP_GET_PROPERTY", offset);
+            break;
         case SET_PROPERTY:
-            return constantInstruction("OP_SET_PROPERTY", offset);
+            constantInstruction("OP_SET_PROPERTY", offset);
+            break;
         case GET_SUPER:
-            return constantInstruction("OP_GET_SUPER", offset);
+            constantInstruction("OP_GET_SUPER", offset);
+            break;
         case EQUAL:
-            return simpleInstruction("OP_EQUAL", offset);
+            simpleInstruction("OP_EQUAL", offset);
+            break;
         case GREATER:
-            return simpleInstruction("OP_GREATER", offset);
+            simpleInstruction("OP_GREATER", offset);
+            break;
         case LESS:
-            return simpleInstruction("OP_LESS", offset);
+            simpleInstruction("OP_LESS", offset);
+            break;
         case OpCode::ADD:
-            return simpleInstruction("OP_ADD", offset);
+            simpleInstruction("OP_ADD", offset);
+            break;
         case SUBTRACT:
-            return simpleInstruction("OP_SUBTRACT", offset);
+            simpleInstruction("OP_SUBTRACT", offset);
+            break;
         case MULTIPLY:
-            return simpleInstruction("OP_MULTIPLY", offset);
+            simpleInstruction("OP_MULTIPLY", offset);
+            break;
         case DIVIDE:
-            return simpleInstruction("OP_DIVIDE", offset);
+            simpleInstruction("OP_DIVIDE", offset);
+            break;
         case NOT:
-            return simpleInstruction("OP_NOT", offset);
+            simpleInstruction("OP_NOT", offset);
+            break;
         case NEGATE:
-            return simpleInstruction("OP_NEGATE", offset);
+            simpleInstruction("OP_NEGATE", offset);
+            break;
         case PRINT:
-            return simpleInstruction("OP_PRINT", offset);
+            simpleInstruction("OP_PRINT", offset);
+            break;
         case JUMP:
-            return jumpInstruction("OP_JUMP", 1, offset);
+            jumpInstruction("OP_JUMP", 1, offset);
+            break;
         case JUMP_IF_FALSE:
-            return jumpInstruction("OP_JUMP_IF_FALSE", 1, offset);
+            jumpInstruction("OP_JUMP_IF_FALSE", 1, offset);
+            break;
         case LOOP:
-            return jumpInstruction("OP_LOOP", -1, offset);
+            jumpInstruction("OP_LOOP", -1, offset);
+            break;
         case CALL:
-            return byteInstruction("OP_CALL", offset);
+            byteInstruction("OP_CALL", offset);
+            break;
+        case TAIL_CALL:
+            byteInstruction("OP_TAIL_CALL", offset);
+            break;
         case CLOSURE: {
-            offset++;
-            uint8_t constant = code[offset++];
+            int operand = offset + 1;
+            uint8_t constant = code[operand++];
             printf("%-16s %4d ", "OP_CLOSURE", constant);
             printValue(constants[constant]);
             printf("\n");
             Function function = AS_FUNCTION(constants[constant]);
             for (int j = 0; j < function->upvalueCount; j++) {
-                int isLocal = code[offset++];
-                int index = code[offset++];
+                int isLocal = code[operand++];
+                int index = code[operand++];
                 printf("%04d      |                     %s %d\n",
-                       offset - 2, isLocal ? "local" : "upvalue", index);
+                       operand - 2, isLocal ? "local" : "upvalue", index);
             }
-
-            return offset;
+            break;
         }
         case CLOSE_UPVALUE:
-            return simpleInstruction("OP_CLOSE_UPVALUE", offset);
+            simpleInstruction("OP_CLOSE_UPVALUE", offset);
+            break;
         case OpCode::RETURN:
-            return simpleInstruction("OP_RETURN", offset);
+            simpleInstruction("OP_RETURN", offset);
+            break;
         case OpCode::CLASS:
-            return constantInstruction("OP_CLASS", offset);
+            constantInstruction("OP_CLASS", offset);
+            break;
         case METHOD:
-            return constantInstruction("OP_METHOD", offset);
+            constantInstruction("OP_METHOD", offset);
+            break;
         case INHERIT:
-            return simpleInstruction("OP_INHERIT", offset);
+            simpleInstruction("OP_INHERIT", offset);
+            break;
+        case END_MODULE:
+            simpleInstruction("OP_END_MODULE", offset);
+            break;
         case OpCode::IMPORT:
-            return simpleInstruction("OP_IMPORT", offset);
+            constantInstruction("OP_IMPORT", offset);
+            break;
+        case RANGE:
+            simpleInstruction("OP_RANGE", offset);
+            break;
+        case ITER_INIT:
+            simpleInstruction("OP_ITER_INIT", offset);
+            break;
+        case ITER_NEXT:
+            iterInstruction("OP_ITER_NEXT", offset);
+            break;
+        case ADD_NUM:
+            simpleInstruction("OP_ADD_NUM", offset);
+            break;
+        case SUBTRACT_NUM:
+            simpleInstruction("OP_SUBTRACT_NUM", offset);
+            break;
+        case MULTIPLY_NUM:
+            simpleInstruction("OP_MULTIPLY_NUM", offset);
+            break;
+        case DIVIDE_NUM:
+            simpleInstruction("OP_DIVIDE_NUM", offset);
+            break;
+        case GREATER_NUM:
+            simpleInstruction("OP_GREATER_NUM", offset);
+            break;
+        case LESS_NUM:
+            simpleInstruction("OP_LESS_NUM", offset);
             break;
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
     }
+    size_t length = instructionLength(*this, offset);
+    return offset + (length > 0 ? (int)length : 1);
 }
 
 int Chunk::constantInstruction(const char *name,
@@ -146,4 +346,11 @@ int Chunk::jumpInstruction(const char *name, int sign, int offset) {
     printf("%-16s %4d -> %d\n", name, offset,
            offset + 3 + sign * jump);
     return offset + 3;
+}
+int Chunk::iterInstruction(const char *name, int offset) {
+    uint8_t slot = code[offset + 1];
+    uint16_t jump = (uint16_t)(code[offset + 2] << 8);
+    jump |= code[offset + 3];
+    printf("%-16s %4d -> %d\n", name, slot, offset + 4 + jump);
+    return offset + 4;
 }
\ No newline at end of file
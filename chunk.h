@@ -47,9 +47,26 @@ enum OpCode {
     INHERIT,
     IMPORT,
     END_MODULE,
+    RANGE,
+    ITER_INIT,
+    ITER_NEXT,
+    // CALL in tail position, the callee takes over the caller's frame
+    TAIL_CALL,
+    // Quickened forms, only ever written by the VM over their generic op.
+    ADD_NUM,
+    SUBTRACT_NUM,
+    MULTIPLY_NUM,
+    DIVIDE_NUM,
+    GREATER_NUM,
+    LESS_NUM,
 
 };
 
+// Number of opcodes, keep it past the last one
+#define OPCODE_COUNT (LESS_NUM + 1)
+
+const char *opcodeName(uint8_t instruction);
+
 // smart line
 // long constant
 // https://github.com/munificent/craftinginterpreters/blob/master/note/answers/chapter14_chunks/
@@ -67,6 +84,10 @@ class Chunk {
     std::vector<int> lines;
     //! The constant pool for lookup value 
     std::vector<Value> constants;
+    //! Type feedback of each instruction, see VM::quicken
+    std::vector<uint8_t> feedback;
+    //! Shared by several VMs, the code is never rewritten
+    bool frozen = false;
 
    public:
     Chunk();
@@ -86,4 +107,21 @@ class Chunk {
     int constantInstruction(const char *name, int offset);
     int byteInstruction(const char *name, int offset);
     int jumpInstruction(const char *name, int sign, int offset);
-};
\ No newline at end of file
+    int iterInstruction(const char *name, int offset);
+};
+
+/**
+ * @brief Bytes of the instruction at [offset], opcode and operands
+ *
+ * The one table of operand widths, every pass walking bytecode steps with
+ * it. 0 for an unknown opcode or a CLOSURE whose constant is missing or
+ * not a function; operands past the end of the code are the caller's to
+ * check.
+ */
+size_t instructionLength(const Chunk &chunk, size_t offset);
+/**
+ * @brief Same for instruction [op] whose first operand is [operand], for
+ * code being rewritten away from the chunk
+ *
+ */
+size_t instructionLength(const Chunk &chunk, uint8_t op, uint8_t operand);
\ No newline at end of file
@@ -9,8 +9,20 @@
 
 #define MAX_ARGS (UINT8_MAX)
 
+// Trace compilation and execution, left out of optimized builds.
+#ifndef NDEBUG
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
+#endif
+
+// Count executed instructions for --opstats, set by the Opstats
+// configuration.
+// #define OPSTATS
+
+// Abort on any Value read as the wrong type (see Value::get).
+#ifdef DEBUG
+#define DEBUG_VERIFY_VALUES
+#endif
 
 // #undef DEBUG_TRACE_EXECUTION
 // #undef DEBUG_PRINT_CODE
\ No newline at end of file
@@ -2,10 +2,16 @@
 
 #include "stdio.h"
 
+#include "optimize.h"
+#include "regcode.h"
+
 void Parser::errorAt(Token *token, const char *message) {
     if (panicMode)
         return;
     panicMode = true;
+    hadError = true;
+    if (silent)
+        return;
     fprintf(stderr, "[line %d] Error", token->line);
 
     if (token->type == TOKEN_EOF) {
@@ -17,7 +23,6 @@ void Parser::errorAt(Token *token, const char *message) {
     }
 
     fprintf(stderr, ": %s\n", message);
-    hadError = true;
 }
 
 void Parser::errorAtCurrent(const char *message) {
@@ -67,6 +72,7 @@ void Compiler::initState(CompilerState *compilerState, FunctionType type) {
     compilerState->scopeDepth = 0;
     compilerState->function = std::make_shared<ObjFunction>();
     compilerState->type = type;
+    compilerState->lastCall = -1;
     current = compilerState;
     if (type != TYPE_SCRIPT) {
         current->function->name = copyString(parser.previous.start,
@@ -189,11 +195,17 @@ void Compiler::emitConstant(Value value) {
 Function Compiler::endCompiler() {
     emitReturn();
     Function function = current->function;
+    if (!parser.hadError)
+        optimizeFunction(function.get());
+    if (usesRegisterCode() && !parser.hadError)
+        translateRegisters(function.get());
 #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError) {
         disassembleChunk(currentChunk(), function->name != ""
                                              ? function->name.c_str()
                                              : "<script>");
+        if (function->registers != nullptr)
+            function->registers->disassemble(function->name != "" ? function->name.c_str() : "<script>");
     }
 #endif
     current = current->enclosing;
@@ -215,7 +227,7 @@ void Compiler::endScope() {
         current->localCount--;
     }
 }
-void Compiler::binary() {
+void Compiler::binary(bool canAssign) {
     TokenType operatorType = parser.previous.type;
     ParseRule *rule = getRule(operatorType);
     parsePrecedence((Precedence)(rule->precedence + 1));
@@ -251,13 +263,17 @@ void Compiler::binary() {
         case TOKEN_SLASH:
             emitByte(OpCode::DIVIDE);
             break;
+        case TOKEN_DOT_DOT:
+            emitByte(OpCode::RANGE);
+            break;
         default:
             return;  // Unreachable.
     }
 }
 
-void Compiler::call() {
+void Compiler::call(bool canAssign) {
     uint8_t argCount = argumentList();
+    current->lastCall = (int)currentChunk()->size();
     emitBytes(OpCode::CALL, argCount);
 }
 
@@ -281,7 +297,7 @@ void Compiler::dot(bool canAssign) {
         emitBytes(OpCode::GET_PROPERTY, name);
     }
 }
-void Compiler::literal() {
+void Compiler::literal(bool canAssign) {
     switch (parser.previous.type) {
         case TOKEN_FALSE:
             emitByte(FALSE);
@@ -296,16 +312,16 @@ void Compiler::literal() {
             return;  // Unreachable.
     }
 }
-void Compiler::grouping() {
+void Compiler::grouping(bool canAssign) {
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
-void Compiler::number() {
+void Compiler::number(bool canAssign) {
     double value = strtod(parser.previous.start, NULL);
     emitConstant(NUMBER_VAL(value));
 }
 
-void Compiler::string() {
+void Compiler::string(bool canAssign) {
     emitConstant(STRING_VAL(copyString(parser.previous.start + 1,
                                        parser.previous.length - 2)));
 }
@@ -342,7 +358,7 @@ Token Compiler::syntheticToken(const char *text) {
     token.length = (int)strlen(text);
     return token;
 }
-void Compiler::super_() {
+void Compiler::super_(bool canAssign) {
     if (currentClass == NULL) {
         error("Can't use 'super' outside of a class.");
     } else if (!currentClass->hasSuperclass) {
@@ -356,14 +372,14 @@ void Compiler::super_() {
     namedVariable(syntheticToken("super"), false);
     emitBytes(OpCode::GET_SUPER, name);
 }
-void Compiler::this_() {
+void Compiler::this_(bool canAssign) {
     if (currentClass == NULL) {
         error("Can't use 'this' outside of a class.");
         return;
     }
     variable(false);
 }
-void Compiler::unary() {
+void Compiler::unary(bool canAssign) {
     TokenType operatorType = parser.previous.type;
 
     // Compile the operand.
@@ -510,10 +526,17 @@ void Compiler::expressionStatement() {
 void Compiler::forStatement() {
     beginScope();
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
-    if (match(TOKEN_SEMICOLON)) {
-        // No initializer.
-    } else if (match(TOKEN_VAR)) {
+    bool declared = match(TOKEN_VAR);
+    if (checkForIn()) {
+        forInStatement();
+        endScope();
+        return;
+    }
+
+    if (declared) {
         varDeclaration();
+    } else if (match(TOKEN_SEMICOLON)) {
+        // No initializer.
     } else {
         expressionStatement();
     }
@@ -550,6 +573,59 @@ void Compiler::forStatement() {
     endScope();
 }
 
+/**
+ * @brief Look one token past the current identifier for `in`
+ *
+ */
+bool Compiler::checkForIn() {
+    if (!parser.check(TOKEN_IDENTIFIER))
+        return false;
+
+    Scanner saved = scanner;
+    Token next = scanner.scanToken();
+    scanner = saved;
+    return next.type == TOKEN_IN;
+}
+
+/**
+ * @brief for (x in sequence) statement
+ *
+ * The sequence and the iteration state live in two hidden locals, so
+ * stepping over a range or a string never allocates an iterator.
+ */
+void Compiler::forInStatement() {
+    consume(TOKEN_IDENTIFIER, "Expect loop variable name.");
+    Token name = parser.previous;
+    consume(TOKEN_IN, "Expect 'in' after loop variable.");
+    expression();
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+
+    // Names with a space can't clash with user variables.
+    addLocal(syntheticToken(" seq"));
+    markInitialized();
+    int seqSlot = current->localCount - 1;
+    emitByte(OpCode::ITER_INIT);
+    addLocal(syntheticToken(" iter"));
+    markInitialized();
+
+    int loopStart = currentChunk()->size();
+    emitBytes(OpCode::ITER_NEXT, (uint8_t)seqSlot);
+    emitByte(0xff);
+    emitByte(0xff);
+    int exitJump = currentChunk()->size() - 2;
+
+    // The element pushed by ITER_NEXT is the loop variable, scoped to one
+    // iteration so closures capture a fresh binding each time.
+    beginScope();
+    addLocal(name);
+    markInitialized();
+    statement();
+    endScope();
+
+    emitLoop(loopStart);
+    patchJump(exitJump);
+}
+
 void Compiler::ifStatement() {
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
     expression();
@@ -660,6 +736,11 @@ void Compiler::returnStatement() {
 
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+        // A call ending the returned expression is in tail position, jumps
+        // over it land on the RETURN kept for callees that can't take the
+        // frame over.
+        if (current->lastCall >= 0 && current->lastCall == (int)currentChunk()->size() - 2)
+            currentChunk()->code[current->lastCall] = OpCode::TAIL_CALL;
         emitByte(OpCode::RETURN);
     }
 }
@@ -742,56 +823,46 @@ void Compiler::statement() {
 }
 
 ParseRule *Compiler::getRule(TokenType type) {
-    auto grouping = [this](bool canAssign) { this->grouping(); };
-    auto unary = [this](bool canAssign) { this->unary(); };
-    auto binary = [this](bool canAssign) { this->binary(); };
-    auto call = [this](bool canAssign) { this->call(); };
-    auto dot = [this](bool canAssign) { this->dot(canAssign); };
-    auto number = [this](bool canAssign) { this->number(); };
-    auto string = [this](bool canAssign) { this->string(); };
-    auto literal = [this](bool canAssign) { this->literal(); };
-    auto variable = [this](bool canAssign) { this->variable(canAssign); };
-    auto super_ = [this](bool canAssign) { this->super_(); };
-    auto this_ = [this](bool canAssign) { this->this_(); };
-    auto and_ = [this](bool canAssign) { this->and_(); };
-    auto or_ = [this](bool canAssign) { this->or_(); };
+    // Shared by every compiler, rules only hold member functions.
     static ParseRule rules[] = {
-        [TOKEN_LEFT_PAREN] = {grouping, call, PREC_CALL},
+        [TOKEN_LEFT_PAREN] = {&Compiler::grouping, &Compiler::call, PREC_CALL},
         [TOKEN_RIGHT_PAREN] = {NULL, NULL, PREC_NONE},
         [TOKEN_LEFT_BRACE] = {NULL, NULL, PREC_NONE},
         [TOKEN_RIGHT_BRACE] = {NULL, NULL, PREC_NONE},
         [TOKEN_COMMA] = {NULL, NULL, PREC_NONE},
-        [TOKEN_DOT] = {NULL, dot, PREC_CALL},
-        [TOKEN_MINUS] = {unary, binary, PREC_TERM},
-        [TOKEN_PLUS] = {NULL, binary, PREC_TERM},
+        [TOKEN_DOT] = {NULL, &Compiler::dot, PREC_CALL},
+        [TOKEN_DOT_DOT] = {NULL, &Compiler::binary, PREC_RANGE},
+        [TOKEN_MINUS] = {&Compiler::unary, &Compiler::binary, PREC_TERM},
+        [TOKEN_PLUS] = {NULL, &Compiler::binary, PREC_TERM},
         [TOKEN_SEMICOLON] = {NULL, NULL, PREC_NONE},
-        [TOKEN_SLASH] = {NULL, binary, PREC_FACTOR},
-        [TOKEN_STAR] = {NULL, binary, PREC_FACTOR},
-        [TOKEN_BANG] = {unary, NULL, PREC_NONE},
-        [TOKEN_BANG_EQUAL] = {NULL, binary, PREC_EQUALITY},
+        [TOKEN_SLASH] = {NULL, &Compiler::binary, PREC_FACTOR},
+        [TOKEN_STAR] = {NULL, &Compiler::binary, PREC_FACTOR},
+        [TOKEN_BANG] = {&Compiler::unary, NULL, PREC_NONE},
+        [TOKEN_BANG_EQUAL] = {NULL, &Compiler::binary, PREC_EQUALITY},
         [TOKEN_EQUAL] = {NULL, NULL, PREC_NONE},
-        [TOKEN_EQUAL_EQUAL] = {NULL, binary, PREC_EQUALITY},
-        [TOKEN_GREATER] = {NULL, binary, PREC_COMPARISON},
-        [TOKEN_GREATER_EQUAL] = {NULL, binary, PREC_COMPARISON},
-        [TOKEN_LESS] = {NULL, binary, PREC_COMPARISON},
-        [TOKEN_LESS_EQUAL] = {NULL, binary, PREC_COMPARISON},
-        [TOKEN_IDENTIFIER] = {variable, NULL, PREC_NONE},
-        [TOKEN_STRING] = {string, NULL, PREC_NONE},
-        [TOKEN_NUMBER] = {number, NULL, PREC_NONE},
-        [TOKEN_AND] = {NULL, and_, PREC_AND},
+        [TOKEN_EQUAL_EQUAL] = {NULL, &Compiler::binary, PREC_EQUALITY},
+        [TOKEN_GREATER] = {NULL, &Compiler::binary, PREC_COMPARISON},
+        [TOKEN_GREATER_EQUAL] = {NULL, &Compiler::binary, PREC_COMPARISON},
+        [TOKEN_LESS] = {NULL, &Compiler::binary, PREC_COMPARISON},
+        [TOKEN_LESS_EQUAL] = {NULL, &Compiler::binary, PREC_COMPARISON},
+        [TOKEN_IDENTIFIER] = {&Compiler::variable, NULL, PREC_NONE},
+        [TOKEN_STRING] = {&Compiler::string, NULL, PREC_NONE},
+        [TOKEN_NUMBER] = {&Compiler::number, NULL, PREC_NONE},
+        [TOKEN_AND] = {NULL, &Compiler::and_, PREC_AND},
         [TOKEN_CLASS] = {NULL, NULL, PREC_NONE},
         [TOKEN_ELSE] = {NULL, NULL, PREC_NONE},
-        [TOKEN_FALSE] = {literal, NULL, PREC_NONE},
+        [TOKEN_FALSE] = {&Compiler::literal, NULL, PREC_NONE},
         [TOKEN_FOR] = {NULL, NULL, PREC_NONE},
         [TOKEN_FUN] = {NULL, NULL, PREC_NONE},
         [TOKEN_IF] = {NULL, NULL, PREC_NONE},
-        [TOKEN_NIL] = {literal, NULL, PREC_NONE},
-        [TOKEN_OR] = {NULL, or_, PREC_OR},
+        [TOKEN_IN] = {NULL, NULL, PREC_NONE},
+        [TOKEN_NIL] = {&Compiler::literal, NULL, PREC_NONE},
+        [TOKEN_OR] = {NULL, &Compiler::or_, PREC_OR},
         [TOKEN_PRINT] = {NULL, NULL, PREC_NONE},
         [TOKEN_RETURN] = {NULL, NULL, PREC_NONE},
-        [TOKEN_SUPER] = {super_, NULL, PREC_NONE},
-        [TOKEN_THIS] = {this_, NULL, PREC_NONE},
-        [TOKEN_TRUE] = {literal, NULL, PREC_NONE},
+        [TOKEN_SUPER] = {&Compiler::super_, NULL, PREC_NONE},
+        [TOKEN_THIS] = {&Compiler::this_, NULL, PREC_NONE},
+        [TOKEN_TRUE] = {&Compiler::literal, NULL, PREC_NONE},
         [TOKEN_VAR] = {NULL, NULL, PREC_NONE},
         [TOKEN_WHILE] = {NULL, NULL, PREC_NONE},
         [TOKEN_ERROR] = {NULL, NULL, PREC_NONE},
@@ -808,11 +879,11 @@ void Compiler::parsePrecedence(Precedence precedence) {
         return;
     }
     bool canAssign = precedence <= PREC_ASSIGNMENT;
-    prefixRule(canAssign);
+    (this->*prefixRule)(canAssign);
     while (precedence <= getRule(parser.current.type)->precedence) {
         advance();
         ParseFn infixRule = getRule(parser.previous.type)->infix;
-        infixRule(canAssign);
+        (this->*infixRule)(canAssign);
     }
 
     if (canAssign && match(TOKEN_EQUAL)) {
@@ -860,10 +931,10 @@ int Compiler::addUpvalue(CompilerState *compiler, uint8_t index,
 }
 
 int Compiler::resolveUpvalue(CompilerState *compiler, Token *name) {
-    if (current->enclosing == NULL)
+    if (compiler->enclosing == NULL)
         return -1;
 
-    int local = resolveLocal(current->enclosing, name);
+    int local = resolveLocal(compiler->enclosing, name);
     if (local != -1) {
         compiler->enclosing->locals[local].isCaptured = true;
         return addUpvalue(compiler, (uint8_t)local, true);
@@ -946,7 +1017,7 @@ uint8_t Compiler::argumentList() {
     return argCount;
 }
 
-void Compiler::and_() {
+void Compiler::and_(bool canAssign) {
     int endJump = emitJump(OpCode::JUMP_IF_FALSE);
 
     emitByte(POP);
@@ -955,7 +1026,7 @@ void Compiler::and_() {
     patchJump(endJump);
 }
 
-void Compiler::or_() {
+void Compiler::or_(bool canAssign) {
     int elseJump = emitJump(OpCode::JUMP_IF_FALSE);
     int endJump = emitJump(OpCode::JUMP);
 
@@ -19,6 +19,8 @@ struct Parser {
     Token previous;
     bool hadError;
     bool panicMode;
+    //! Record errors without printing them
+    bool silent = false;
     Scanner *scanner;
 
    public:
@@ -39,6 +41,7 @@ enum Precedence {
     PREC_AND,          // and
     PREC_EQUALITY,     // == !=
     PREC_COMPARISON,   // < > <= >=
+    PREC_RANGE,        // ..
     PREC_TERM,         // + -
     PREC_FACTOR,       // * /
     PREC_UNARY,        // ! -
@@ -46,8 +49,9 @@ enum Precedence {
     PREC_PRIMARY
 };
 
-// typedef void (*ParseFn)();
-typedef std::function<void(bool)> ParseFn;
+class Compiler;
+
+typedef void (Compiler::*ParseFn)(bool canAssign);
 
 struct ParseRule {
     ParseFn prefix;
@@ -73,6 +77,8 @@ struct CompilerState {
     int scopeDepth;
     Function function;
     FunctionType type;
+    //! Offset of the last CALL emitted, see returnStatement()
+    int lastCall;
 };
 struct ClassCompiler {
     struct ClassCompiler *enclosing;
@@ -96,6 +102,7 @@ class Compiler {
     void advance();
     void consume(TokenType type, const char *message);
     bool match(TokenType type) { return parser.match(type); }
+    void silenceErrors(bool silent) { parser.silent = silent; }
     void error(const char *message);
     void emitByte(uint8_t byte);
     void emitBytes(uint8_t byte1, uint8_t byte2);
@@ -108,19 +115,19 @@ class Compiler {
     Function endCompiler();
     void beginScope();
     void endScope();
-    void binary();
-    void call();
+    void binary(bool canAssign);
+    void call(bool canAssign);
     void dot(bool canAssign);
-    void literal();
-    void grouping();
-    void number();
-    void string();
+    void literal(bool canAssign);
+    void grouping(bool canAssign);
+    void number(bool canAssign);
+    void string(bool canAssign);
     void namedVariable(Token name, bool canAssign);
     void variable(bool canAssign);
     Token syntheticToken(const char *text);
-    void super_();
-    void this_();
-    void unary();
+    void super_(bool canAssign);
+    void this_(bool canAssign);
+    void unary(bool canAssign);
     void expression();
     void block();
     void function(FunctionType type);
@@ -131,6 +138,8 @@ class Compiler {
     void import();
     void expressionStatement();
     void forStatement();
+    bool checkForIn();
+    void forInStatement();
     void ifStatement();
     void switchStatement();
     void printStatement();
@@ -152,6 +161,6 @@ class Compiler {
     void markInitialized();
     void defineVariable(uint8_t global);
     uint8_t argumentList();
-    void and_();
-    void or_();
+    void and_(bool canAssign);
+    void or_(bool canAssign);
 };
\ No newline at end of file
@@ -0,0 +1,131 @@
+#include "core.h"
+
+#include "vm.h"
+
+// Field holding the buffer of a StringBuilder, the space keeps it out of
+// reach of scripts.
+#define BUILDER_BUFFER " buffer"
+
+/**
+ * @brief join(separator, a, b, ...) concatenates its arguments in one pass
+ *
+ */
+Value joinNative(VM *vm, int argCount, Value *args) {
+    if (argCount == 0)
+        return STRING_VAL("");
+
+    std::string separator = toString(args[0]);
+    std::string result;
+    for (int i = 1; i < argCount; i++) {
+        if (i > 1)
+            result += separator;
+        result += toString(args[i]);
+    }
+    return STRING_VAL(std::move(result));
+}
+
+/**
+ * @brief Buffer of a builder, unshared before it is written to
+ *
+ * The buffer is handed out by toString() without copying, so it is only
+ * copied when appended to while a script still holds the result.
+ */
+static ObjString *builderBuffer(Value receiver) {
+    Value &buffer = AS_INSTANCE(receiver)->fields[BUILDER_BUFFER];
+    if (!IS_STRING(buffer)) {
+        buffer = STRING_VAL("");
+    }
+    Str &str = AS_STR(buffer);
+    if (str.body == nullptr || str.body.use_count() != 1) {
+        str = Str(std::make_shared<ObjString>(std::string(str.view())));
+    }
+    return str.body.get();
+}
+
+static Value builderNew(VM *vm, Value receiver, int argCount, Value *args) {
+    AS_INSTANCE(receiver)->fields[BUILDER_BUFFER] = STRING_VAL("");
+    return receiver;
+}
+
+static Value builderAppend(VM *vm, Value receiver, int argCount, Value *args) {
+    ObjString *buffer = builderBuffer(receiver);
+    if (IS_STRING(args[0])) {
+        buffer->chars += AS_STRING(args[0]);
+    } else {
+        buffer->chars += toString(args[0]);
+    }
+    // The destructor frees the bytes of the final length.
+    heapResized(HEAP_STRING, (int64_t)(buffer->chars.size() - buffer->length));
+    buffer->length = buffer->chars.size();
+    return receiver;
+}
+
+static Value builderToString(VM *vm, Value receiver, int argCount, Value *args) {
+    builderBuffer(receiver);
+    return AS_INSTANCE(receiver)->fields[BUILDER_BUFFER];
+}
+
+static Value builderLength(VM *vm, Value receiver, int argCount, Value *args) {
+    return NUMBER_VAL((double)builderBuffer(receiver)->length);
+}
+
+/**
+ * @brief Fiber(fn) wraps a function taking at most one argument
+ *
+ */
+static Value fiberNative(VM *vm, int argCount, Value *args) {
+    if (argCount != 1 || !IS_CLOSURE(args[0])) {
+        vm->runtimeError("Fiber() expects a function.");
+        return NIL_VAL;
+    }
+    Closure closure = AS_CLOSURE(args[0]);
+    if (closure->function->arity > 1) {
+        vm->runtimeError("A fiber function takes at most one argument.");
+        return NIL_VAL;
+    }
+    return FIBER_VAL(std::make_shared<ObjFiber>(closure));
+}
+
+/**
+ * @brief resume(fiber, value) runs [fiber] until it yields or returns
+ *
+ */
+static Value resumeNative(VM *vm, int argCount, Value *args) {
+    if (argCount < 1 || argCount > 2 || !IS_FIBER(args[0])) {
+        vm->runtimeError("resume() expects a fiber and an optional value.");
+        return NIL_VAL;
+    }
+    vm->resumeFiber(AS_FIBER(args[0]), argCount == 2 ? args[1] : NIL_VAL);
+    return NIL_VAL;
+}
+
+/**
+ * @brief yield(value) suspends the running fiber
+ *
+ */
+static Value yieldNative(VM *vm, int argCount, Value *args) {
+    vm->yieldFiber(argCount > 0 ? args[0] : NIL_VAL);
+    return NIL_VAL;
+}
+
+static Value isDoneNative(VM *vm, int argCount, Value *args) {
+    if (argCount != 1 || !IS_FIBER(args[0])) {
+        vm->runtimeError("isDone() expects a fiber.");
+        return NIL_VAL;
+    }
+    return BOOL_VAL(AS_FIBER(args[0])->state == FIBER_DONE);
+}
+
+void defineCore(VM *vm) {
+    vm->defineNative("join", joinNative);
+    vm->defineNative("Fiber", fiberNative);
+    vm->defineNative("resume", resumeNative);
+    vm->defineNative("yield", yieldNative);
+    vm->defineNative("isDone", isDoneNative);
+
+    Value builder = vm->defineBuiltinClass("StringBuilder", CLS_STRING);
+    vm->defineNativeMethod(builder, builderNew, "new", 0, false);
+    vm->defineNativeMethod(builder, builderAppend, "append", 1, false);
+    vm->defineNativeMethod(builder, builderToString, "toString", 0, false);
+    vm->defineNativeMethod(builder, builderLength, "length", 0, false);
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "value.h"
+
+struct VM;
+
+/**
+ * @brief Register the native functions and classes of the core library
+ *
+ * @param vm the VM receiving the globals
+ */
+void defineCore(VM *vm);
+
+Value joinNative(VM *vm, int argCount, Value *args);
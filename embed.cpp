@@ -0,0 +1,83 @@
+#include "vm.h"
+
+/**
+ * @brief Take the global [name] into [handle], false if it is not defined
+ *
+ * Meant to be done once after interpret() ran the script defining it; the
+ * handle stays valid when the global is later reassigned.
+ */
+bool VM::getHandle(const char *name, Handle *handle) {
+    auto it = globals.find(name);
+    if (it == globals.end())
+        return false;
+    handle->value = it->second;
+    return true;
+}
+
+/**
+ * @brief Call [function] with the first [argCount] slots as arguments
+ *
+ * The value returned is put in slot zero. Only valid while the VM is not
+ * running, as between two interpret() calls.
+ */
+InterpretResult VM::callHandle(const Handle &function, int argCount) {
+    ensureSlots(argCount > 0 ? argCount : 1);
+    Value result;
+    InterpretResult status = callFunction(function.value, slots.data(), argCount, &result);
+    if (status == INTERPRET_OK)
+        slots[0] = result;
+    return status;
+}
+
+/**
+ * @brief Make sure at least [count] slots exist, new ones hold nil
+ *
+ */
+void VM::ensureSlots(int count) {
+    if ((int)slots.size() < count)
+        slots.resize(count, NIL_VAL);
+}
+
+ValueType VM::getSlotType(int slot) {
+    return slots[slot].type;
+}
+
+bool VM::getSlotBool(int slot) {
+    return AS_BOOL(slots[slot]);
+}
+
+double VM::getSlotNumber(int slot) {
+    return AS_NUMBER(slots[slot]);
+}
+
+/**
+ * @brief Characters of the string in [slot], valid until the slot changes
+ *
+ */
+std::string_view VM::getSlotString(int slot) {
+    return AS_STRING(slots[slot]);
+}
+
+Handle VM::getSlotHandle(int slot) {
+    return Handle{slots[slot]};
+}
+
+void VM::setSlotNil(int slot) {
+    slots[slot] = NIL_VAL;
+}
+
+void VM::setSlotBool(int slot, bool value) {
+    slots[slot] = BOOL_VAL(value);
+}
+
+void VM::setSlotNumber(int slot, double value) {
+    slots[slot] = NUMBER_VAL(value);
+}
+
+void VM::setSlotString(int slot, std::string_view value) {
+    slots[slot] = STRING_VAL(value);
+}
+
+void VM::setSlotHandle(int slot, const Handle &handle) {
+    slots[slot] = handle.value;
+}
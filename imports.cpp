@@ -0,0 +1,256 @@
+#include "imports.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+
+#include "compiler.h"
+#include "vm.h"
+
+// Guards the search paths and the resolved names
+static std::mutex resolverLock;
+static std::vector<String> searchPaths;
+static std::unordered_map<String, String> resolved;
+
+void addModuleSearchPath(const String &directory) {
+    std::lock_guard<std::mutex> guard(resolverLock);
+    searchPaths.push_back(directory);
+    resolved.clear();
+}
+
+/**
+ * @brief Directories to search, in order
+ *
+ */
+static std::vector<String> searchOrder() {
+    std::vector<String> directories = {"."};
+    directories.insert(directories.end(), searchPaths.begin(), searchPaths.end());
+    if (const char *variable = getenv(MODULE_PATH_VARIABLE)) {
+        String list(variable);
+        size_t start = 0;
+        while (start <= list.size()) {
+            size_t end = list.find(':', start);
+            if (end == String::npos)
+                end = list.size();
+            if (end > start)
+                directories.push_back(list.substr(start, end - start));
+            start = end + 1;
+        }
+    }
+    return directories;
+}
+
+bool resolveModule(const String &name, String *path) {
+    // todo:  expose api to load module exemple pkg managr folder
+    if (name == "core") {
+        *path = CORE_MODULE_PATH;
+        return true;
+    }
+    std::lock_guard<std::mutex> guard(resolverLock);
+    auto it = resolved.find(name);
+    if (it != resolved.end()) {
+        *path = it->second;
+        return true;
+    }
+
+    for (const String &directory : searchOrder()) {
+        std::error_code error;
+        std::filesystem::path candidate = std::filesystem::path(directory) / (name + MODULE_EXTENSION);
+        if (!std::filesystem::is_regular_file(candidate, error))
+            continue;
+        std::filesystem::path canonical = std::filesystem::canonical(candidate, error);
+        if (error)
+            continue;
+        *path = canonical.string();
+        // Missing modules aren't remembered, their file may show up later.
+        resolved[name] = *path;
+        return true;
+    }
+    return false;
+}
+
+bool readModuleSource(const String &path, std::string *source) {
+    if (path == CORE_MODULE_PATH) {
+        *source = R"(
+            class System{
+                println(val){
+                    print val;
+                }
+            }
+        )";
+        return true;
+    }
+    FILE *file = fopen(path.c_str(), "rb");
+    if (file == NULL)
+        return false;
+    source->clear();
+    char buffer[4096];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        source->append(buffer, count);
+    }
+    fclose(file);
+    return true;
+}
+
+/**
+ * @brief Canonical paths of the modules [source] imports, those not found
+ * are skipped
+ *
+ */
+static std::vector<String> resolveImports(const char *source) {
+    std::vector<String> paths;
+    for (const String &name : scanImports(source)) {
+        String path;
+        if (resolveModule(name, &path))
+            paths.push_back(path);
+    }
+    return paths;
+}
+
+std::vector<String> scanImports(const char *source) {
+    std::vector<String> imports;
+    Scanner scanner(source);
+    for (Token token = scanner.scanToken(); token.type != TOKEN_EOF; token = scanner.scanToken()) {
+        if (token.type != TOKEN_IMPORT)
+            continue;
+        token = scanner.scanToken();
+        if (token.type == TOKEN_IDENTIFIER) {
+            String name(token.start, token.length);
+            if (std::find(imports.begin(), imports.end(), name) == imports.end())
+                imports.push_back(name);
+        }
+        if (token.type == TOKEN_EOF)
+            break;
+    }
+    return imports;
+}
+
+/**
+ * @brief Add the globals declared at the top level of [source] to
+ * [globals], and the modules it imports to [imports]
+ *
+ * Declarations inside braces or parentheses are local, like the variable
+ * of a top-level for loop.
+ */
+static void scanDeclarations(const char *source, std::unordered_set<String> &globals, std::vector<String> &imports) {
+    Scanner scanner(source);
+    int depth = 0;
+    for (Token token = scanner.scanToken(); token.type != TOKEN_EOF; token = scanner.scanToken()) {
+        switch (token.type) {
+            case TOKEN_LEFT_BRACE:
+            case TOKEN_LEFT_PAREN:
+                depth++;
+                break;
+            case TOKEN_RIGHT_BRACE:
+            case TOKEN_RIGHT_PAREN:
+                depth--;
+                break;
+            case TOKEN_CLASS:
+            case TOKEN_FUN:
+            case TOKEN_VAR:
+            case TOKEN_IMPORT: {
+                TokenType declaration = token.type;
+                if (depth != 0)
+                    break;
+                token = scanner.scanToken();
+                if (token.type != TOKEN_IDENTIFIER)
+                    break;
+                String name(token.start, token.length);
+                if (declaration == TOKEN_IMPORT)
+                    imports.push_back(name);
+                else
+                    globals.insert(name);
+                break;
+            }
+            default:
+                break;
+        }
+    }
+}
+
+std::unordered_set<String> moduleDeclarations(const String &path) {
+    std::unordered_set<String> globals;
+    std::unordered_set<String> visited = {path};
+    std::vector<String> paths = {path};
+    while (!paths.empty()) {
+        std::string source;
+        std::vector<String> imports;
+        if (readModuleSource(paths.back(), &source))
+            scanDeclarations(source.c_str(), globals, imports);
+        paths.pop_back();
+        for (const String &name : imports) {
+            String importPath;
+            if (resolveModule(name, &importPath) && visited.insert(importPath).second)
+                paths.push_back(importPath);
+        }
+    }
+    return globals;
+}
+
+std::unordered_map<String, Function> compileImports(const char *source) {
+    std::unordered_map<String, Function> compiled;
+    std::vector<String> roots = resolveImports(source);
+    if (roots.empty())
+        return compiled;
+
+    std::mutex lock;
+    std::condition_variable changed;
+    std::deque<String> queue(roots.begin(), roots.end());
+    std::unordered_set<String> seen(roots.begin(), roots.end());
+    size_t busy = 0;
+
+    auto work = [&]() {
+        Compiler compiler;
+        // Errors are reported by the import that runs into them.
+        compiler.silenceErrors(true);
+
+        std::unique_lock<std::mutex> guard(lock);
+        for (;;) {
+            changed.wait(guard, [&] { return !queue.empty() || busy == 0; });
+            if (queue.empty())
+                return;
+            String path = queue.front();
+            queue.pop_front();
+            busy++;
+            guard.unlock();
+
+            std::string moduleText;
+            bool found = readModuleSource(path, &moduleText);
+            if (found) {
+                // Hand the dependencies out before compiling this module.
+                std::vector<String> imports = resolveImports(moduleText.c_str());
+                guard.lock();
+                for (const String &import : imports) {
+                    if (seen.insert(import).second)
+                        queue.push_back(import);
+                }
+                changed.notify_all();
+                guard.unlock();
+            }
+            Function function = found ? compiler.compile(moduleText.c_str(), std::make_shared<ObjModule>(path)) : nullptr;
+
+            guard.lock();
+            busy--;
+            if (function != nullptr)
+                compiled[path] = function;
+            changed.notify_all();
+        }
+    };
+
+    size_t threadCount = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < threadCount; i++) {
+        threads.emplace_back(work);
+    }
+    work();
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    return compiled;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "value.h"
+
+// Environment variable listing module directories, separated by ':'
+#define MODULE_PATH_VARIABLE "IZI_PATH"
+// Extension of module files
+#define MODULE_EXTENSION ".izi"
+// Path of the module compiled into the interpreter
+#define CORE_MODULE_PATH "<core>"
+
+/**
+ * @brief Look for modules in [directory] too
+ *
+ * Directories are tried in the order they are added, after the working
+ * directory and before those of IZI_PATH. Only call this before any VM
+ * runs.
+ */
+void addModuleSearchPath(const String &directory);
+
+/**
+ * @brief Canonical path of the file of module [name], false if none
+ *
+ * Resolved names are remembered, as the search does not depend on the
+ * importer.
+ */
+bool resolveModule(const String &name, String *path);
+
+/**
+ * @brief Read the module at canonical [path], false if it can't be read
+ *
+ */
+bool readModuleSource(const String &path, std::string *source);
+
+/**
+ * @brief Names of the modules [source] imports, in order of appearance
+ *
+ */
+std::vector<String> scanImports(const char *source);
+
+/**
+ * @brief Globals the module at canonical [path] declares at its top level,
+ * with those of the modules it imports
+ *
+ * Found by scanning tokens, so nothing is compiled or run.
+ */
+std::unordered_set<String> moduleDeclarations(const String &path);
+
+/**
+ * @brief Compile the modules reachable through the imports of [source]
+ *
+ * Imports are found ahead of execution and the modules are compiled in
+ * parallel, one Compiler per thread. Module bodies still run when their
+ * IMPORT executes. The result is keyed by canonical path. Modules that
+ * can't be found or don't compile are left out, so their import reports
+ * the error as before.
+ */
+std::unordered_map<String, Function> compileImports(const char *source);
@@ -0,0 +1,516 @@
+#include "io.h"
+
+#include "vm.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Bytes read() asks for when no size is given
+#define IO_READ_SIZE 4096
+#define IO_MAX_EVENTS 64
+
+EventLoop::EventLoop() {
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+}
+
+EventLoop::~EventLoop() {
+    if (epollFd >= 0)
+        close(epollFd);
+}
+
+/**
+ * @brief Queue [fiber] to run with [value] as transfer value
+ *
+ */
+void EventLoop::spawn(Fiber fiber, Value value) {
+    fiber->transfer = value;
+    ready.push_back(fiber);
+}
+
+void EventLoop::sleep(Fiber fiber, double seconds) {
+    auto delay = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+    timers.push(Timer{Clock::now() + delay, timerSequence++, fiber});
+}
+
+/**
+ * @brief Wake [fiber] up once [attempt] succeeds on [fd]
+ *
+ * Fails if another fiber already waits on [fd] or epoll refuses it, like
+ * regular files, which never block anyway.
+ */
+bool EventLoop::watch(Fiber fiber, int fd, bool writing, IoAttempt attempt) {
+    if (watchers.count(fd) != 0)
+        return false;
+
+    epoll_event event = {};
+    event.events = (writing ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+    event.data.fd = fd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0)
+        return false;
+
+    watchers[fd] = Watcher{fiber, writing, std::move(attempt)};
+    return true;
+}
+
+/**
+ * @brief Stop watching [fd] and wake the fiber waiting on it up with nil,
+ * before the descriptor is closed
+ *
+ */
+void EventLoop::cancel(int fd) {
+    auto it = watchers.find(fd);
+    if (it == watchers.end())
+        return;
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+    Fiber fiber = std::move(it->second.fiber);
+    watchers.erase(it);
+    spawn(fiber, NIL_VAL);
+}
+
+/**
+ * @brief FiberScheduler of the VM, blocks until a fiber can run
+ *
+ * A fiber that merely yielded goes back in the ready queue; null means no
+ * fiber is ready and none is waiting.
+ */
+Fiber EventLoop::schedule(Fiber suspended) {
+    if (suspended != nullptr && suspended->state == FIBER_SUSPENDED) {
+        suspended->transfer = NIL_VAL;
+        ready.push_back(suspended);
+    }
+
+    // Keep timers and descriptors moving while fibers keep yielding.
+    if (!ready.empty() && (!timers.empty() || !watchers.empty()))
+        poll(false);
+
+    for (;;) {
+        while (ready.empty()) {
+            if (timers.empty() && watchers.empty())
+                return nullptr;
+            poll(true);
+        }
+
+        Fiber next = ready.front();
+        ready.pop_front();
+        // It may have been resumed by hand since it was queued.
+        if (next->state != FIBER_DONE && next->state != FIBER_RUNNING)
+            return next;
+    }
+}
+
+/**
+ * @brief Move fibers whose timer expired or descriptor is ready to the
+ * ready queue
+ *
+ * @param block wait for the next event instead of only looking
+ */
+void EventLoop::poll(bool block) {
+    int timeout = 0;
+    if (block) {
+        timeout = -1;
+        if (!timers.empty()) {
+            auto wait = std::chrono::ceil<std::chrono::milliseconds>(timers.top().deadline - Clock::now());
+            timeout = wait.count() > 0 ? (int)wait.count() : 0;
+        }
+    }
+
+    epoll_event events[IO_MAX_EVENTS];
+    int count = epoll_wait(epollFd, events, IO_MAX_EVENTS, timeout);
+    for (int i = 0; i < count; i++) {
+        int fd = events[i].data.fd;
+        auto it = watchers.find(fd);
+        if (it == watchers.end())
+            continue;
+
+        Value result = NIL_VAL;
+        if (!it->second.attempt(result)) {
+            // Spurious wake up, wait again.
+            epoll_event event = {};
+            event.events = (it->second.writing ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+            event.data.fd = fd;
+            epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &event);
+            continue;
+        }
+
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        Fiber fiber = std::move(it->second.fiber);
+        watchers.erase(it);
+        spawn(fiber, result);
+    }
+
+    Clock::time_point now = Clock::now();
+    while (!timers.empty() && timers.top().deadline <= now) {
+        Fiber fiber = timers.top().fiber;
+        timers.pop();
+        spawn(fiber, NIL_VAL);
+    }
+}
+
+/**
+ * @brief Park the running fiber on the loop, its call returns the transfer
+ * value it is woken up with
+ *
+ */
+static Value waitOnLoop(VM *vm) {
+    vm->fiber->state = FIBER_WAITING;
+    vm->suspendFiber();
+    return NIL_VAL;
+}
+
+static Value waitOn(VM *vm, int fd, bool writing, IoAttempt attempt) {
+    if (!vm->eventLoop->watch(vm->fiber, fd, writing, std::move(attempt))) {
+        vm->runtimeError("Can't wait on descriptor %d.", fd);
+        return NIL_VAL;
+    }
+    return waitOnLoop(vm);
+}
+
+/**
+ * @brief Run [attempt] now and only suspend if [fd] is not ready
+ *
+ */
+static Value perform(VM *vm, int fd, bool writing, IoAttempt attempt) {
+    Value result = NIL_VAL;
+    if (attempt(result))
+        return result;
+    return waitOn(vm, fd, writing, std::move(attempt));
+}
+
+static bool wouldBlock() {
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+static bool descriptorArg(VM *vm, Value value, const char *native, int *fd) {
+    if (!IS_NUMBER(value)) {
+        vm->runtimeError("%s() expects a file descriptor.", native);
+        return false;
+    }
+    *fd = (int)AS_NUMBER(value);
+    return true;
+}
+
+/**
+ * @brief A port number is a loopback TCP address, a string is the path of
+ * a Unix socket
+ *
+ */
+static bool socketAddress(Value address, sockaddr_storage *storage, socklen_t *length) {
+    memset(storage, 0, sizeof(*storage));
+    if (IS_NUMBER(address)) {
+        sockaddr_in *in = (sockaddr_in *)storage;
+        in->sin_family = AF_INET;
+        in->sin_port = htons((uint16_t)AS_NUMBER(address));
+        in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        *length = sizeof(sockaddr_in);
+        return true;
+    }
+    if (IS_STRING(address)) {
+        sockaddr_un *un = (sockaddr_un *)storage;
+        std::string_view path = AS_STRING(address);
+        if (path.size() >= sizeof(un->sun_path))
+            return false;
+        un->sun_family = AF_UNIX;
+        memcpy(un->sun_path, path.data(), path.size());
+        *length = sizeof(sockaddr_un);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @brief sleep(seconds) suspends the running fiber
+ *
+ */
+static Value sleepNative(VM *vm, int argCount, Value *args) {
+    if (argCount != 1 || !IS_NUMBER(args[0])) {
+        vm->runtimeError("sleep() expects a number of seconds.");
+        return NIL_VAL;
+    }
+    vm->eventLoop->sleep(vm->fiber, AS_NUMBER(args[0]));
+    return waitOnLoop(vm);
+}
+
+/**
+ * @brief schedule(fiber or fn, value) runs it on the loop and returns the
+ * fiber
+ *
+ */
+static Value scheduleNative(VM *vm, int argCount, Value *args) {
+    if (argCount < 1 || argCount > 2 || !(IS_FIBER(args[0]) || IS_CLOSURE(args[0]))) {
+        vm->runtimeError("schedule() expects a fiber or a function and an optional value.");
+        return NIL_VAL;
+    }
+
+    Fiber fiber;
+    if (IS_FIBER(args[0])) {
+        fiber = AS_FIBER(args[0]);
+        if (fiber->state != FIBER_NEW && fiber->state != FIBER_SUSPENDED) {
+            vm->runtimeError("Can only schedule a new or suspended fiber.");
+            return NIL_VAL;
+        }
+    } else {
+        Closure closure = AS_CLOSURE(args[0]);
+        if (closure->function->arity > 1) {
+            vm->runtimeError("A fiber function takes at most one argument.");
+            return NIL_VAL;
+        }
+        fiber = std::make_shared<ObjFiber>(closure);
+    }
+    vm->eventLoop->spawn(fiber, argCount == 2 ? args[1] : NIL_VAL);
+    return FIBER_VAL(fiber);
+}
+
+/**
+ * @brief open(path, mode) returns a descriptor, mode is "r", "w" or "a"
+ *
+ */
+static Value openNative(VM *vm, int argCount, Value *args) {
+    if (argCount < 1 || argCount > 2 || !IS_STRING(args[0]) || (argCount == 2 && !IS_STRING(args[1]))) {
+        vm->runtimeError("open() expects a path and an optional mode.");
+        return NIL_VAL;
+    }
+
+    std::string_view mode = argCount == 2 ? AS_STRING(args[1]) : "r";
+    int flags;
+    if (mode == "r") {
+        flags = O_RDONLY;
+    } else if (mode == "w") {
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+    } else if (mode == "a") {
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+    } else {
+        vm->runtimeError("Unknown open() mode '%.*s'.", (int)mode.size(), mode.data());
+        return NIL_VAL;
+    }
+
+    std::string path(AS_STRING(args[0]));
+    int fd = open(path.c_str(), flags | O_NONBLOCK | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        vm->runtimeError("Can't open '%s': %s.", path.c_str(), strerror(errno));
+        return NIL_VAL;
+    }
+    return NUMBER_VAL((double)fd);
+}
+
+/**
+ * @brief read(fd, size) returns up to [size] bytes, "" at end of file and
+ * nil on error
+ *
+ */
+static Value readNative(VM *vm, int argCount, Value *args) {
+    int fd;
+    if (argCount < 1 || argCount > 2) {
+        vm->runtimeError("read() expects a descriptor and an optional size.");
+        return NIL_VAL;
+    }
+    if (!descriptorArg(vm, args[0], "read", &fd))
+        return NIL_VAL;
+
+    size_t size = argCount == 2 && IS_NUMBER(args[1]) ? (size_t)AS_NUMBER(args[1]) : IO_READ_SIZE;
+    return perform(vm, fd, false, [fd, size](Value &result) {
+        std::string buffer(size, '\0');
+        ssize_t count = read(fd, &buffer[0], size);
+        if (count < 0) {
+            if (wouldBlock())
+                return false;
+            result = NIL_VAL;
+            return true;
+        }
+        buffer.resize(count);
+        result = STRING_VAL(std::move(buffer));
+        return true;
+    });
+}
+
+/**
+ * @brief write(fd, string) returns the number of bytes written once all are,
+ * nil on error
+ *
+ */
+static Value writeNative(VM *vm, int argCount, Value *args) {
+    int fd;
+    if (argCount != 2) {
+        vm->runtimeError("write() expects a descriptor and a string.");
+        return NIL_VAL;
+    }
+    if (!descriptorArg(vm, args[0], "write", &fd))
+        return NIL_VAL;
+
+    std::string data = IS_STRING(args[1]) ? std::string(AS_STRING(args[1])) : toString(args[1]);
+    size_t written = 0;
+    bool socket = true;
+    return perform(vm, fd, true, [fd, data, written, socket](Value &result) mutable {
+        while (written < data.size()) {
+            // A closed peer fails the send instead of raising SIGPIPE, the
+            // signal is left to the host.
+            ssize_t count = -1;
+            if (socket) {
+                count = send(fd, data.data() + written, data.size() - written, MSG_NOSIGNAL);
+                socket = count >= 0 || errno != ENOTSOCK;
+            }
+            if (!socket)
+                count = write(fd, data.data() + written, data.size() - written);
+            if (count < 0) {
+                if (wouldBlock())
+                    return false;
+                result = NIL_VAL;
+                return true;
+            }
+            written += count;
+        }
+        result = NUMBER_VAL((double)written);
+        return true;
+    });
+}
+
+/**
+ * @brief close(fd) returns whether it succeeded, a fiber waiting on [fd]
+ * gets nil
+ *
+ */
+static Value closeNative(VM *vm, int argCount, Value *args) {
+    int fd;
+    if (argCount != 1 || !descriptorArg(vm, args[0], "close", &fd))
+        return NIL_VAL;
+    vm->eventLoop->cancel(fd);
+    return BOOL_VAL(close(fd) == 0);
+}
+
+/**
+ * @brief listen(port or path) returns a listening socket
+ *
+ */
+static Value listenNative(VM *vm, int argCount, Value *args) {
+    sockaddr_storage address;
+    socklen_t length;
+    if (argCount != 1 || !socketAddress(args[0], &address, &length)) {
+        vm->runtimeError("listen() expects a port or a socket path.");
+        return NIL_VAL;
+    }
+
+    int fd = socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && address.ss_family == AF_INET) {
+        int reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    }
+    if (fd < 0 || bind(fd, (sockaddr *)&address, length) < 0 || listen(fd, SOMAXCONN) < 0) {
+        vm->runtimeError("Can't listen: %s.", strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return NIL_VAL;
+    }
+    return NUMBER_VAL((double)fd);
+}
+
+/**
+ * @brief accept(socket) returns the descriptor of the next connection
+ *
+ */
+static Value acceptNative(VM *vm, int argCount, Value *args) {
+    int fd;
+    if (argCount != 1 || !descriptorArg(vm, args[0], "accept", &fd))
+        return NIL_VAL;
+
+    return perform(vm, fd, false, [fd](Value &result) {
+        int client = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client < 0) {
+            if (wouldBlock())
+                return false;
+            result = NIL_VAL;
+            return true;
+        }
+        result = NUMBER_VAL((double)client);
+        return true;
+    });
+}
+
+/**
+ * @brief connect(port or path) returns a connected socket, nil if the
+ * connection failed
+ *
+ */
+static Value connectNative(VM *vm, int argCount, Value *args) {
+    sockaddr_storage address;
+    socklen_t length;
+    if (argCount != 1 || !socketAddress(args[0], &address, &length)) {
+        vm->runtimeError("connect() expects a port or a socket path.");
+        return NIL_VAL;
+    }
+
+    int fd = socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        vm->runtimeError("Can't create socket: %s.", strerror(errno));
+        return NIL_VAL;
+    }
+    if (connect(fd, (sockaddr *)&address, length) == 0)
+        return NUMBER_VAL((double)fd);
+    if (errno != EINPROGRESS && !wouldBlock()) {
+        close(fd);
+        return NIL_VAL;
+    }
+
+    // Writable once the connection is established or failed.
+    return waitOn(vm, fd, true, [fd](Value &result) {
+        int error = 0;
+        socklen_t size = sizeof(error);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &size);
+        if (error != 0) {
+            close(fd);
+            result = NIL_VAL;
+        } else {
+            result = NUMBER_VAL((double)fd);
+        }
+        return true;
+    });
+}
+
+/**
+ * @brief Pipe() has a [reader] and a [writer] descriptor
+ *
+ */
+static Value pipeNew(VM *vm, Value receiver, int argCount, Value *args) {
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        vm->runtimeError("Can't create pipe: %s.", strerror(errno));
+        return NIL_VAL;
+    }
+    AS_INSTANCE(receiver)->fields["reader"] = NUMBER_VAL((double)fds[0]);
+    AS_INSTANCE(receiver)->fields["writer"] = NUMBER_VAL((double)fds[1]);
+    return receiver;
+}
+
+void defineIo(VM *vm) {
+    if (vm->eventLoop == nullptr)
+        vm->eventLoop = std::make_shared<EventLoop>();
+    vm->scheduler = [](VM *vm, Fiber suspended) {
+        return vm->eventLoop->schedule(suspended);
+    };
+
+    vm->defineNative("sleep", sleepNative);
+    vm->defineNative("schedule", scheduleNative);
+    vm->defineNative("open", openNative);
+    vm->defineNative("read", readNative);
+    vm->defineNative("write", writeNative);
+    vm->defineNative("close", closeNative);
+    vm->defineNative("listen", listenNative);
+    vm->defineNative("accept", acceptNative);
+    vm->defineNative("connect", connectNative);
+
+    Value pipe = vm->defineBuiltinClass("Pipe", CLS_FILE);
+    vm->defineNativeMethod(pipe, pipeNew, "new", 0, false);
+}
+
+#else
+
+void defineIo(VM *vm) {
+}
+
+#endif
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
+#include "value.h"
+
+struct VM;
+
+/**
+ * @brief Attempt at a non-blocking operation
+ *
+ * Returns false when the descriptor is not ready yet, otherwise stores
+ * what the waiting fiber receives in [result].
+ */
+using IoAttempt = std::function<bool(Value &result)>;
+
+/**
+ * @brief Scheduler running fibers that wait on timers and descriptors
+ *
+ * A fiber waiting on the loop is FIBER_WAITING and gets the result of its
+ * operation as transfer value when it is woken up. Readiness comes from
+ * epoll, so the loop only exists on Linux.
+ */
+struct EventLoop {
+    using Clock = std::chrono::steady_clock;
+
+    struct Timer {
+        Clock::time_point deadline;
+        //! Keeps timers with the same deadline in order
+        uint64_t sequence;
+        Fiber fiber;
+        bool operator>(const Timer &other) const {
+            return deadline != other.deadline ? deadline > other.deadline : sequence > other.sequence;
+        }
+    };
+
+    struct Watcher {
+        Fiber fiber;
+        bool writing;
+        IoAttempt attempt;
+    };
+
+    int epollFd;
+    std::deque<Fiber> ready;
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers;
+    uint64_t timerSequence = 0;
+    //! Fiber waiting on each descriptor, one at a time
+    std::unordered_map<int, Watcher> watchers;
+
+    EventLoop();
+    ~EventLoop();
+    void spawn(Fiber fiber, Value value);
+    void sleep(Fiber fiber, double seconds);
+    bool watch(Fiber fiber, int fd, bool writing, IoAttempt attempt);
+    void cancel(int fd);
+    Fiber schedule(Fiber suspended);
+    void poll(bool block);
+};
+
+/**
+ * @brief Register the event loop and its I/O natives
+ *
+ * Writes to sockets never raise SIGPIPE. One to a pipe whose reader is
+ * closed still does: the process keeps its own handling, izi ignores it in
+ * main() and a host embedding a VM decides for itself.
+ * @param vm the VM whose fibers the loop schedules
+ */
+void defineIo(VM *vm);
@@ -0,0 +1,592 @@
+#include "jit.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "chunk.h"
+#include "profile.h"
+#include "vm.h"
+
+#ifdef JIT_SUPPORTED
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+static bool jitEnabled = true;
+
+void useJit(bool enabled) {
+    jitEnabled = enabled;
+}
+
+bool usesJit() {
+    return jitEnabled;
+}
+
+JitCode::~JitCode() {
+#ifdef JIT_SUPPORTED
+    if (memory != nullptr)
+        munmap(memory, size);
+#endif
+}
+
+JitStatus JitCode::run(VM *vm, CallFrame *frame) {
+    const uint8_t *entry = (size_t)frame->index < entries.size() ? entries[frame->index] : nullptr;
+    if (entry == nullptr)
+        return JIT_INTERPRET;
+    // The code starts with the prologue taking the instruction to jump to.
+    auto code = reinterpret_cast<JitStatus (*)(VM *, CallFrame *, const uint8_t *)>(memory);
+    return code(vm, frame, entry);
+}
+
+#ifdef JIT_SUPPORTED
+
+/**
+ * @brief Work of one instruction, called by its template
+ *
+ * [a] is the operand or the address of what it names, [b] the offset of
+ * the next instruction, stored in frame->index by handlers that may report
+ * an error or leave the frame.
+ */
+using Handler = uint32_t (*)(VM *vm, CallFrame *frame, uintptr_t a, uint32_t b);
+
+#define PUSH(value) (*vm->stackTop++ = (value))
+#define PEEK(distance) (vm->stackTop[-1 - (distance)])
+
+static uint32_t opConstant(VM *vm, CallFrame *, uintptr_t a, uint32_t) {
+    PUSH(*(const Value *)a);
+    return JIT_CONTINUE;
+}
+
+static uint32_t opNil(VM *vm, CallFrame *, uintptr_t, uint32_t) {
+    PUSH(NIL_VAL);
+    return JIT_CONTINUE;
+}
+
+static uint32_t opTrue(VM *vm, CallFrame *, uintptr_t, uint32_t) {
+    PUSH(BOOL_VAL(true));
+    return JIT_CONTINUE;
+}
+
+static uint32_t opFalse(VM *vm, CallFrame *, uintptr_t, uint32_t) {
+    PUSH(BOOL_VAL(false));
+    return JIT_CONTINUE;
+}
+
+static uint32_t opPop(VM *vm, CallFrame *, uintptr_t, uint32_t) {
+    vm->stackTop--;
+    return JIT_CONTINUE;
+}
+
+static uint32_t opDup(VM *vm, CallFrame *, uintptr_t, uint32_t) {
+    Value value = PEEK(0);
+    PUSH(value);
+    return JIT_CONTINUE;
+}
+
+static uint32_t opGetLocal(VM *vm, CallFrame *frame, uintptr_t a, uint32_t) {
+    PUSH(frame->slots[a]);
+    return JIT_CONTINUE;
+}
+
+static uint32_t opSetLocal(VM *vm, CallFrame *frame, uintptr_t a, uint32_t) {
+    frame->slots[a] = PEEK(0);
+    return JIT_CONTINUE;
+}
+
+// A missing global may be declared by a lazily imported module, the stack
+// loop runs the instruction to load it.
+static uint32_t opGetGlobal(VM *vm, CallFrame *frame, uintptr_t a, uint32_t b) {
+    auto it = vm->globals.find(String(AS_STRING(*(const Value *)a)));
+    if (it == vm->globals.end()) {
+        frame->index = b - 2;
+        return JIT_INTERPRET;
+    }
+    PUSH(it->second);
+    return JIT_CONTINUE;
+}
+
+static uint32_t opDefineGlobal(VM *vm, CallFrame *, uintptr_t a, uint32_t) {
+    vm->globals[String(AS_STRING(*(const Value *)a))] = PEEK(0);
+    vm->globalsVersion++;
+    vm->stackTop--;
+    return JIT_CONTINUE;
+}
+
+static uint32_t opSetGlobal(VM *vm, CallFrame *frame, uintptr_t a, uint32_t b) {
+    auto it = vm->globals.find(String(AS_STRING(*(const Value *)a)));
+    if (it == vm->globals.end()) {
+        frame->index = b - 2;
+        return JIT_INTERPRET;
+    }
+    it->second = PEEK(0);
+    vm->globalsVersion++;
+    return JIT_CONTINUE;
+}
+
+static uint32_t opGetUpvalue(VM *vm, CallFrame *frame, uintptr_t a, uint32_t) {
+    PUSH(*frame->closure->upvalues[a]->location);
+    return JIT_CONTINUE;
+}
+
+static uint32_t opSetUpvalue(VM *vm, CallFrame *frame, uintptr_t a, uint32_t) {
+    *frame->closure->upvalues[a]->location = PEEK(0);
+    return JIT_CONTINUE;
+}
+
+static uint32_t opGetProperty(VM *vm, CallFrame *frame, uintptr_t a, uint32_t b) {
+    frame->index = b;
+    if (!IS_INSTANCE(PEEK(0))) {
+        vm->runtimeError("Only instances have properties.");
+        return JIT_ERROR;
+    }
+    Instance instance = AS_INSTANCE(PEEK(0));
+    String name(AS_STRING(*(const Value *)a));
+
+    auto it = instance->fields.find(name);
+    if (it != instance->fields.end()) {
+        PEEK(0) = it->second;
+        return JIT_CONTINUE;
+    }
+    return vm->bindMethod(instance->klass, name) ? JIT_CONTINUE : JIT_ERROR;
+}
+
+static uint32_t opSetProperty(VM *vm, CallFrame *frame, uintptr_t a, uint32_t b) {
+    frame->index = b;
+    if (!IS_INSTANCE(PEEK(1))) {
+        vm->runtimeError("Only instances have fields.");
+        return JIT_ERROR;
+    }
+    Instance instance = AS_INSTANCE(PEEK(1));
+    if (instance->frozen) {
+        vm->runtimeError("Can't set a field of a frozen instance.");
+        return JIT_ERROR;
+    }
+    instance->fields[String(AS_STRING(*(const Value *)a))] = PEEK(0);
+    Value value = PEEK(0);
+    vm->stackTop--;
+    PEEK(0) = value;
+    return JIT_CONTINUE;
+}
+
+static uint32_t opEqual(VM *vm, CallFrame *, uintptr_t, uint32_t) {
+    bool equal = valuesEqual(PEEK(1), PEEK(0));
+    vm->stackTop--;
+    PEEK(0) = BOOL_VAL(equal);
+    return JIT_CONTINUE;
+}
+
+#define BINARY_OP(name, valueType, op)                                \
+    static uint32_t name(VM *vm, CallFrame *frame, uintptr_t, uint32_t b) { \
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {             \
+            frame->index = b;                                         \
+            vm->runtimeError("Operands must be numbers.");            \
+            return JIT_ERROR;                                         \
+        }                                                             \
+        double right = AS_NUMBER(PEEK(0));                            \
+        double left = AS_NUMBER(PEEK(1));                             \
+        vm->stackTop--;                                               \
+        PEEK(0) = valueType(left op right);                           \
+        return JIT_CONTINUE;                                          \
+    }
+
+BINARY_OP(opGreater, BOOL_VAL, >)
+BINARY_OP(opLess, BOOL_VAL, <)
+BINARY_OP(opSubtract, NUMBER_VAL, -)
+BINARY_OP(opMultiply, NUMBER_VAL, *)
+BINARY_OP(opDivide, NUMBER_VAL, /)
+
+#undef BINARY_OP
+
+static uint32_t opAdd(VM *vm, CallFrame *frame, uintptr_t, uint32_t b) {
+    if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+        double right = AS_NUMBER(PEEK(0));
+        double left = AS_NUMBER(PEEK(1));
+        vm->stackTop--;
+        PEEK(0) = NUMBER_VAL(left + right);
+    } else if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) {
+        Value right = PEEK(0);
+        vm->stackTop--;
+        PEEK(0) = Value{VAL_STRING, concatStrings(AS_STR(PEEK(0)), AS_STR(right))};
+    } else {
+        frame->index = b;
+        vm->runtimeError("Operands must be two numbers or two strings.");
+        return JIT_ERROR;
+    }
+    return JIT_CONTINUE;
+}
+
+static uint32_t opNot(VM *vm, CallFrame *, uintptr_t, uint32_t) {
+    PEEK(0) = BOOL_VAL(isFalsey(PEEK(0)));
+    return JIT_CONTINUE;
+}
+
+static uint32_t opNegate(VM *vm, CallFrame *frame, uintptr_t, uint32_t b) {
+    if (!IS_NUMBER(PEEK(0))) {
+        frame->index = b;
+        vm->runtimeError("Operand must be a number.");
+        return JIT_ERROR;
+    }
+    PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+    return JIT_CONTINUE;
+}
+
+static uint32_t opPrint(VM *vm, CallFrame *, uintptr_t, uint32_t) {
+    printValue(*--vm->stackTop);
+    printf("\n");
+    return JIT_CONTINUE;
+}
+
+// Conditions of branches: a non-zero result takes the jump.
+static uint32_t opIsFalsey(VM *vm, CallFrame *, uintptr_t, uint32_t) {
+    return isFalsey(PEEK(0));
+}
+
+static uint32_t opIterNext(VM *vm, CallFrame *frame, uintptr_t a, uint32_t) {
+    Value *seq = &frame->slots[a];
+    Value *state = seq + 1;
+    double index = AS_NUMBER(*state);
+    if (seq->type == VAL_RANGE) {
+        if (index >= AS_RANGE(*seq)->to)
+            return true;
+        PUSH(NUMBER_VAL(index));
+    } else {
+        std::string_view chars = AS_STRING(*seq);
+        if (index >= chars.size())
+            return true;
+        PUSH(STRING_VAL(chars.substr((size_t)index, 1)));
+    }
+    *state = NUMBER_VAL(index + 1);
+    return false;
+}
+
+// Back-edges are where a long running function is sampled.
+static uint32_t opLoop(VM *vm, CallFrame *frame, uintptr_t, uint32_t b) {
+    if (vm->profiler != nullptr && Profiler::due.load(std::memory_order_relaxed)) {
+        Profiler::due = false;
+        frame->index = b;
+        vm->profiler->sample(vm);
+    }
+    return JIT_CONTINUE;
+}
+
+static uint32_t opCall(VM *vm, CallFrame *frame, uintptr_t a, uint32_t b) {
+    frame->index = b;
+    if (!vm->callValue(PEEK(a), (int)a))
+        return JIT_ERROR;
+    return JIT_FRAME;
+}
+
+static uint32_t opTailCall(VM *vm, CallFrame *frame, uintptr_t a, uint32_t b) {
+    int argCount = (int)a;
+    frame->index = b;
+    Value callee = PEEK(argCount);
+    if (IS_BOUND_METHOD(callee) && IS_CLOSURE(AS_BOUND_METHOD(callee)->method)) {
+        BoundMethod bound = AS_BOUND_METHOD(callee);
+        PEEK(argCount) = bound->receiver;
+        callee = bound->method;
+    }
+    if (!IS_CLOSURE(callee) || frame->discardResult)
+        return vm->callValue(callee, argCount) ? JIT_FRAME : JIT_ERROR;
+
+    vm->closeUpvalues(frame->slots);
+    std::copy(vm->stackTop - argCount - 1, vm->stackTop, frame->slots);
+    vm->stackTop = frame->slots + argCount + 1;
+    vm->frameCount--;
+    return vm->call(AS_CLOSURE(callee), argCount) ? JIT_FRAME : JIT_ERROR;
+}
+
+static uint32_t opClosure(VM *vm, CallFrame *frame, uintptr_t a, uint32_t b) {
+    const uint8_t *operands = (const uint8_t *)a;
+    Function function = AS_FUNCTION(frame->closure->function->chunk->constants[operands[0]]);
+    Closure closure = std::make_shared<ObjClosure>(function);
+    PUSH(CLOSURE_VAL(closure));
+    for (int i = 0; i < closure->upvalueCount; i++) {
+        uint8_t isLocal = operands[1 + 2 * i];
+        uint8_t index = operands[2 + 2 * i];
+        if (isLocal) {
+            closure->upvalues[i] = vm->captureUpvalue(frame->slots + index);
+        } else {
+            closure->upvalues[i] = frame->closure->upvalues[index];
+        }
+    }
+    return JIT_CONTINUE;
+}
+
+static uint32_t opCloseUpvalue(VM *vm, CallFrame *, uintptr_t, uint32_t) {
+    vm->closeUpvalues(vm->stackTop - 1);
+    vm->stackTop--;
+    return JIT_CONTINUE;
+}
+
+// Returning from the last frame finishes the fiber, left to the stack loop.
+static uint32_t opReturn(VM *vm, CallFrame *frame, uintptr_t, uint32_t b) {
+    if (vm->frameCount == 1) {
+        frame->index = b - 1;
+        return JIT_INTERPRET;
+    }
+    Value result = PEEK(0);
+    vm->closeUpvalues(frame->slots);
+    vm->frameCount--;
+    vm->stackTop = frame->slots;
+    if (!frame->discardResult)
+        PUSH(result);
+    return JIT_FRAME;
+}
+
+static uint32_t opRange(VM *vm, CallFrame *frame, uintptr_t, uint32_t b) {
+    if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+        frame->index = b;
+        vm->runtimeError("Range bounds must be numbers.");
+        return JIT_ERROR;
+    }
+    double to = AS_NUMBER(PEEK(0));
+    double from = AS_NUMBER(PEEK(1));
+    vm->stackTop--;
+    PEEK(0) = RANGE_VAL(std::make_shared<ObjRange>(from, to));
+    return JIT_CONTINUE;
+}
+
+static uint32_t opIterInit(VM *vm, CallFrame *frame, uintptr_t, uint32_t b) {
+    Value seq = PEEK(0);
+    if (IS_RANGE(seq)) {
+        PUSH(NUMBER_VAL(AS_RANGE(seq)->from));
+    } else if (IS_STRING(seq)) {
+        PUSH(NUMBER_VAL(0.0));
+    } else {
+        frame->index = b;
+        vm->runtimeError("Can only iterate over ranges and strings.");
+        return JIT_ERROR;
+    }
+    return JIT_CONTINUE;
+}
+
+// Instructions without a template run on the stack loop, which comes
+// back at the next call, return or back-edge.
+static uint32_t opInterpret(VM *, CallFrame *frame, uintptr_t a, uint32_t) {
+    frame->index = (int)a;
+    return JIT_INTERPRET;
+}
+
+#undef PUSH
+#undef PEEK
+
+/**
+ * @brief x86-64 code of the templates, in the order they are copied
+ *
+ * The prologue keeps the VM in rbx and the frame in r12, both preserved
+ * by the handlers, and jumps to the instruction given as third argument.
+ * Handlers get the System V arguments rdi, rsi, rdx, rcx.
+ */
+struct Assembler {
+    std::vector<uint8_t> code;
+    //! Offset of the shared exit, returning the status in eax
+    size_t exit = 0;
+
+    void bytes(std::initializer_list<uint8_t> values) {
+        code.insert(code.end(), values);
+    }
+
+    void imm32(uint32_t value) {
+        for (int i = 0; i < 4; i++)
+            code.push_back((uint8_t)(value >> (8 * i)));
+    }
+
+    void imm64(uint64_t value) {
+        for (int i = 0; i < 8; i++)
+            code.push_back((uint8_t)(value >> (8 * i)));
+    }
+
+    void prologue() {
+        bytes({0x53});              // push rbx
+        bytes({0x41, 0x54});        // push r12
+        bytes({0x41, 0x55});        // push r13, keeps rsp 16-byte aligned
+        bytes({0x48, 0x89, 0xfb});  // mov rbx, rdi
+        bytes({0x49, 0x89, 0xf4});  // mov r12, rsi
+        bytes({0xff, 0xe2});        // jmp rdx
+        exit = code.size();
+        bytes({0x41, 0x5d});  // pop r13
+        bytes({0x41, 0x5c});  // pop r12
+        bytes({0x5b});        // pop rbx
+        bytes({0xc3});        // ret
+    }
+
+    void call(Handler handler, uintptr_t a, uint32_t b) {
+        bytes({0x48, 0x89, 0xdf});  // mov rdi, rbx
+        bytes({0x4c, 0x89, 0xe6});  // mov rsi, r12
+        if (a <= UINT32_MAX) {
+            bytes({0xba});  // mov edx, imm32
+            imm32((uint32_t)a);
+        } else {
+            bytes({0x48, 0xba});  // mov rdx, imm64
+            imm64(a);
+        }
+        bytes({0xb9});  // mov ecx, imm32
+        imm32(b);
+        bytes({0x48, 0xb8});  // mov rax, imm64
+        imm64((uint64_t)handler);
+        bytes({0xff, 0xd0});  // call rax
+        bytes({0x85, 0xc0});  // test eax, eax
+    }
+
+    //! Jump taken when eax isn't zero, returns where to patch the target
+    size_t jumpIfNonZero() {
+        bytes({0x0f, 0x85});  // jnz rel32
+        imm32(0);
+        return code.size() - 4;
+    }
+
+    size_t jump() {
+        bytes({0xe9});  // jmp rel32
+        imm32(0);
+        return code.size() - 4;
+    }
+
+    void patch(size_t at, size_t target) {
+        int32_t distance = (int32_t)((int64_t)target - (int64_t)(at + 4));
+        memcpy(&code[at], &distance, 4);
+    }
+
+    //! Run [handler], leaving with its status unless it is JIT_CONTINUE
+    void instruction(Handler handler, uintptr_t a, uint32_t b) {
+        call(handler, a, b);
+        patch(jumpIfNonZero(), exit);
+    }
+};
+
+bool compileJit(ObjFunction *function) {
+    if (!jitEnabled || function->jit != nullptr || function->registers != nullptr || function->chunk->frozen)
+        return false;
+
+    Chunk *chunk = function->chunk;
+    const uint8_t *code = chunk->code.data();
+    const Value *constants = chunk->constants.data();
+    size_t size = chunk->code.size();
+
+    Assembler assembler;
+    assembler.prologue();
+    std::vector<size_t> offsets(size + 1, SIZE_MAX);
+    // Position of each rel32 to patch, with the bytecode offset it goes to
+    std::vector<std::pair<size_t, size_t>> jumps;
+
+    for (size_t offset = 0; offset < size;) {
+        offsets[offset] = assembler.code.size();
+        uint8_t instruction = code[offset];
+        size_t next = offset + instructionLength(*chunk, offset);
+        if (next == offset)
+            return false;
+        // Templates of the instructions with a one byte operand
+        auto withByte = [&](Handler handler) {
+            assembler.instruction(handler, code[offset + 1], next);
+        };
+        auto withConstant = [&](Handler handler) {
+            assembler.instruction(handler, (uintptr_t)&constants[code[offset + 1]], next);
+        };
+        switch (instruction) {
+            case CONSTANT: withConstant(opConstant); break;
+            case NIL: assembler.instruction(opNil, 0, next); break;
+            case TRUE: assembler.instruction(opTrue, 0, next); break;
+            case FALSE: assembler.instruction(opFalse, 0, next); break;
+            case POP: assembler.instruction(opPop, 0, next); break;
+            case DUP: assembler.instruction(opDup, 0, next); break;
+            case GET_LOCAL: withByte(opGetLocal); break;
+            case SET_LOCAL: withByte(opSetLocal); break;
+            case GET_GLOBAL: withConstant(opGetGlobal); break;
+            case DEFINE_GLOBAL: withConstant(opDefineGlobal); break;
+            case SET_GLOBAL: withConstant(opSetGlobal); break;
+            case GET_UPVALUE: withByte(opGetUpvalue); break;
+            case SET_UPVALUE: withByte(opSetUpvalue); break;
+            case GET_PROPERTY: withConstant(opGetProperty); break;
+            case SET_PROPERTY: withConstant(opSetProperty); break;
+            case EQUAL: assembler.instruction(opEqual, 0, next); break;
+            case GREATER:
+            case GREATER_NUM: assembler.instruction(opGreater, 0, next); break;
+            case LESS:
+            case LESS_NUM: assembler.instruction(opLess, 0, next); break;
+            case ADD:
+            case ADD_NUM: assembler.instruction(opAdd, 0, next); break;
+            case SUBTRACT:
+            case SUBTRACT_NUM: assembler.instruction(opSubtract, 0, next); break;
+            case MULTIPLY:
+            case MULTIPLY_NUM: assembler.instruction(opMultiply, 0, next); break;
+            case DIVIDE:
+            case DIVIDE_NUM: assembler.instruction(opDivide, 0, next); break;
+            case NOT: assembler.instruction(opNot, 0, next); break;
+            case NEGATE: assembler.instruction(opNegate, 0, next); break;
+            case PRINT: assembler.instruction(opPrint, 0, next); break;
+            case JUMP:
+            case JUMP_IF_FALSE:
+            case LOOP: {
+                uint16_t distance = (uint16_t)((code[offset + 1] << 8) | code[offset + 2]);
+                size_t target = instruction == LOOP ? next - distance : next + distance;
+                if (instruction == JUMP_IF_FALSE) {
+                    assembler.call(opIsFalsey, 0, next);
+                    jumps.emplace_back(assembler.jumpIfNonZero(), target);
+                    break;
+                }
+                if (instruction == LOOP)
+                    assembler.instruction(opLoop, 0, next);
+                jumps.emplace_back(assembler.jump(), target);
+                break;
+            }
+            case ITER_NEXT: {
+                uint16_t distance = (uint16_t)((code[offset + 2] << 8) | code[offset + 3]);
+                assembler.call(opIterNext, code[offset + 1], next);
+                jumps.emplace_back(assembler.jumpIfNonZero(), next + distance);
+                break;
+            }
+            case CALL: withByte(opCall); break;
+            case TAIL_CALL: withByte(opTailCall); break;
+            case CLOSURE: assembler.instruction(opClosure, (uintptr_t)&code[offset + 1], next); break;
+            case CLOSE_UPVALUE: assembler.instruction(opCloseUpvalue, 0, next); break;
+            case RETURN: assembler.instruction(opReturn, 0, next); break;
+            case RANGE: assembler.instruction(opRange, 0, next); break;
+            case ITER_INIT: assembler.instruction(opIterInit, 0, next); break;
+            case CLASS:
+            case METHOD:
+            case GET_SUPER:
+            case IMPORT:
+            case INHERIT: assembler.instruction(opInterpret, offset, next); break;
+            default:
+                return false;
+        }
+        offset = next;
+    }
+
+    for (auto &[at, target] : jumps) {
+        if (target >= size || offsets[target] == SIZE_MAX)
+            return false;
+        assembler.patch(at, offsets[target]);
+    }
+
+    // Written then made executable, never both.
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t length = (assembler.code.size() + page - 1) / page * page;
+    void *memory = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        return false;
+    memcpy(memory, assembler.code.data(), assembler.code.size());
+    if (mprotect(memory, length, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, length);
+        return false;
+    }
+
+    JitCode *jit = new JitCode();
+    jit->memory = (uint8_t *)memory;
+    jit->size = length;
+    jit->entries.assign(size, nullptr);
+    for (size_t offset = 0; offset < size; offset++) {
+        if (offsets[offset] != SIZE_MAX)
+            jit->entries[offset] = jit->memory + offsets[offset];
+    }
+    function->jit = jit;
+    return true;
+}
+
+#else
+
+bool compileJit(ObjFunction *) {
+    return false;
+}
+
+#endif
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "value.h"
+
+// Calls of a function before it is compiled to machine code
+#define JIT_THRESHOLD 64
+// Times a LOOP jumps back before its function is compiled mid-loop, see
+// VM::takeBackEdge(). Counted in the chunk's feedback bytes.
+#define OSR_THRESHOLD 100
+
+// Machine code is only generated for x86-64 Linux. Opstats builds keep
+// every instruction on the dispatch loops that count them.
+#if defined(__x86_64__) && defined(__linux__) && !defined(OPSTATS)
+#define JIT_SUPPORTED
+#endif
+
+struct CallFrame;
+
+/**
+ * @brief Status the machine code of a function returns to VM::runJit()
+ *
+ */
+enum JitStatus : uint32_t {
+    //! Only between the templates, go on with the next instruction
+    JIT_CONTINUE,
+    //! A call or a return changed the frame on top
+    JIT_FRAME,
+    //! The instruction at frame->index runs on the stack loop
+    JIT_INTERPRET,
+    //! A runtime error was reported
+    JIT_ERROR,
+};
+
+/**
+ * @brief Machine code of a function, see compileJit()
+ *
+ * Every instruction of the chunk is a copy of the template for its
+ * opcode: operands are patched in as immediates and the template calls the
+ * handler doing the work of the instruction, jumps go straight to the
+ * code of their target.
+ */
+struct JitCode {
+    //! Executable mapping holding the code
+    uint8_t *memory = nullptr;
+    size_t size = 0;
+    //! Code of the instruction starting at each offset of the chunk, null
+    //! inside operands
+    std::vector<const uint8_t *> entries;
+
+    ~JitCode();
+    /**
+     * @brief Run [frame] from frame->index until a template returns
+     * something else than JIT_CONTINUE
+     *
+     */
+    JitStatus run(VM *vm, CallFrame *frame);
+};
+
+/**
+ * @brief Compile functions called JIT_THRESHOLD times or looping
+ * OSR_THRESHOLD times from now on, on by default where JIT_SUPPORTED;
+ * --no-jit turns it off
+ *
+ */
+void useJit(bool enabled);
+bool usesJit();
+
+/**
+ * @brief Give [function] machine code
+ *
+ * Instructions without a template (classes, super and imports) hand
+ * themselves to the stack loop. Functions with register code and frozen
+ * chunks shared between threads keep running on the dispatch loops.
+ */
+bool compileJit(ObjFunction *function);
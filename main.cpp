@@ -1,15 +1,95 @@
+#include <atomic>
+#include <csignal>
+#include <cstring>
+#include <mutex>
+#include <string>
 #include <iostream>
+#include <thread>
+#include <vector>
 
 #include "chunk.h"
 #include "debug.h"
+#include "imports.h"
+#include "optimize.h"
+#include "profile.h"
+#include "program.h"
+#include "snapshot.h"
 #include "vm.h"
 
+//! Set by --lazy-imports
+static bool lazyImports = false;
+//! Attached to every VM when --profile is given
+static Profiler* profiler = nullptr;
+static const char* profilePath = NULL;
+
+//! Written once the script ran, set by --snapshot
+static const char* snapshotPath = NULL;
+//! Snapshot every VM starts from, set by --restore
+static const char* restorePath = NULL;
+static std::string snapshot;
+
+//! Set by --opstats
+static bool printOpStats = false;
+//! Set by --memstats
+static bool printMemStats = false;
+#ifdef OPSTATS
+//! Counts of every VM that ran
+static OpStats opStats;
+static std::mutex opStatsLock;
+#endif
+
+/**
+ * @brief Add the instruction counts of [vm] to those printed at exit
+ *
+ */
+static void collectOpStats(VM& vm) {
+#ifdef OPSTATS
+    if (!printOpStats) return;
+    std::lock_guard<std::mutex> guard(opStatsLock);
+    vm.opStats.quickened = vm.quickenedSites;
+    vm.opStats.dequickened = vm.dequickenedSites;
+    opStats.merge(vm.opStats);
+#endif
+}
+
+/**
+ * @brief Print the counts asked for on the command line
+ *
+ */
+static void writeStats() {
+#ifdef OPSTATS
+    if (printOpStats) opStats.write(stderr);
+#endif
+    if (printMemStats) writeHeapStats(stderr);
+}
+
+/**
+ * @brief Stop the profiler and write its samples
+ *
+ */
+static void writeProfile() {
+    if (profiler == nullptr) return;
+    profiler->stop();
+    if (!profiler->write(profilePath))
+        fprintf(stderr, "Could not write profile \"%s\".\n", profilePath);
+}
+
+/**
+ * @brief Give [vm] the state saved in the snapshot given with --restore
+ *
+ */
+static bool restoreState(VM& vm) {
+    return restorePath == NULL || restoreSnapshot(&vm, snapshot);
+}
+
 /**
  * @brief init the VM and expose cmd line interpreter
  * 
  */
 static void repl() {
     VM vm;
+    vm.lazyImports = lazyImports;
+    if (!restoreState(vm)) exit(65);
     char line[1024];
     for (;;) {
         printf("> ");
@@ -50,14 +130,50 @@ static char* readFile2(const char* path) {
 }
 static void runFile(const char* path) {
     VM vm;
+    vm.lazyImports = lazyImports;
+    vm.profiler = profiler;
+    if (!restoreState(vm)) exit(65);
     char* source = readFile(path);
     InterpretResult result = vm.interpret(source);
     free(source);
+    if (result == INTERPRET_OK && snapshotPath != NULL && !saveSnapshot(&vm, snapshotPath)) exit(74);
+    writeProfile();
+    collectOpStats(vm);
+    writeStats();
 
     if (result == INTERPRET_COMPILE_ERROR) exit(65);
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+/**
+ * @brief Compile the file once and run it in [workers] VMs, one per thread
+ *
+ */
+static void runShared(const char* path, int workers) {
+    char* source = readFile(path);
+    std::shared_ptr<Program> program = std::make_shared<Program>();
+    bool compiled = program->compile(source);
+    free(source);
+    if (!compiled) exit(65);
+
+    std::atomic<bool> failed(false);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < workers; i++) {
+        threads.emplace_back([&program, &failed]() {
+            VM vm;
+            vm.lazyImports = lazyImports;
+            vm.profiler = profiler;
+            if (!restoreState(vm) || vm.interpret(program) == INTERPRET_RUNTIME_ERROR) failed = true;
+            collectOpStats(vm);
+        });
+    }
+    for (std::thread& thread : threads) thread.join();
+    writeProfile();
+    writeStats();
+
+    if (failed) exit(70);
+}
+
 int main(int argc, const char* argv[]) {
 #ifdef false
     Chunk* chunk = new Chunk();
@@ -85,13 +201,78 @@ int main(int argc, const char* argv[]) {
     vm.interpret(chunk);
 #endif
 
-    if (argc == 1) {
+#ifdef SIGPIPE
+    // A write to a pipe whose reader is gone fails instead of killing izi.
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    int workers = 0;
+    const char* path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--lazy-imports") == 0) {
+            lazyImports = true;
+        } else if (strncmp(argv[i], "-O", 2) == 0 && argv[i][2] >= '0' && argv[i][2] <= '0' + OPTIMIZE_MAX_LEVEL &&
+                   argv[i][3] == '\0') {
+            setOptimizationLevel(argv[i][2] - '0');
+        } else if (strcmp(argv[i], "--registers") == 0) {
+            useRegisterCode(true);
+        } else if (strcmp(argv[i], "--no-jit") == 0) {
+            useJit(false);
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profilePath = argv[++i];
+        } else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+            snapshotPath = argv[++i];
+        } else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc) {
+            restorePath = argv[++i];
+        } else if (strcmp(argv[i], "--opstats") == 0) {
+            printOpStats = true;
+        } else if (strcmp(argv[i], "--memstats") == 0) {
+            printMemStats = true;
+        } else if (strcmp(argv[i], "-I") == 0 && i + 1 < argc) {
+            addModuleSearchPath(argv[++i]);
+        } else if (path == NULL && argv[i][0] != '-') {
+            path = argv[i];
+        } else {
+            path = NULL;
+            workers = -1;
+            break;
+        }
+    }
+
+    if (workers < 0 || ((workers > 0 || profilePath != NULL || snapshotPath != NULL) && path == NULL) ||
+        (workers > 0 && snapshotPath != NULL)) {
+        fprintf(stderr,
+                "Usage: izi [-I dir]... [-O0|-O1|-O2] [--lazy-imports] [--registers] [--no-jit] [--profile out.folded]\n"
+                "           [--opstats] [--memstats] [--restore in.snap] [--snapshot out.snap] [--workers n] [path]\n");
+        exit(64);
+    }
+
+#ifndef OPSTATS
+    if (printOpStats) {
+        fprintf(stderr, "--opstats needs a build with OPSTATS defined (the Opstats configuration).\n");
+        exit(64);
+    }
+#endif
+
+    if (restorePath != NULL && !readSnapshot(restorePath, &snapshot)) exit(74);
+
+    Profiler sampler;
+    if (profilePath != NULL) {
+        if (!sampler.start()) {
+            fprintf(stderr, "Profiling is not supported on this platform.\n");
+            exit(64);
+        }
+        profiler = &sampler;
+    }
+
+    if (path == NULL) {
         repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
+    } else if (workers > 0) {
+        runShared(path, workers);
     } else {
-        fprintf(stderr, "Usage: izi [path]\n");
-        exit(64);
+        runFile(path);
     }
 
     // disassembleChunk(chunk, "test chunk");
@@ -0,0 +1,183 @@
+#include "memstats.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "vm.h"
+
+// Hidden global holding the class of gcStats() results, the space keeps it
+// out of reach of scripts.
+#define HEAP_STATS_CLASS " HeapStats"
+
+// Live bytes a thread gathers before adding them to the process total the
+// peak is taken from
+#define HEAP_PUBLISH_BYTES (64 * 1024)
+
+/**
+ * @brief Counts of the objects created and destroyed by one thread
+ *
+ * Only the owning thread writes them, without read-modify-write, other
+ * threads read them when summing. Blocks stay registered after their
+ * thread exits so its counts are kept, and so objects destroyed during
+ * thread or process teardown still have a block to count in.
+ */
+struct ThreadHeap {
+    std::atomic<uint64_t> allocated[HEAP_KIND_COUNT] = {};
+    std::atomic<uint64_t> freed[HEAP_KIND_COUNT] = {};
+    std::atomic<int64_t> bytes[HEAP_KIND_COUNT] = {};
+    //! Bytes not yet added to [publishedBytes]
+    int64_t unpublished = 0;
+};
+
+// Guards the list of blocks
+static std::mutex &heapsLock() {
+    static std::mutex lock;
+    return lock;
+}
+
+static std::vector<ThreadHeap *> &heaps() {
+    static std::vector<ThreadHeap *> list;
+    return list;
+}
+
+static std::atomic<int64_t> publishedBytes;
+static std::atomic<int64_t> peakBytes;
+
+static ThreadHeap *threadHeap() {
+    static thread_local ThreadHeap *heap = nullptr;
+    if (heap == nullptr) {
+        heap = new ThreadHeap();
+        std::lock_guard<std::mutex> guard(heapsLock());
+        heaps().push_back(heap);
+    }
+    return heap;
+}
+
+template <class T>
+static inline void add(std::atomic<T> &counter, T delta) {
+    counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+static void publish(ThreadHeap *heap) {
+    int64_t total = publishedBytes.fetch_add(heap->unpublished, std::memory_order_relaxed) + heap->unpublished;
+    heap->unpublished = 0;
+    int64_t peak = peakBytes.load(std::memory_order_relaxed);
+    while (total > peak && !peakBytes.compare_exchange_weak(peak, total, std::memory_order_relaxed)) {
+    }
+}
+
+void heapAllocated(HeapKind kind, size_t size) {
+    ThreadHeap *heap = threadHeap();
+    add<uint64_t>(heap->allocated[kind], 1);
+    add<int64_t>(heap->bytes[kind], size);
+    heap->unpublished += size;
+    if (heap->unpublished >= HEAP_PUBLISH_BYTES)
+        publish(heap);
+}
+
+void heapFreed(HeapKind kind, size_t size) {
+    ThreadHeap *heap = threadHeap();
+    add<uint64_t>(heap->freed[kind], 1);
+    add<int64_t>(heap->bytes[kind], -(int64_t)size);
+    heap->unpublished -= size;
+    if (heap->unpublished <= -HEAP_PUBLISH_BYTES)
+        publish(heap);
+}
+
+void heapResized(HeapKind kind, int64_t delta) {
+    ThreadHeap *heap = threadHeap();
+    add<int64_t>(heap->bytes[kind], delta);
+    heap->unpublished += delta;
+    if (heap->unpublished >= HEAP_PUBLISH_BYTES || heap->unpublished <= -HEAP_PUBLISH_BYTES)
+        publish(heap);
+}
+
+/**
+ * @brief Sum of the counts of every thread
+ *
+ * The peak is exact to HEAP_PUBLISH_BYTES per thread.
+ */
+HeapStats heapStats() {
+    HeapStats stats = {};
+    std::lock_guard<std::mutex> guard(heapsLock());
+    for (ThreadHeap *heap : heaps()) {
+        for (int kind = 0; kind < HEAP_KIND_COUNT; kind++) {
+            uint64_t allocated = heap->allocated[kind].load(std::memory_order_relaxed);
+            uint64_t freed = heap->freed[kind].load(std::memory_order_relaxed);
+            stats.allocated[kind] += allocated;
+            stats.live[kind] += (int64_t)(allocated - freed);
+            stats.bytes[kind] += heap->bytes[kind].load(std::memory_order_relaxed);
+        }
+    }
+    for (int kind = 0; kind < HEAP_KIND_COUNT; kind++) {
+        stats.liveBytes += stats.bytes[kind];
+    }
+    stats.peakBytes = std::max(peakBytes.load(std::memory_order_relaxed), stats.liveBytes);
+    return stats;
+}
+
+/**
+ * @brief Name of [kind] in gcStats() and --memstats
+ *
+ */
+const char *heapKindName(HeapKind kind) {
+    static const char *names[] = {
+        "strings",
+        "functions",
+        "closures",
+        "upvalues",
+        "classes",
+        "instances",
+        "boundMethods",
+        "modules",
+        "ranges",
+        "fibers",
+        "natives",
+    };
+    static_assert(sizeof(names) / sizeof(names[0]) == HEAP_KIND_COUNT, "every heap kind needs a name");
+    return names[kind];
+}
+
+/**
+ * @brief Write the counts as JSON
+ *
+ */
+void writeHeapStats(FILE *file) {
+    HeapStats stats = heapStats();
+    fprintf(file, "{\n  \"liveBytes\": %lld,\n  \"peakBytes\": %lld,\n  \"kinds\": {", (long long)stats.liveBytes,
+            (long long)stats.peakBytes);
+    for (int kind = 0; kind < HEAP_KIND_COUNT; kind++) {
+        fprintf(file, "%s\n    \"%s\": {\"allocated\": %llu, \"live\": %lld, \"bytes\": %lld}", kind > 0 ? "," : "",
+                heapKindName((HeapKind)kind), (unsigned long long)stats.allocated[kind], (long long)stats.live[kind],
+                (long long)stats.bytes[kind]);
+    }
+    fprintf(file, "\n  }\n}\n");
+}
+
+/**
+ * @brief gcStats() returns the heap counts, one field per kind holding
+ * [allocated], [live] and [bytes], with [liveBytes] and [peakBytes]
+ *
+ */
+static Value gcStatsNative(VM *vm, int argCount, Value *args) {
+    HeapStats stats = heapStats();
+    Klass klass = AS_CLASS(vm->globals[HEAP_STATS_CLASS]);
+    Instance result = std::make_shared<ObjInstance>(klass);
+    for (int kind = 0; kind < HEAP_KIND_COUNT; kind++) {
+        Instance counts = std::make_shared<ObjInstance>(klass);
+        counts->fields["allocated"] = NUMBER_VAL((double)stats.allocated[kind]);
+        counts->fields["live"] = NUMBER_VAL((double)stats.live[kind]);
+        counts->fields["bytes"] = NUMBER_VAL((double)stats.bytes[kind]);
+        result->fields[heapKindName((HeapKind)kind)] = INSTANCE_VAL(counts);
+    }
+    result->fields["liveBytes"] = NUMBER_VAL((double)stats.liveBytes);
+    result->fields["peakBytes"] = NUMBER_VAL((double)stats.peakBytes);
+    return INSTANCE_VAL(result);
+}
+
+void defineHeapStats(VM *vm) {
+    vm->defineNative("gcStats", gcStatsNative);
+    vm->globals[HEAP_STATS_CLASS] = CLASS_VAL(std::make_shared<ObjClass>("HeapStats"));
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdio.h>
+
+#include <cstddef>
+#include <cstdint>
+
+struct VM;
+
+/**
+ * @brief Kinds of heap objects counted by the VM
+ *
+ */
+enum HeapKind {
+    HEAP_STRING,
+    HEAP_FUNCTION,
+    HEAP_CLOSURE,
+    HEAP_UPVALUE,
+    HEAP_CLASS,
+    HEAP_INSTANCE,
+    HEAP_BOUND_METHOD,
+    HEAP_MODULE,
+    HEAP_RANGE,
+    HEAP_FIBER,
+    HEAP_NATIVE,
+    HEAP_KIND_COUNT,
+};
+
+/**
+ * @brief Counts of the objects of every VM of the process
+ *
+ * Bytes are the size of the objects themselves, plus the characters of
+ * string bodies.
+ */
+struct HeapStats {
+    uint64_t allocated[HEAP_KIND_COUNT];
+    int64_t live[HEAP_KIND_COUNT];
+    int64_t bytes[HEAP_KIND_COUNT];
+    int64_t liveBytes;
+    //! Highest [liveBytes] reached
+    int64_t peakBytes;
+};
+
+void heapAllocated(HeapKind kind, size_t bytes);
+void heapFreed(HeapKind kind, size_t bytes);
+//! An object of [kind] grew or shrank in place by [delta] bytes
+void heapResized(HeapKind kind, int64_t delta);
+HeapStats heapStats();
+const char *heapKindName(HeapKind kind);
+void writeHeapStats(FILE *file);
+
+/**
+ * @brief Base counting the objects of type [T] as they are created,
+ * copied and destroyed
+ *
+ */
+template <class T, HeapKind kind>
+struct HeapTracked {
+    HeapTracked() { heapAllocated(kind, sizeof(T)); }
+    HeapTracked(const HeapTracked &) { heapAllocated(kind, sizeof(T)); }
+    HeapTracked &operator=(const HeapTracked &) = default;
+    ~HeapTracked() { heapFreed(kind, sizeof(T)); }
+};
+
+/**
+ * @brief Register gcStats()
+ *
+ * @param vm the VM receiving the globals
+ */
+void defineHeapStats(VM *vm);
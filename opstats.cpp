@@ -0,0 +1,115 @@
+#include "opstats.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+void OpStats::merge(const OpStats &other) {
+    for (int i = 0; i < OPCODE_COUNT; i++) {
+        counts[i] += other.counts[i];
+        for (int j = 0; j < OPCODE_COUNT; j++) {
+            pairs[i][j] += other.pairs[i][j];
+        }
+    }
+    for (int i = 0; i < REG_OPCODE_COUNT; i++) {
+        registerCounts[i] += other.registerCounts[i];
+    }
+    for (auto &[key, entry] : other.functions) {
+        auto &mine = functions[key];
+        mine.first = entry.first;
+        mine.second += entry.second;
+    }
+    quickened += other.quickened;
+    dequickened += other.dequickened;
+}
+
+/**
+ * @brief [text] as a JSON string
+ *
+ */
+static std::string jsonString(const std::string &text) {
+    std::string quoted = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+        } else if ((unsigned char)c < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            quoted += escape;
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
+
+/**
+ * @brief Write the counts as JSON, pairs and functions most frequent first
+ *
+ */
+void OpStats::write(FILE *file) {
+    uint64_t total = 0;
+    for (int i = 0; i < OPCODE_COUNT; i++) {
+        total += counts[i];
+    }
+    for (int i = 0; i < REG_OPCODE_COUNT; i++) {
+        total += registerCounts[i];
+    }
+    fprintf(file, "{\n  \"instructions\": %llu,\n", (unsigned long long)total);
+    fprintf(file, "  \"quickened\": %zu,\n  \"dequickened\": %zu,\n", quickened, dequickened);
+
+    fprintf(file, "  \"opcodes\": {");
+    const char *separator = "\n";
+    for (int i = 0; i < OPCODE_COUNT; i++) {
+        if (counts[i] == 0)
+            continue;
+        fprintf(file, "%s    \"%s\": %llu", separator, opcodeName(i), (unsigned long long)counts[i]);
+        separator = ",\n";
+    }
+    fprintf(file, "\n  },\n");
+
+    fprintf(file, "  \"register_opcodes\": {");
+    separator = "\n";
+    for (int i = 0; i < REG_OPCODE_COUNT; i++) {
+        if (registerCounts[i] == 0)
+            continue;
+        fprintf(file, "%s    \"%s\": %llu", separator, regOpName(i), (unsigned long long)registerCounts[i]);
+        separator = ",\n";
+    }
+    fprintf(file, "\n  },\n");
+
+    std::vector<std::pair<int, int>> pairList;
+    for (int i = 0; i < OPCODE_COUNT; i++) {
+        for (int j = 0; j < OPCODE_COUNT; j++) {
+            if (pairs[i][j] != 0)
+                pairList.emplace_back(i, j);
+        }
+    }
+    std::sort(pairList.begin(), pairList.end(), [this](auto &a, auto &b) {
+        return pairs[a.first][a.second] > pairs[b.first][b.second];
+    });
+    fprintf(file, "  \"pairs\": [");
+    separator = "\n";
+    for (auto &[first, second] : pairList) {
+        fprintf(file, "%s    {\"first\": \"%s\", \"second\": \"%s\", \"count\": %llu}", separator,
+                opcodeName(first), opcodeName(second), (unsigned long long)pairs[first][second]);
+        separator = ",\n";
+    }
+    fprintf(file, "\n  ],\n");
+
+    std::vector<std::pair<Function, uint64_t>> functionList;
+    for (auto &[key, entry] : functions) {
+        functionList.push_back(entry);
+    }
+    std::sort(functionList.begin(), functionList.end(), [](auto &a, auto &b) { return a.second > b.second; });
+    fprintf(file, "  \"functions\": [");
+    separator = "\n";
+    for (auto &[function, count] : functionList) {
+        std::string name = function->name == "" ? "script" : function->name;
+        fprintf(file, "%s    {\"name\": %s, \"line\": %d, \"instructions\": %llu}", separator, jsonString(name).c_str(),
+                function->chunk->lines.empty() ? 0 : function->chunk->lines[0], (unsigned long long)count);
+        separator = ",\n";
+    }
+    fprintf(file, "\n  ]\n}\n");
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdio.h>
+
+#include <unordered_map>
+
+#include "chunk.h"
+#include "regcode.h"
+#include "value.h"
+
+/**
+ * @brief Execution counts of an instrumented VM
+ *
+ * Only filled in builds defining OPSTATS (the Opstats configuration), the
+ * dispatch loop records every instruction before running it.
+ */
+struct OpStats {
+    //! Executions of each opcode
+    uint64_t counts[OPCODE_COUNT] = {};
+    //! Executions of each opcode, by the opcode run just before
+    uint64_t pairs[OPCODE_COUNT][OPCODE_COUNT] = {};
+    //! Executions of each register opcode, see runRegisters()
+    uint64_t registerCounts[REG_OPCODE_COUNT] = {};
+    //! Instructions run in each function
+    std::unordered_map<ObjFunction *, std::pair<Function, uint64_t>> functions;
+    size_t quickened = 0;
+    size_t dequickened = 0;
+
+    inline void record(const Function &function, uint8_t instruction) {
+        counts[instruction]++;
+        pairs[previous][instruction]++;
+        previous = instruction;
+        countFunction(function);
+    }
+
+    inline void recordRegister(const Function &function, uint8_t instruction) {
+        registerCounts[instruction]++;
+        countFunction(function);
+    }
+
+    void merge(const OpStats &other);
+    void write(FILE *file);
+
+   private:
+    inline void countFunction(const Function &function) {
+        if (function.get() != current) {
+            auto &entry = functions[function.get()];
+            entry.first = function;
+            current = function.get();
+            currentCount = &entry.second;
+        }
+        (*currentCount)++;
+    }
+
+    uint8_t previous = 0;
+    //! Function of the last instruction and its counter, entries of
+    //! [functions] don't move
+    ObjFunction *current = nullptr;
+    uint64_t *currentCount = nullptr;
+};
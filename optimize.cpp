@@ -0,0 +1,607 @@
+#include "optimize.h"
+
+#include <cmath>
+#include <vector>
+
+#include "chunk.h"
+
+// Rounds of passes at the highest level, each round only ever shrinks
+// the code
+#define OPTIMIZE_MAX_ROUNDS 8
+// Jumps followed when threading a chain of jumps
+#define OPTIMIZE_MAX_HOPS 16
+// Longest block copied over a jump to it
+#define OPTIMIZE_MAX_TAIL 6
+
+static int level = OPTIMIZE_DEFAULT_LEVEL;
+
+void setOptimizationLevel(int newLevel) {
+    level = newLevel < 0 ? 0 : newLevel > OPTIMIZE_MAX_LEVEL ? OPTIMIZE_MAX_LEVEL : newLevel;
+}
+
+int optimizationLevel() {
+    return level;
+}
+
+/**
+ * @brief Decoded instruction, jumps hold the index of the instruction they
+ * go to instead of a distance
+ *
+ */
+struct Instruction {
+    uint8_t op;
+    //! First operand byte: constant, slot, upvalue or argument count
+    uint8_t operand;
+    bool removed;
+    int line;
+    //! Jumps and ITER_NEXT, index of the instruction jumped to
+    int target;
+    //! CLOSURE, offset of its upvalue descriptors in the original code
+    uint32_t upvalues;
+};
+
+static bool isJump(uint8_t op) {
+    return op == JUMP || op == JUMP_IF_FALSE || op == LOOP || op == ITER_NEXT;
+}
+
+/**
+ * @brief Instructions of one function being optimized
+ *
+ */
+struct Optimizer {
+    Chunk *chunk;
+    std::vector<Instruction> code;
+    //! Set for each live instruction some live jump goes to
+    std::vector<bool> targets;
+    //! Instructions removed since the last compact()
+    int removedCount = 0;
+
+    bool decode();
+    bool encode();
+    void compact();
+    void findTargets();
+
+    bool foldConstants();
+    bool foldBranches();
+    bool removePushPop();
+    bool threadJumps();
+    bool removeDeadCode();
+    bool forwardStores();
+    bool duplicateTails();
+    int tailEnd(int start, int jump);
+
+    int nextLive(int index) {
+        do {
+            index++;
+        } while (index < (int)code.size() && code[index].removed);
+        return index;
+    }
+
+    int previousLive(int index) {
+        do {
+            index--;
+        } while (index >= 0 && code[index].removed);
+        return index;
+    }
+
+    //! Instruction control reaches going to [index], the next live one
+    //! when it was removed
+    int resolve(int index) {
+        return index < (int)code.size() && !code[index].removed ? index : nextLive(index);
+    }
+
+    bool live(int index) {
+        return index >= 0 && index < (int)code.size();
+    }
+
+    void remove(int index) {
+        code[index].removed = true;
+        removedCount++;
+    }
+
+    bool pushesConstant(int index) {
+        uint8_t op = code[index].op;
+        return op == CONSTANT || op == NIL || op == TRUE || op == FALSE;
+    }
+
+    Value pushedConstant(int index) {
+        switch (code[index].op) {
+            case NIL: return NIL_VAL;
+            case TRUE: return BOOL_VAL(true);
+            case FALSE: return BOOL_VAL(false);
+            default: return chunk->constants[code[index].operand];
+        }
+    }
+
+    bool setPush(int index, Value value);
+};
+
+bool Optimizer::decode() {
+    std::vector<int> indexAt(chunk->code.size() + 1, -1);
+    code.reserve(chunk->code.size() / 2 + 1);
+    size_t offset = 0;
+    while (offset < chunk->code.size()) {
+        uint8_t op = chunk->code[offset];
+        Instruction instruction{op, 0, false, chunk->lines[offset], -1, 0};
+        size_t length = instructionLength(*chunk, offset);
+        if (length == 0 || offset + length > chunk->code.size())
+            return false;
+        if (op == CLOSURE)
+            instruction.upvalues = (uint32_t)(offset + 2);
+        if (length > 1)
+            instruction.operand = chunk->code[offset + 1];
+        if (op == JUMP || op == JUMP_IF_FALSE || op == LOOP) {
+            int distance = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+            instruction.target = op == LOOP ? (int)offset + 3 - distance : (int)offset + 3 + distance;
+        } else if (op == ITER_NEXT) {
+            int distance = (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+            instruction.target = (int)offset + 4 + distance;
+        }
+        indexAt[offset] = (int)code.size();
+        code.push_back(instruction);
+        offset += length;
+    }
+
+    for (Instruction &instruction : code) {
+        if (!isJump(instruction.op))
+            continue;
+        if (instruction.target < 0 || instruction.target >= (int)chunk->code.size() || indexAt[instruction.target] < 0)
+            return false;
+        instruction.target = indexAt[instruction.target];
+    }
+    return true;
+}
+
+/**
+ * @brief Write the live instructions back to the chunk, false when a jump
+ * no longer fits its encoding
+ *
+ */
+bool Optimizer::encode() {
+    compact();
+    std::vector<size_t> offsets(code.size() + 1);
+    size_t offset = 0;
+    for (size_t i = 0; i < code.size(); i++) {
+        offsets[i] = offset;
+        offset += instructionLength(*chunk, code[i].op, code[i].operand);
+    }
+    offsets[code.size()] = offset;
+
+    std::vector<uint8_t> bytes;
+    std::vector<int> lines;
+    bytes.reserve(offset);
+    lines.reserve(offset);
+    auto write = [&](uint8_t byte, int line) {
+        bytes.push_back(byte);
+        lines.push_back(line);
+    };
+    for (size_t i = 0; i < code.size(); i++) {
+        Instruction &instruction = code[i];
+        uint8_t op = instruction.op;
+        if (isJump(op)) {
+            if (instruction.target < 0 || instruction.target >= (int)code.size())
+                return false;
+            size_t from = offsets[i] + (op == ITER_NEXT ? 4 : 3);
+            size_t to = offsets[instruction.target];
+            // Threading may have turned a forward jump backward.
+            if (op == JUMP || op == LOOP)
+                op = to >= from ? JUMP : LOOP;
+            else if (to < from)
+                return false;
+            size_t distance = to >= from ? to - from : from - to;
+            if (distance > UINT16_MAX)
+                return false;
+            write(op, instruction.line);
+            if (op == ITER_NEXT)
+                write(instruction.operand, instruction.line);
+            write((distance >> 8) & 0xff, instruction.line);
+            write(distance & 0xff, instruction.line);
+            continue;
+        }
+
+        write(op, instruction.line);
+        if (op == CLOSURE) {
+            Function function = AS_FUNCTION(chunk->constants[instruction.operand]);
+            write(instruction.operand, instruction.line);
+            for (int j = 0; j < 2 * function->upvalueCount; j++) {
+                write(chunk->code[instruction.upvalues + j], instruction.line);
+            }
+        } else if (instructionLength(*chunk, op, instruction.operand) == 2) {
+            write(instruction.operand, instruction.line);
+        }
+    }
+
+    chunk->code = std::move(bytes);
+    chunk->lines = std::move(lines);
+    chunk->feedback.assign(chunk->code.size(), 0);
+    return true;
+}
+
+/**
+ * @brief Drop removed instructions, jumps to one go to the instruction
+ * that followed it
+ *
+ */
+void Optimizer::compact() {
+    if (removedCount == 0)
+        return;
+    removedCount = 0;
+    std::vector<int> newIndex(code.size() + 1);
+    int count = 0;
+    for (size_t i = 0; i < code.size(); i++) {
+        newIndex[i] = count;
+        if (!code[i].removed)
+            count++;
+    }
+    newIndex[code.size()] = count;
+
+    std::vector<Instruction> kept;
+    kept.reserve(count);
+    for (Instruction &instruction : code) {
+        if (instruction.removed)
+            continue;
+        if (isJump(instruction.op))
+            instruction.target = newIndex[instruction.target];
+        kept.push_back(instruction);
+    }
+    code = std::move(kept);
+}
+
+void Optimizer::findTargets() {
+    compact();
+    targets.assign(code.size() + 1, false);
+    for (Instruction &instruction : code) {
+        if (isJump(instruction.op) && instruction.target <= (int)code.size())
+            targets[instruction.target] = true;
+    }
+}
+
+/**
+ * @brief Make the instruction at [index] push [value], false when the
+ * constant table is full
+ *
+ */
+bool Optimizer::setPush(int index, Value value) {
+    Instruction &instruction = code[index];
+    if (IS_NIL(value)) {
+        instruction.op = NIL;
+        return true;
+    }
+    if (IS_BOOL(value)) {
+        instruction.op = AS_BOOL(value) ? TRUE : FALSE;
+        return true;
+    }
+    for (size_t i = 0; i < chunk->constants.size(); i++) {
+        const Value &constant = chunk->constants[i];
+        if (constant.type != value.type || !valuesEqual(constant, value))
+            continue;
+        // -0 equals 0 but prints and divides differently.
+        if (IS_NUMBER(value) && std::signbit(AS_NUMBER(constant)) != std::signbit(AS_NUMBER(value)))
+            continue;
+        instruction.op = CONSTANT;
+        instruction.operand = (uint8_t)i;
+        return true;
+    }
+    if (chunk->constants.size() > UINT8_MAX)
+        return false;
+    instruction.op = CONSTANT;
+    instruction.operand = (uint8_t)chunk->addConstant(value);
+    return true;
+}
+
+/**
+ * @brief Value of [op] applied to constants, false when it would fail or
+ * isn't pure
+ *
+ */
+static bool evaluate(uint8_t op, const Value &a, const Value &b, Value *result) {
+    if (op == EQUAL) {
+        *result = BOOL_VAL(valuesEqual(a, b));
+        return true;
+    }
+    if (op == ADD && IS_STRING(a) && IS_STRING(b)) {
+        // Flat, a rope constant would be flattened by every thread reading it.
+        std::string chars(AS_STRING(a));
+        chars += AS_STRING(b);
+        *result = Value{VAL_STRING, Str(std::move(chars))};
+        return true;
+    }
+    if (!IS_NUMBER(a) || !IS_NUMBER(b))
+        return false;
+    double left = AS_NUMBER(a);
+    double right = AS_NUMBER(b);
+    switch (op) {
+        case ADD: *result = NUMBER_VAL(left + right); return true;
+        case SUBTRACT: *result = NUMBER_VAL(left - right); return true;
+        case MULTIPLY: *result = NUMBER_VAL(left * right); return true;
+        case DIVIDE: *result = NUMBER_VAL(left / right); return true;
+        case GREATER: *result = BOOL_VAL(left > right); return true;
+        case LESS: *result = BOOL_VAL(left < right); return true;
+        default: return false;
+    }
+}
+
+/**
+ * @brief Replace operators applied to constants by their result
+ *
+ * Operands must not be jumped to, the stack there may hold other values.
+ * Operations that would raise a runtime error are left to raise it.
+ */
+bool Optimizer::foldConstants() {
+    findTargets();
+    bool changed = false;
+    for (int i = 0; i < (int)code.size(); i++) {
+        if (code[i].removed || targets[i])
+            continue;
+        uint8_t op = code[i].op;
+        int right = previousLive(i);
+        if (!live(right) || !pushesConstant(right))
+            continue;
+
+        if (op == NOT || op == NEGATE) {
+            Value operand = pushedConstant(right);
+            Value result;
+            if (op == NOT)
+                result = BOOL_VAL(isFalsey(operand));
+            else if (IS_NUMBER(operand))
+                result = NUMBER_VAL(-AS_NUMBER(operand));
+            else
+                continue;
+            if (setPush(right, result)) {
+                code[right].line = code[i].line;
+                remove(i);
+                changed = true;
+            }
+            continue;
+        }
+
+        if (op != EQUAL && op != GREATER && op != LESS && op != ADD && op != SUBTRACT && op != MULTIPLY &&
+            op != DIVIDE)
+            continue;
+        int left = previousLive(right);
+        if (targets[right] || !live(left) || !pushesConstant(left))
+            continue;
+        Value result;
+        if (!evaluate(op, pushedConstant(left), pushedConstant(right), &result) || !setPush(left, result))
+            continue;
+        code[left].line = code[i].line;
+        remove(right);
+        remove(i);
+        changed = true;
+    }
+    return changed;
+}
+
+/**
+ * @brief Decide JUMP_IF_FALSE on a constant at compile time
+ *
+ * A truthy condition never jumps, a falsey one always does. The
+ * condition stays pushed either way, both paths pop it.
+ */
+bool Optimizer::foldBranches() {
+    findTargets();
+    bool changed = false;
+    for (int i = 0; i < (int)code.size(); i++) {
+        if (code[i].removed || code[i].op != JUMP_IF_FALSE || targets[i])
+            continue;
+        int condition = previousLive(i);
+        if (!live(condition) || !pushesConstant(condition))
+            continue;
+        if (isFalsey(pushedConstant(condition)))
+            code[i].op = JUMP;
+        else
+            remove(i);
+        changed = true;
+    }
+    return changed;
+}
+
+/**
+ * @brief Drop values pushed without side effect and popped right away
+ *
+ */
+bool Optimizer::removePushPop() {
+    findTargets();
+    bool changed = false;
+    for (int i = 0; i < (int)code.size(); i++) {
+        if (code[i].removed || code[i].op != POP || targets[i])
+            continue;
+        int push = previousLive(i);
+        if (!live(push))
+            continue;
+        uint8_t op = code[push].op;
+        if (!pushesConstant(push) && op != GET_LOCAL && op != GET_UPVALUE && op != DUP)
+            continue;
+        // Jumps to the push now land past the pop, with the same stack.
+        remove(push);
+        remove(i);
+        changed = true;
+    }
+    return changed;
+}
+
+/**
+ * @brief Send jumps straight to the end of a chain of unconditional jumps
+ * and drop jumps to the next instruction
+ *
+ */
+bool Optimizer::threadJumps() {
+    compact();
+    bool changed = false;
+    for (int i = 0; i < (int)code.size(); i++) {
+        Instruction &instruction = code[i];
+        if (instruction.removed || instruction.op == ITER_NEXT || !isJump(instruction.op))
+            continue;
+        int target = resolve(instruction.target);
+        for (int hop = 0; hop < OPTIMIZE_MAX_HOPS && live(target) && target != i; hop++) {
+            uint8_t op = code[target].op;
+            if (op != JUMP && op != LOOP)
+                break;
+            int next = resolve(code[target].target);
+            // JUMP_IF_FALSE only goes forward.
+            if (instruction.op == JUMP_IF_FALSE && next <= i)
+                break;
+            target = next;
+        }
+        if (target != instruction.target) {
+            instruction.target = target;
+            changed = true;
+        }
+        if (target == nextLive(i)) {
+            remove(i);
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+/**
+ * @brief Drop instructions no path from the entry reaches
+ *
+ */
+bool Optimizer::removeDeadCode() {
+    compact();
+    std::vector<bool> reached(code.size(), false);
+    std::vector<int> pending = {0};
+    while (!pending.empty()) {
+        int index = pending.back();
+        pending.pop_back();
+        if (!live(index) || reached[index])
+            continue;
+        reached[index] = true;
+        uint8_t op = code[index].op;
+        if (isJump(op))
+            pending.push_back(code[index].target);
+        if (op != JUMP && op != LOOP && op != RETURN)
+            pending.push_back(index + 1);
+    }
+
+    bool changed = false;
+    for (size_t i = 0; i < code.size(); i++) {
+        if (!reached[i]) {
+            remove((int)i);
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+/**
+ * @brief Reuse the value a store leaves on the stack instead of popping
+ * it and loading the variable again
+ *
+ */
+bool Optimizer::forwardStores() {
+    findTargets();
+    bool changed = false;
+    for (int i = 0; i < (int)code.size(); i++) {
+        uint8_t op = code[i].op;
+        if (code[i].removed || (op != SET_LOCAL && op != SET_UPVALUE && op != SET_GLOBAL))
+            continue;
+        int pop = nextLive(i);
+        if (!live(pop) || code[pop].op != POP || targets[pop])
+            continue;
+        int load = nextLive(pop);
+        uint8_t loadOp = op == SET_LOCAL ? GET_LOCAL : op == SET_UPVALUE ? GET_UPVALUE : GET_GLOBAL;
+        if (!live(load) || code[load].op != loadOp || targets[load])
+            continue;
+        // Each use of a global name has its own constant.
+        bool same = op == SET_GLOBAL ? valuesEqual(chunk->constants[code[load].operand], chunk->constants[code[i].operand])
+                                     : code[load].operand == code[i].operand;
+        if (!same)
+            continue;
+        remove(pop);
+        remove(load);
+        changed = true;
+    }
+    return changed;
+}
+
+/**
+ * @brief Last instruction of the block starting at [start] when it can be
+ * copied over [jump], -1 otherwise
+ *
+ * The block must be short, end with a return or an unconditional jump and
+ * hold no other jump.
+ */
+int Optimizer::tailEnd(int start, int jump) {
+    if (start == jump + 1)
+        return -1;
+    for (int i = start; i < start + OPTIMIZE_MAX_TAIL && i < (int)code.size(); i++) {
+        uint8_t op = code[i].op;
+        if (i == jump || op == JUMP_IF_FALSE || op == ITER_NEXT)
+            return -1;
+        if (op == RETURN)
+            return i;
+        if (op == JUMP || op == LOOP)
+            return code[i].target == start ? -1 : i;
+    }
+    return -1;
+}
+
+/**
+ * @brief Replace jumps to a short block ending in a jump or a return by a
+ * copy of the block
+ *
+ * Saves a dispatch each time the jump runs. The increment of a for loop,
+ * which the body jumps back to before jumping again to the condition,
+ * ends up at the end of the body.
+ */
+bool Optimizer::duplicateTails() {
+    compact();
+    std::vector<Instruction> grown;
+    std::vector<int> newIndex(code.size() + 1);
+    bool changed = false;
+    for (int i = 0; i < (int)code.size(); i++) {
+        newIndex[i] = (int)grown.size();
+        uint8_t op = code[i].op;
+        int end = op == JUMP || op == LOOP ? tailEnd(code[i].target, i) : -1;
+        if (end < 0) {
+            grown.push_back(code[i]);
+            continue;
+        }
+        for (int j = code[i].target; j <= end; j++) {
+            grown.push_back(code[j]);
+        }
+        changed = true;
+    }
+    newIndex[code.size()] = (int)grown.size();
+
+    for (Instruction &instruction : grown) {
+        if (isJump(instruction.op))
+            instruction.target = newIndex[instruction.target];
+    }
+    code = std::move(grown);
+    return changed;
+}
+
+void optimizeFunction(ObjFunction *function) {
+    if (level == 0)
+        return;
+    Optimizer optimizer{function->chunk};
+    if (!optimizer.decode())
+        return;
+
+    int rounds = level >= 2 ? OPTIMIZE_MAX_ROUNDS : 1;
+    bool changed = true;
+    bool rewritten = false;
+    for (int round = 0; round < rounds && changed; round++) {
+        changed = optimizer.foldConstants();
+        changed = optimizer.foldBranches() || changed;
+        changed = optimizer.removePushPop() || changed;
+        if (level >= 2)
+            changed = optimizer.forwardStores() || changed;
+        // Copies are only made once, a copied jump may lead to another
+        // short block.
+        if (level >= 2 && round == 0)
+            changed = optimizer.duplicateTails() || changed;
+        changed = optimizer.threadJumps() || changed;
+        changed = optimizer.removeDeadCode() || changed;
+        rewritten = rewritten || changed;
+    }
+
+    // The chunk keeps its code when nothing applied, or when a jump got
+    // too long to encode.
+    if (rewritten)
+        optimizer.encode();
+}
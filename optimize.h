@@ -0,0 +1,30 @@
+#pragma once
+
+#include "value.h"
+
+// Level compilers start with, see setOptimizationLevel(). The passes
+// cost about as much as parsing, scripts compiled on a request path keep
+// the plain bytecode unless asked.
+#define OPTIMIZE_DEFAULT_LEVEL 0
+#define OPTIMIZE_MAX_LEVEL 2
+
+/**
+ * @brief Passes run on every function compiled from now on, set by -O
+ *
+ * 0 keeps the bytecode as the compiler emitted it. 1 folds constant
+ * expressions and branches, threads jumps and removes dead code and
+ * values pushed only to be popped. 2 also forwards a stored variable to
+ * the load right after it, copies short blocks over the jumps to them and
+ * repeats the passes until none applies.
+ */
+void setOptimizationLevel(int level);
+int optimizationLevel();
+
+/**
+ * @brief Rewrite the bytecode of [function] at the current level
+ *
+ * The chunk is decoded into a list of instructions whose jumps name the
+ * instruction they go to, rewritten, then encoded again. Constants are
+ * only ever added, indexes held elsewhere stay valid.
+ */
+void optimizeFunction(ObjFunction *function);
@@ -19,10 +19,43 @@ newaction {
 
 
 }
+
+newoption {
+   trigger = "shared",
+   description = "Build izi-lib as a shared library instead of a static one"
+}
+
 workspace "Izi"
    architecture "x64"
-   configurations { "Debug", "Release" }
+   configurations { "Debug", "Release", "Opstats" }
+
+
+-- The interpreter without its command line, for hosts embedding a VM
+project "izi-lib"
+    kind (_OPTIONS["shared"] and "SharedLib" or "StaticLib")
+    language "C++"
+    cppdialect "C++17"
+    toolset ("clang")
+    staticruntime "on"
+    pic "On"
+    location "../"
+    files {"*.h", "*.cpp"}
+    removefiles {"main.cpp"}
+
+    filter { "configurations:Debug" }
+       defines { "DEBUG" }
+       symbols "On"
+       runtime "Debug"
+ 
+    filter { "configurations:Release" }
+       defines { "NDEBUG" }
+       optimize "On"
 
+    filter { "configurations:Opstats" }
+       defines { "NDEBUG", "OPSTATS" }
+       optimize "On"
+
+    filter {}
 
 project "izi"
     kind "ConsoleApp"
@@ -31,7 +64,8 @@ project "izi"
     toolset ("clang")
     staticruntime "on"
     location "../"
-    files {"**.h", "**.cpp"}
+    files {"main.cpp"}
+    links {"izi-lib"}
 
     filter { "configurations:Debug" }
        defines { "DEBUG" }
@@ -41,5 +75,45 @@ project "izi"
     filter { "configurations:Release" }
        defines { "NDEBUG" }
        optimize "On"
+
+    -- Release build counting executed instructions for --opstats
+    filter { "configurations:Opstats" }
+       defines { "NDEBUG", "OPSTATS" }
+       optimize "On"
+
+    filter {}
+
+-- Runs the scripts of bench/ with the izi built next to it:
+-- izi-bench [--runs n] [--baseline old.json] [--save new.json]
+project "izi-bench"
+    kind "ConsoleApp"
+    language "C++"
+    cppdialect "C++17"
+    toolset ("clang")
+    staticruntime "on"
+    location "../"
+    files {"bench/bench.cpp"}
+    dependson {"izi"}
+
+    filter { "configurations:Debug" }
+       symbols "On"
+
+    filter { "configurations:Release or Opstats" }
+       optimize "On"
+
+    filter {}
+
+-- Scanner and compiler throughput on generated sources, always optimized
+project "izi-compile-bench"
+    kind "ConsoleApp"
+    language "C++"
+    cppdialect "C++17"
+    toolset ("clang")
+    staticruntime "on"
+    location "../"
+    files {"*.h", "*.cpp", "bench/compile_bench.cpp"}
+    removefiles {"main.cpp"}
+    defines { "NDEBUG" }
+    optimize "On"
    -- filter { "system:linux", "action:gmake" }
       -- buildoptions { "`wx-config --cxxflags`", "-ansi", "-pedantic" }
@@ -0,0 +1,88 @@
+#include "profile.h"
+
+#include <stdio.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <signal.h>
+#include <sys/time.h>
+#define PROFILE_SIGNALS
+#endif
+
+#include "vm.h"
+
+std::atomic<bool> Profiler::due(false);
+
+#ifdef PROFILE_SIGNALS
+static void onProfileTimer(int) {
+    Profiler::due.store(true, std::memory_order_relaxed);
+}
+
+static bool setTimer(long microseconds) {
+    struct itimerval timer = {};
+    timer.it_interval.tv_usec = microseconds;
+    timer.it_value.tv_usec = microseconds;
+    return setitimer(ITIMER_PROF, &timer, NULL) == 0;
+}
+#endif
+
+/**
+ * @brief Start the profiling timer, false if the platform has none
+ *
+ */
+bool Profiler::start() {
+#ifdef PROFILE_SIGNALS
+    struct sigaction action = {};
+    action.sa_handler = onProfileTimer;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, NULL) != 0)
+        return false;
+    return setTimer(PROFILE_INTERVAL_US);
+#else
+    return false;
+#endif
+}
+
+void Profiler::stop() {
+#ifdef PROFILE_SIGNALS
+    setTimer(0);
+#endif
+    due = false;
+}
+
+/**
+ * @brief Record the call stack of the fiber [vm] is running
+ *
+ */
+void Profiler::sample(VM *vm) {
+    std::string stack;
+    for (int i = 0; i < vm->frameCount; i++) {
+        CallFrame *frame = &vm->frames[i];
+        Function function = frame->closure->function;
+        if (i > 0)
+            stack += ';';
+        stack += function->name == "" ? "script" : function->name;
+        stack += ':';
+        stack += std::to_string(frame->line());
+    }
+    if (stack.empty())
+        return;
+
+    std::lock_guard<std::mutex> guard(lock);
+    stacks[stack]++;
+}
+
+/**
+ * @brief Write the samples to [path], false if it can't be written
+ *
+ */
+bool Profiler::write(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+        return false;
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto &[stack, count] : stacks) {
+        fprintf(file, "%s %zu\n", stack.c_str(), count);
+    }
+    return fclose(file) == 0;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Microseconds of CPU time between two samples
+#define PROFILE_INTERVAL_US 1000
+
+struct VM;
+
+/**
+ * @brief Sampling profiler writing collapsed stacks for flame graphs
+ *
+ * A profiling timer signal raises [due], a VM with the profiler attached
+ * checks it between instructions and records its call stack, one line per
+ * distinct stack with the number of samples that hit it:
+ * `script:12;parse:40;next:7 31`.
+ */
+struct Profiler {
+    //! Raised by the timer signal, cleared by the VM taking the sample
+    static std::atomic<bool> due;
+
+    bool start();
+    void stop();
+    void sample(VM *vm);
+    bool write(const char *path);
+
+   private:
+    //! Guards [stacks], VMs on several threads may share the profiler
+    std::mutex lock;
+    std::unordered_map<std::string, size_t> stacks;
+};
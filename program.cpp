@@ -0,0 +1,45 @@
+#include "program.h"
+
+#include "imports.h"
+#include "vm.h"
+
+Function Program::compileFrozen(const char *source, const String &name) {
+    Module module = std::make_shared<ObjModule>(name);
+    Function function = compiler.compile(source, module);
+    if (function != nullptr)
+        freezeFunction(function);
+    return function;
+}
+
+/**
+ * @brief Compile the main source, false on compile error
+ *
+ */
+bool Program::compile(const char *source) {
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto &[name, function] : compileImports(source)) {
+        freezeFunction(function);
+        modules.emplace(name, function);
+    }
+    script = compileFrozen(source, "___");
+    return script != nullptr;
+}
+
+/**
+ * @brief Function running the body of the module at canonical [path], null
+ * if it can't be read or does not compile
+ *
+ */
+Function Program::module(const String &path) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = modules.find(path);
+    if (it != modules.end())
+        return it->second;
+
+    std::string source;
+    Function function = nullptr;
+    if (readModuleSource(path, &source))
+        function = compileFrozen(source.c_str(), path);
+    modules[path] = function;
+    return function;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "compiler.h"
+#include "value.h"
+
+/**
+ * @brief Compiled code shared by VMs running on different threads
+ *
+ * Every VM running a program keeps its own globals, stack and objects, only
+ * functions and their chunks are shared. Those are frozen so no VM rewrites
+ * them, and modules are compiled once, on the first import of any VM.
+ */
+struct Program {
+    //! Top level function of the main source
+    Function script;
+
+    bool compile(const char *source);
+    Function module(const String &path);
+
+   private:
+    //! Guards the compiler and the module table
+    std::mutex lock;
+    Compiler compiler;
+    //! Modules by canonical path
+    std::unordered_map<String, Function> modules;
+
+    Function compileFrozen(const char *source, const String &name);
+};
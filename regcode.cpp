@@ -0,0 +1,551 @@
+#include "regcode.h"
+
+#include <stdio.h>
+
+#include <unordered_map>
+
+#include "chunk.h"
+
+static bool registerCode = false;
+
+void useRegisterCode(bool enabled) {
+    registerCode = enabled;
+}
+
+bool usesRegisterCode() {
+    return registerCode;
+}
+
+static const char *regOpNames[] = {
+    "MOVE",
+    "GET_GLOBAL",
+    "DEFINE_GLOBAL",
+    "SET_GLOBAL",
+    "GET_UPVALUE",
+    "SET_UPVALUE",
+    "EQUAL",
+    "GREATER",
+    "LESS",
+    "ADD",
+    "SUBTRACT",
+    "MULTIPLY",
+    "DIVIDE",
+    "NOT",
+    "NEGATE",
+    "PRINT",
+    "JUMP",
+    "JUMP_IF_FALSE",
+    "LOOP",
+    "CALL",
+    "TAIL_CALL",
+    "CLOSURE",
+    "CLOSE_UPVALUE",
+    "RETURN",
+};
+
+static_assert(sizeof(regOpNames) / sizeof(regOpNames[0]) == REG_OPCODE_COUNT, "every register opcode needs a name");
+
+const char *regOpName(uint8_t op) {
+    return op < REG_OPCODE_COUNT ? regOpNames[op] : "UNKNOWN";
+}
+
+static void printOperand(RegisterCode *code, uint16_t operand) {
+    if (operand < REG_CONSTANT) {
+        printf(" r%d", operand);
+        return;
+    }
+    printf(" '");
+    printValue(code->constants[operand - REG_CONSTANT]);
+    printf("'");
+}
+
+void RegisterCode::disassemble(const char *name) {
+    printf("== %s (registers: %d) ==\n", name, frameSize);
+    for (size_t i = 0; i < code.size(); i++) {
+        const RegInstruction &instruction = code[i];
+        printf("%04zu ", i);
+        if (i > 0 && lines[i] == lines[i - 1])
+            printf("   | ");
+        else
+            printf("%4d ", lines[i]);
+        printf("%-16s", regOpName(instruction.op));
+        switch (instruction.op) {
+            case R_MOVE:
+            case R_GET_GLOBAL:
+            case R_NOT:
+            case R_NEGATE:
+                printf(" r%d", instruction.a);
+                printOperand(this, instruction.b);
+                break;
+            case R_DEFINE_GLOBAL:
+            case R_SET_GLOBAL:
+                printOperand(this, instruction.b);
+                printOperand(this, instruction.c);
+                break;
+            case R_GET_UPVALUE:
+                printf(" r%d u%d", instruction.a, instruction.b);
+                break;
+            case R_SET_UPVALUE:
+                printf(" u%d", instruction.b);
+                printOperand(this, instruction.c);
+                break;
+            case R_PRINT:
+            case R_RETURN:
+                printOperand(this, instruction.b);
+                break;
+            case R_JUMP:
+            case R_LOOP:
+                printf(" -> %d", instruction.b);
+                break;
+            case R_JUMP_IF_FALSE:
+                printOperand(this, instruction.b);
+                printf(" -> %d", instruction.c);
+                break;
+            case R_CALL:
+            case R_TAIL_CALL:
+                printf(" r%d (%d args)", instruction.a, instruction.b);
+                break;
+            case R_CLOSURE:
+                printf(" r%d", instruction.a);
+                printOperand(this, instruction.b);
+                break;
+            case R_CLOSE_UPVALUE:
+                printf(" r%d", instruction.a);
+                break;
+            default:
+                printf(" r%d", instruction.a);
+                printOperand(this, instruction.b);
+                printOperand(this, instruction.c);
+                break;
+        }
+        printf("\n");
+    }
+}
+
+/**
+ * @brief Stack code of one function being turned into register code
+ *
+ */
+struct Translator {
+    ObjFunction *function;
+    Chunk *chunk;
+    RegisterCode *out;
+    //! Operand standing for each slot of the simulated stack, a slot
+    //! holding its own register number is written in the frame
+    std::vector<uint16_t> stack;
+    //! Register instructions to point at the stack code offset they jump to
+    std::vector<std::pair<size_t, int>> jumps;
+    //! Register instruction at each jump target of the stack code
+    std::unordered_map<int, size_t> labels;
+    //! Stack depth jumps to a target expect
+    std::unordered_map<int, size_t> targetDepths;
+    //! Stack depth at each target passed, backward jumps must match it
+    std::unordered_map<int, size_t> labelDepths;
+    //! Stack depth left by the last return or unconditional jump
+    size_t deadDepth = 0;
+    std::vector<bool> targets;
+    //! Instruction that just wrote the top slot, an assignment can write
+    //! its local instead
+    int lastResult = -1;
+    int line = 0;
+    bool failed = false;
+    uint16_t nilConstant = 0;
+    uint16_t trueConstant = 0;
+    uint16_t falseConstant = 0;
+
+    bool findTargets();
+    void translate();
+
+    void emit(uint8_t op, int a, uint16_t b, uint16_t c) {
+        out->code.push_back({op, (uint8_t)a, b, c});
+        out->lines.push_back(line);
+        lastResult = -1;
+    }
+
+    //! Emit an instruction writing the new top slot
+    void emitResult(uint8_t op, uint16_t b, uint16_t c) {
+        int slot = (int)stack.size();
+        emit(op, slot, b, c);
+        push(slot);
+        lastResult = (int)out->code.size() - 1;
+    }
+
+    void push(uint16_t operand) {
+        if (stack.size() >= REG_CONSTANT - 1) {
+            failed = true;
+            return;
+        }
+        stack.push_back(operand);
+        if ((int)stack.size() > out->frameSize)
+            out->frameSize = (int)stack.size();
+    }
+
+    uint16_t pop() {
+        if (stack.empty()) {
+            failed = true;
+            return 0;
+        }
+        uint16_t operand = stack.back();
+        stack.pop_back();
+        return operand;
+    }
+
+    uint16_t top() {
+        if (stack.empty()) {
+            failed = true;
+            return 0;
+        }
+        return stack.back();
+    }
+
+    uint16_t constant(uint8_t index) {
+        return REG_CONSTANT + index;
+    }
+
+    //! Constant only the register code needs, added once
+    uint16_t extraConstant(uint16_t &cached, Value value) {
+        if (cached == 0) {
+            if (out->constants.size() >= UINT16_MAX - REG_CONSTANT) {
+                failed = true;
+                return 0;
+            }
+            out->constants.push_back(value);
+            cached = (uint16_t)(REG_CONSTANT + out->constants.size() - 1);
+        }
+        return cached;
+    }
+
+    void materialize(size_t slot) {
+        if (stack[slot] != slot) {
+            emit(R_MOVE, (int)slot, stack[slot], 0);
+            stack[slot] = (uint16_t)slot;
+        }
+    }
+
+    //! Write every slot, as the stack code has them at a jump or a call
+    void materializeAll() {
+        for (size_t slot = 0; slot < stack.size(); slot++) {
+            materialize(slot);
+        }
+    }
+
+    void jump(uint8_t op, uint16_t b, int target) {
+        auto label = labelDepths.find(target);
+        if (label != labelDepths.end() && label->second != stack.size())
+            failed = true;
+        jumps.emplace_back(out->code.size(), target);
+        targetDepths.emplace(target, stack.size());
+        emit(op, 0, b, 0);
+    }
+
+    void binary(uint8_t op) {
+        uint16_t right = pop();
+        uint16_t left = pop();
+        emitResult(op, left, right);
+    }
+
+    void unary(uint8_t op) {
+        emitResult(op, pop(), 0);
+    }
+
+    void setLocal(uint8_t local);
+};
+
+/**
+ * @brief Whether the stack instruction [op] has a register form
+ *
+ */
+static bool hasRegisterForm(uint8_t op) {
+    switch (op) {
+        case CONSTANT:
+        case GET_LOCAL:
+        case SET_LOCAL:
+        case GET_GLOBAL:
+        case DEFINE_GLOBAL:
+        case SET_GLOBAL:
+        case GET_UPVALUE:
+        case SET_UPVALUE:
+        case CALL:
+        case TAIL_CALL:
+        case NIL:
+        case TRUE:
+        case FALSE:
+        case POP:
+        case DUP:
+        case EQUAL:
+        case GREATER:
+        case LESS:
+        case ADD:
+        case SUBTRACT:
+        case MULTIPLY:
+        case DIVIDE:
+        case NOT:
+        case NEGATE:
+        case PRINT:
+        case CLOSE_UPVALUE:
+        case RETURN:
+        case JUMP:
+        case JUMP_IF_FALSE:
+        case LOOP:
+        case CLOSURE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * @brief Mark the jump targets of the stack code, false if it uses an
+ * instruction without register form
+ *
+ */
+bool Translator::findTargets() {
+    targets.assign(chunk->code.size() + 1, false);
+    size_t offset = 0;
+    while (offset < chunk->code.size()) {
+        uint8_t op = chunk->code[offset];
+        size_t size = instructionLength(*chunk, offset);
+        if (!hasRegisterForm(op) || size == 0 || offset + size > chunk->code.size())
+            return false;
+        if (op == JUMP || op == JUMP_IF_FALSE || op == LOOP) {
+            int distance = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+            int target = op == LOOP ? (int)offset + 3 - distance : (int)offset + 3 + distance;
+            if (target < 0 || target > (int)chunk->code.size())
+                return false;
+            targets[target] = true;
+        }
+        offset += size;
+    }
+    return true;
+}
+
+/**
+ * @brief SET_LOCAL, keeping the value on the stack
+ *
+ */
+void Translator::setLocal(uint8_t local) {
+    uint16_t value = top();
+    if (failed || local >= stack.size() - 1)
+        return;
+
+    // Slots standing for the local must keep its old value.
+    bool read = false;
+    for (size_t slot = 0; slot + 1 < stack.size(); slot++) {
+        read = read || (slot != local && stack[slot] == local);
+    }
+    size_t valueSlot = stack.size() - 1;
+    if (!read && lastResult == (int)out->code.size() - 1 && value == valueSlot) {
+        // Have the instruction computing the value write the local.
+        out->code[lastResult].a = local;
+        stack[local] = local;
+        stack[valueSlot] = local;
+        lastResult = -1;
+        return;
+    }
+    for (size_t slot = 0; slot + 1 < stack.size(); slot++) {
+        if (slot != local && stack[slot] == local)
+            materialize(slot);
+    }
+    if (value != local)
+        emit(R_MOVE, local, value, 0);
+    stack[local] = local;
+}
+
+void Translator::translate() {
+    // The callee and the parameters are in place.
+    for (int slot = 0; slot <= function->arity; slot++) {
+        push((uint16_t)slot);
+    }
+
+    bool reachable = true;
+    size_t offset = 0;
+    while (offset < chunk->code.size() && !failed) {
+        if (targets[offset]) {
+            auto depth = targetDepths.find((int)offset);
+            if (reachable) {
+                materializeAll();
+                if (depth != targetDepths.end() && depth->second != stack.size()) {
+                    failed = true;
+                    return;
+                }
+            } else {
+                // Only reached by jumping, the stack is the one jumps left.
+                // A target only jumped to from further on, like the
+                // increment of a for loop, takes the depth the code before
+                // it left, its jumps check it.
+                size_t size = depth != targetDepths.end() ? depth->second : deadDepth;
+                stack.clear();
+                for (size_t slot = 0; slot < size; slot++) {
+                    push((uint16_t)slot);
+                }
+                reachable = true;
+            }
+            labels[(int)offset] = out->code.size();
+            labelDepths[(int)offset] = stack.size();
+            lastResult = -1;
+        }
+        if (!reachable) {
+            // Code after a return or a jump nothing jumps to.
+            offset += instructionLength(*chunk, offset);
+            continue;
+        }
+
+        line = chunk->lines[offset];
+        uint8_t op = chunk->code[offset];
+        uint8_t operand = offset + 1 < chunk->code.size() ? chunk->code[offset + 1] : 0;
+        switch (op) {
+            case CONSTANT:
+                push(constant(operand));
+                break;
+            case NIL:
+                push(extraConstant(nilConstant, NIL_VAL));
+                break;
+            case TRUE:
+                push(extraConstant(trueConstant, BOOL_VAL(true)));
+                break;
+            case FALSE:
+                push(extraConstant(falseConstant, BOOL_VAL(false)));
+                break;
+            case POP:
+                pop();
+                break;
+            case DUP:
+                push(top());
+                break;
+            case GET_LOCAL:
+                if (operand >= stack.size()) {
+                    failed = true;
+                    break;
+                }
+                materialize(operand);
+                push(operand);
+                break;
+            case SET_LOCAL:
+                setLocal(operand);
+                break;
+            case GET_GLOBAL:
+                emitResult(R_GET_GLOBAL, constant(operand), 0);
+                break;
+            case DEFINE_GLOBAL:
+                emit(R_DEFINE_GLOBAL, 0, constant(operand), pop());
+                break;
+            case SET_GLOBAL:
+                emit(R_SET_GLOBAL, 0, constant(operand), top());
+                break;
+            case GET_UPVALUE:
+                emitResult(R_GET_UPVALUE, operand, 0);
+                break;
+            case SET_UPVALUE:
+                emit(R_SET_UPVALUE, 0, operand, top());
+                break;
+            case EQUAL:
+                binary(R_EQUAL);
+                break;
+            case GREATER:
+                binary(R_GREATER);
+                break;
+            case LESS:
+                binary(R_LESS);
+                break;
+            case ADD:
+                binary(R_ADD);
+                break;
+            case SUBTRACT:
+                binary(R_SUBTRACT);
+                break;
+            case MULTIPLY:
+                binary(R_MULTIPLY);
+                break;
+            case DIVIDE:
+                binary(R_DIVIDE);
+                break;
+            case NOT:
+                unary(R_NOT);
+                break;
+            case NEGATE:
+                unary(R_NEGATE);
+                break;
+            case PRINT:
+                emit(R_PRINT, 0, pop(), 0);
+                break;
+            case JUMP:
+            case JUMP_IF_FALSE:
+            case LOOP: {
+                int distance = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+                int target = op == LOOP ? (int)offset + 3 - distance : (int)offset + 3 + distance;
+                materializeAll();
+                if (op == JUMP_IF_FALSE) {
+                    jump(R_JUMP_IF_FALSE, top(), target);
+                } else {
+                    jump(op == JUMP ? R_JUMP : R_LOOP, 0, target);
+                    reachable = false;
+                    deadDepth = stack.size();
+                }
+                break;
+            }
+            case CALL:
+            case TAIL_CALL: {
+                materializeAll();
+                if (operand + 1 > (int)stack.size()) {
+                    failed = true;
+                    break;
+                }
+                size_t base = stack.size() - operand - 1;
+                emit(op == CALL ? R_CALL : R_TAIL_CALL, (int)base, operand, 0);
+                stack.resize(base);
+                push((uint16_t)base);
+                break;
+            }
+            case CLOSURE: {
+                // Captured locals must be in their slots.
+                materializeAll();
+                if (offset + 2 > UINT16_MAX) {
+                    failed = true;
+                    break;
+                }
+                emitResult(R_CLOSURE, constant(operand), (uint16_t)(offset + 2));
+                break;
+            }
+            case CLOSE_UPVALUE:
+                materializeAll();
+                emit(R_CLOSE_UPVALUE, (int)stack.size() - 1, 0, 0);
+                pop();
+                break;
+            case RETURN:
+                emit(R_RETURN, 0, pop(), 0);
+                reachable = false;
+                deadDepth = stack.size();
+                break;
+            default:
+                failed = true;
+                break;
+        }
+        offset += instructionLength(*chunk, offset);
+    }
+
+    for (auto &[instruction, target] : jumps) {
+        auto label = labels.find(target);
+        if (label == labels.end() || label->second > UINT16_MAX) {
+            failed = true;
+            return;
+        }
+        RegInstruction &jump = out->code[instruction];
+        if (jump.op == R_JUMP_IF_FALSE)
+            jump.c = (uint16_t)label->second;
+        else
+            jump.b = (uint16_t)label->second;
+    }
+}
+
+void translateRegisters(ObjFunction *function) {
+    Chunk *chunk = function->chunk;
+    RegisterCode *code = new RegisterCode();
+    code->constants = chunk->constants;
+    Translator translator{function, chunk, code};
+    if (!translator.findTargets() || (translator.translate(), translator.failed) || code->code.empty()) {
+        delete code;
+        return;
+    }
+    delete function->registers;
+    function->registers = code;
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "value.h"
+
+// Operands from this value on are constants of RegisterCode::constants,
+// registers below it
+#define REG_CONSTANT 256
+
+/**
+ * @brief Instructions of the register backend, see translateRegisters()
+ *
+ * Registers are the slots of the frame: the callee, parameters and locals
+ * keep the slot they have in the stack code and temporaries take the slot
+ * their value would be pushed to. [a] is a register, [b] and [c] registers
+ * or constants unless noted.
+ */
+enum RegOp : uint8_t {
+    R_MOVE,           // a = b
+    R_GET_GLOBAL,     // a = global named by constant b
+    R_DEFINE_GLOBAL,  // define global b as c
+    R_SET_GLOBAL,     // global b = c, b must exist
+    R_GET_UPVALUE,    // a = upvalue number b
+    R_SET_UPVALUE,    // upvalue number b = c
+    R_EQUAL,          // a = b == c
+    R_GREATER,        // a = b > c
+    R_LESS,           // a = b < c
+    R_ADD,            // a = b + c
+    R_SUBTRACT,       // a = b - c
+    R_MULTIPLY,       // a = b * c
+    R_DIVIDE,         // a = b / c
+    R_NOT,            // a = !b
+    R_NEGATE,         // a = -b
+    R_PRINT,          // print b
+    R_JUMP,           // go to instruction b
+    R_JUMP_IF_FALSE,  // go to instruction c if b is falsey
+    R_LOOP,           // go back to instruction b
+    R_CALL,           // a = a(a + 1, ..., a + b)
+    R_TAIL_CALL,      // R_CALL handing its frame over to a script callee
+    R_CLOSURE,        // a = closure of function b, upvalues described at offset c of the stack code
+    R_CLOSE_UPVALUE,  // close the upvalues of registers a and up
+    R_RETURN,         // return b
+};
+
+// Number of register opcodes, keep it past the last one
+#define REG_OPCODE_COUNT (R_RETURN + 1)
+
+/**
+ * @brief Three-address instruction, [b] and [c] wide enough for a
+ * constant index past REG_CONSTANT or a jump target
+ *
+ */
+struct RegInstruction {
+    uint8_t op;
+    uint8_t a;
+    uint16_t b;
+    uint16_t c;
+};
+
+/**
+ * @brief Register form of a function, run by VM::runRegisters()
+ *
+ */
+struct RegisterCode {
+    std::vector<RegInstruction> code;
+    //! Line of each instruction
+    std::vector<int> lines;
+    //! The chunk's constants, then the ones only register code uses
+    std::vector<Value> constants;
+    //! Registers used from frame->slots on
+    int frameSize = 0;
+
+    void disassemble(const char *name);
+};
+
+const char *regOpName(uint8_t op);
+
+/**
+ * @brief Make compilers translate every function they compile to
+ * register code, set once before compiling
+ *
+ */
+void useRegisterCode(bool enabled);
+bool usesRegisterCode();
+
+/**
+ * @brief Give [function] a register form of its bytecode
+ *
+ * The stack is simulated symbolically: constants and locals are used in
+ * place as operands and only written to the slot they occupy when a jump,
+ * a call or a closure needs the stack as the stack code has it. Functions
+ * using instructions the register loop doesn't run (classes, properties,
+ * imports, iteration) are left without, and run on the stack loop.
+ */
+void translateRegisters(ObjFunction *function);
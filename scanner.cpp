@@ -54,7 +54,7 @@ Token Scanner::scanToken() {
         case ',':
             return makeToken(TOKEN_COMMA);
         case '.':
-            return makeToken(TOKEN_DOT);
+            return makeToken(match('.') ? TOKEN_DOT_DOT : TOKEN_DOT);
         case '-':
             return makeToken(TOKEN_MINUS);
         case '+':
@@ -176,6 +176,8 @@ TokenType Scanner::identifierType() {
                         return checkKeyword(2, 0, "", TOKEN_IF);
                     case 'm':
                         return checkKeyword(2, 4, "port", TOKEN_IMPORT);
+                    case 'n':
+                        return checkKeyword(2, 0, "", TOKEN_IN);
                 }
             }
             break;
@@ -7,7 +7,7 @@ enum TokenType {
   // Single-character tokens.
   TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
   TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
-  TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
+  TOKEN_COMMA, TOKEN_DOT, TOKEN_DOT_DOT, TOKEN_MINUS, TOKEN_PLUS,
   TOKEN_SEMICOLON, TOKEN_SLASH, 
   TOKEN_COLON, TOKEN_QUESTION_MARK,
   // One or two character tokens.
@@ -23,7 +23,7 @@ enum TokenType {
   TOKEN_FOR, TOKEN_FUN, TOKEN_IF, TOKEN_NIL, TOKEN_OR,
   TOKEN_PRINT, TOKEN_RETURN, TOKEN_SUPER, TOKEN_THIS,
   TOKEN_TRUE, TOKEN_VAR, TOKEN_WHILE, TOKEN_SWITCH,
-  TOKEN_CASE, TOKEN_DEFAULT, TOKEN_IMPORT,
+  TOKEN_CASE, TOKEN_DEFAULT, TOKEN_IMPORT, TOKEN_IN,
 
   TOKEN_ERROR, TOKEN_EOF
 } ;
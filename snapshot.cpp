@@ -0,0 +1,798 @@
+#include "snapshot.h"
+
+#include <stdarg.h>
+#include <string.h>
+
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "vm.h"
+
+/**
+ * @brief How a value is written, an object is written as its index in
+ * the object table
+ *
+ */
+enum SnapshotTag : uint8_t {
+    SNAP_NIL,
+    SNAP_FALSE,
+    SNAP_TRUE,
+    SNAP_NUMBER,
+    SNAP_STRING,
+    SNAP_RANGE,
+    SNAP_OBJECT,
+    //! Global of the restoring VM, by name
+    SNAP_BUILTIN,
+    //! Module value of a file whose body did not need one
+    SNAP_NO_MODULE,
+};
+
+enum SnapshotKind : uint8_t {
+    SNAP_FUNCTION,
+    SNAP_CLOSURE,
+    SNAP_UPVALUE,
+    SNAP_CLASS,
+    SNAP_INSTANCE,
+    SNAP_BOUND_METHOD,
+    SNAP_MODULE,
+    SNAP_KIND_COUNT,
+};
+
+struct SnapshotEntry {
+    SnapshotKind kind;
+    Value value;
+    //! Set for SNAP_UPVALUE only, upvalues are not values
+    ObjUpvalue *upvalue;
+};
+
+static const void *objectOf(const Value &value) {
+    switch (value.type) {
+        case VAL_FUNCTION:
+            return AS_FUNCTION(value).get();
+        case VAL_CLOSURE:
+            return AS_CLOSURE(value).get();
+        case VAL_CLASS:
+            return AS_CLASS(value).get();
+        case VAL_INSTANCE:
+            return AS_INSTANCE(value).get();
+        case VAL_BOUND_METHOD:
+            return AS_BOUND_METHOD(value).get();
+        case VAL_MODULE:
+            return AS_MODULE(value).get();
+        case VAL_NATIVE:
+            return value.get<NativeFunction>().get();
+        case VAL_NATIVE_METHOD:
+            return AS_NATIVE_METHOD(value).get();
+        case VAL_NATIVE_CLASS:
+            return value.get<NativeClass>().get();
+        default:
+            return nullptr;
+    }
+}
+
+/**
+ * @brief Values every VM defines on its own, written by name
+ *
+ */
+static bool isBuiltin(const Value &value) {
+    switch (value.type) {
+        case VAL_NATIVE:
+        case VAL_NATIVE_METHOD:
+        case VAL_NATIVE_CLASS:
+            return true;
+        case VAL_CLASS:
+            return AS_CLASS(value)->classType != CLS_USER_DEF;
+        default:
+            return false;
+    }
+}
+
+/**
+ * @brief FNV-1a hash of [bytes], written after the header
+ *
+ */
+static uint64_t checksum(std::string_view bytes, uint64_t hash = 14695981039346656037ull) {
+    for (char c : bytes) {
+        hash = (hash ^ (uint8_t)c) * 1099511628211ull;
+    }
+    return hash;
+}
+
+struct SnapshotWriter {
+    //! Kind of every object, with what allocating it needs
+    std::string shells;
+    //! Contents of every object, in table order
+    std::string bodies;
+    std::vector<SnapshotEntry> entries;
+    std::unordered_map<const void *, uint32_t> ids;
+    //! Builtin objects, by the global naming them in every VM
+    std::unordered_map<const void *, String> builtins;
+    bool failed = false;
+
+    template <class T>
+    void put(std::string &out, T value) {
+        out.append((const char *)&value, sizeof(T));
+    }
+
+    void putString(std::string &out, std::string_view chars) {
+        put<uint32_t>(out, (uint32_t)chars.size());
+        out.append(chars.data(), chars.size());
+    }
+
+    void fail(const char *format, ...) {
+        if (failed)
+            return;
+        failed = true;
+        va_list args;
+        va_start(args, format);
+        vfprintf(stderr, format, args);
+        va_end(args);
+        fputs("\n", stderr);
+    }
+
+    uint32_t intern(const void *object, SnapshotKind kind, const Value &value, ObjUpvalue *upvalue);
+    void value(std::string &out, const Value &value);
+    void body(const SnapshotEntry &entry);
+};
+
+/**
+ * @brief Index of [object] in the table, added on first sight
+ *
+ */
+uint32_t SnapshotWriter::intern(const void *object, SnapshotKind kind, const Value &value, ObjUpvalue *upvalue) {
+    auto it = ids.find(object);
+    if (it != ids.end())
+        return it->second;
+
+    // Restoring a closure needs its function allocated first.
+    uint32_t functionId = 0;
+    if (kind == SNAP_CLOSURE) {
+        Function function = AS_CLOSURE(value)->function;
+        functionId = intern(function.get(), SNAP_FUNCTION, FUNCTION_VAL(function), nullptr);
+    }
+
+    uint32_t id = (uint32_t)entries.size();
+    ids[object] = id;
+    entries.push_back({kind, value, upvalue});
+    put<uint8_t>(shells, kind);
+    if (kind == SNAP_FUNCTION)
+        put<uint32_t>(shells, (uint32_t)AS_FUNCTION(value)->upvalueCount);
+    else if (kind == SNAP_CLOSURE)
+        put<uint32_t>(shells, functionId);
+    return id;
+}
+
+void SnapshotWriter::value(std::string &out, const Value &value) {
+    switch (value.type) {
+        case VAL_NIL:
+            put<uint8_t>(out, SNAP_NIL);
+            return;
+        case VAL_BOOL:
+            put<uint8_t>(out, AS_BOOL(value) ? SNAP_TRUE : SNAP_FALSE);
+            return;
+        case VAL_NUMBER:
+            put<uint8_t>(out, SNAP_NUMBER);
+            put<double>(out, AS_NUMBER(value));
+            return;
+        case VAL_STRING:
+            put<uint8_t>(out, SNAP_STRING);
+            putString(out, AS_STRING(value));
+            return;
+        case VAL_RANGE:
+            put<uint8_t>(out, SNAP_RANGE);
+            put<double>(out, AS_RANGE(value)->from);
+            put<double>(out, AS_RANGE(value)->to);
+            return;
+        case VAL_MODULE:
+            if (AS_MODULE(value) == nullptr) {
+                put<uint8_t>(out, SNAP_NO_MODULE);
+                return;
+            }
+            break;
+        case VAL_FIBER:
+            fail("Can't snapshot a fiber.");
+            return;
+        default:
+            break;
+    }
+
+    const void *object = objectOf(value);
+    auto builtin = builtins.find(object);
+    if (builtin != builtins.end()) {
+        put<uint8_t>(out, SNAP_BUILTIN);
+        putString(out, builtin->second);
+        return;
+    }
+
+    SnapshotKind kind;
+    switch (value.type) {
+        case VAL_FUNCTION:
+            kind = SNAP_FUNCTION;
+            break;
+        case VAL_CLOSURE:
+            kind = SNAP_CLOSURE;
+            break;
+        case VAL_CLASS:
+            if (AS_CLASS(value)->classType != CLS_USER_DEF) {
+                fail("Can't snapshot builtin class '%s' not held by its global.", AS_CLASS(value)->name.c_str());
+                return;
+            }
+            kind = SNAP_CLASS;
+            break;
+        case VAL_INSTANCE:
+            if (AS_INSTANCE(value)->native != nullptr) {
+                fail("Can't snapshot an instance of builtin class '%s'.", AS_INSTANCE(value)->klass->name.c_str());
+                return;
+            }
+            kind = SNAP_INSTANCE;
+            break;
+        case VAL_BOUND_METHOD:
+            kind = SNAP_BOUND_METHOD;
+            break;
+        case VAL_MODULE:
+            kind = SNAP_MODULE;
+            break;
+        default:
+            fail("Can't snapshot a native function not held by its global.");
+            return;
+    }
+    put<uint8_t>(out, SNAP_OBJECT);
+    put<uint32_t>(out, intern(object, kind, value, nullptr));
+}
+
+void SnapshotWriter::body(const SnapshotEntry &entry) {
+    switch (entry.kind) {
+        case SNAP_FUNCTION: {
+            Function function = AS_FUNCTION(entry.value);
+            Chunk *chunk = function->chunk;
+            putString(bodies, function->name);
+            put<int32_t>(bodies, function->arity);
+            put<uint8_t>(bodies, function->optionalArgCount);
+            for (int i = 0; i < function->optionalArgCount; i++) {
+                put<uint16_t>(bodies, function->optionalArguments[i]);
+            }
+            value(bodies, function->module != nullptr ? MODULE_VAL(function->module) : NIL_VAL);
+            putString(bodies, std::string_view((const char *)chunk->code.data(), chunk->code.size()));
+            for (int line : chunk->lines) {
+                put<int32_t>(bodies, line);
+            }
+            put<uint32_t>(bodies, (uint32_t)chunk->constants.size());
+            for (const Value &constant : chunk->constants) {
+                value(bodies, constant);
+            }
+            break;
+        }
+        case SNAP_CLOSURE: {
+            Closure closure = AS_CLOSURE(entry.value);
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                ObjUpvalue *upvalue = closure->upvalues[i];
+                put<uint32_t>(bodies, intern(upvalue, SNAP_UPVALUE, NIL_VAL, upvalue));
+            }
+            break;
+        }
+        case SNAP_UPVALUE:
+            // The VM is not running, every upvalue is closed.
+            value(bodies, *entry.upvalue->location);
+            break;
+        case SNAP_CLASS: {
+            Klass klass = AS_CLASS(entry.value);
+            putString(bodies, klass->name);
+            put<uint8_t>(bodies, klass->final);
+            put<uint32_t>(bodies, (uint32_t)klass->methods.size());
+            for (auto &[name, method] : klass->methods) {
+                putString(bodies, name);
+                value(bodies, method);
+            }
+            break;
+        }
+        case SNAP_INSTANCE: {
+            Instance instance = AS_INSTANCE(entry.value);
+            value(bodies, CLASS_VAL(instance->klass));
+            put<uint8_t>(bodies, instance->frozen);
+            put<uint32_t>(bodies, (uint32_t)instance->fields.size());
+            for (auto &[name, field] : instance->fields) {
+                putString(bodies, name);
+                value(bodies, field);
+            }
+            break;
+        }
+        case SNAP_BOUND_METHOD: {
+            BoundMethod bound = AS_BOUND_METHOD(entry.value);
+            value(bodies, bound->receiver);
+            value(bodies, bound->method);
+            break;
+        }
+        case SNAP_MODULE: {
+            Module module = AS_MODULE(entry.value);
+            putString(bodies, module->name);
+            put<uint32_t>(bodies, (uint32_t)module->variables.size());
+            for (size_t i = 0; i < module->variables.size(); i++) {
+                putString(bodies, i < module->variableNames.size() ? module->variableNames[i] : "");
+                value(bodies, module->variables[i]);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+bool saveSnapshot(VM *vm, const char *path) {
+    if (!vm->lazyModules.empty()) {
+        fprintf(stderr, "Can't snapshot while lazy imports are pending.\n");
+        return false;
+    }
+
+    SnapshotWriter writer;
+    // Builtins are the globals a new VM defines too.
+    VM fresh;
+    for (auto &[name, value] : vm->globals) {
+        if (isBuiltin(value) && fresh.globals.count(name) != 0)
+            writer.builtins.emplace(objectOf(value), name);
+    }
+
+    std::string roots;
+    uint32_t globalCount = 0;
+    std::string globals;
+    for (auto &[name, value] : vm->globals) {
+        auto builtin = writer.builtins.find(objectOf(value));
+        if (isBuiltin(value) && builtin != writer.builtins.end() && builtin->second == name)
+            continue;
+        writer.putString(globals, name);
+        writer.value(globals, value);
+        globalCount++;
+    }
+    writer.put<uint32_t>(roots, globalCount);
+    roots += globals;
+    writer.put<uint32_t>(roots, (uint32_t)vm->modules.size());
+    for (auto &[name, module] : vm->modules) {
+        writer.putString(roots, name);
+        writer.value(roots, module);
+    }
+
+    // Bodies add the objects they reference to the end of the table.
+    for (size_t i = 0; i < writer.entries.size() && !writer.failed; i++) {
+        SnapshotEntry entry = writer.entries[i];
+        writer.body(entry);
+    }
+    if (writer.failed)
+        return false;
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open snapshot \"%s\".\n", path);
+        return false;
+    }
+    std::string header(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    writer.put<uint32_t>(header, SNAPSHOT_VERSION);
+    writer.put<uint32_t>(header, OPCODE_COUNT);
+    writer.put<uint32_t>(header, (uint32_t)writer.entries.size());
+    uint64_t sum = checksum(writer.shells);
+    sum = checksum(writer.bodies, sum);
+    sum = checksum(roots, sum);
+    writer.put<uint64_t>(header, sum);
+    for (const std::string *part : {&header, &writer.shells, &writer.bodies, &roots}) {
+        fwrite(part->data(), 1, part->size(), file);
+    }
+    if (fclose(file) != 0) {
+        fprintf(stderr, "Could not write snapshot \"%s\".\n", path);
+        return false;
+    }
+    return true;
+}
+
+bool readSnapshot(const char *path, std::string *bytes) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open snapshot \"%s\".\n", path);
+        return false;
+    }
+    char buffer[4096];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        bytes->append(buffer, count);
+    }
+    bool failed = ferror(file) != 0;
+    fclose(file);
+    if (failed)
+        fprintf(stderr, "Could not read snapshot \"%s\".\n", path);
+    return !failed;
+}
+
+struct SnapshotReader {
+    VM *vm;
+    const char *current;
+    const char *end;
+    std::vector<SnapshotEntry> objects;
+    //! Set on the first read past the end or inconsistent content
+    bool corrupt = false;
+
+    template <class T>
+    T get() {
+        T value{};
+        if ((size_t)(end - current) < sizeof(T)) {
+            corrupt = true;
+            return value;
+        }
+        memcpy(&value, current, sizeof(T));
+        current += sizeof(T);
+        return value;
+    }
+
+    std::string_view getString() {
+        uint32_t length = get<uint32_t>();
+        if (corrupt || (size_t)(end - current) < length) {
+            corrupt = true;
+            return std::string_view("");
+        }
+        std::string_view chars(current, length);
+        current += length;
+        return chars;
+    }
+
+    //! Object of the table expected to be of [kind]
+    SnapshotEntry *object(SnapshotKind kind) {
+        uint32_t id = get<uint32_t>();
+        if (corrupt || id >= objects.size() || objects[id].kind != kind) {
+            corrupt = true;
+            return nullptr;
+        }
+        return &objects[id];
+    }
+
+    bool shell();
+    Value value();
+    void body(SnapshotEntry &entry);
+};
+
+/**
+ * @brief Whether the operands of every instruction of [function] are in
+ * range of its chunk
+ *
+ * Constants must exist and names be strings, upvalues must be captured by
+ * the function and jumps must land on an instruction. Run on restored
+ * bytecode only, the compiler's is right by construction.
+ */
+static bool validCode(ObjFunction *function) {
+    Chunk *chunk = function->chunk;
+    const std::vector<uint8_t> &code = chunk->code;
+    size_t size = code.size();
+    std::vector<bool> starts(size, false);
+    std::vector<size_t> targets;
+    uint8_t last = RETURN;
+
+    auto constant = [&](size_t index) { return index < chunk->constants.size(); };
+    auto name = [&](size_t index) { return constant(index) && IS_STRING(chunk->constants[index]); };
+
+    for (size_t offset = 0; offset < size;) {
+        starts[offset] = true;
+        uint8_t op = code[offset];
+        last = op;
+        // Also 0 for an opcode that doesn't exist or a CLOSURE of no function.
+        size_t length = instructionLength(*chunk, offset);
+        if (length == 0 || offset + length > size)
+            return false;
+        uint8_t operand = length > 1 ? code[offset + 1] : 0;
+        switch (op) {
+            case CONSTANT:
+                if (!constant(operand))
+                    return false;
+                break;
+            case GET_GLOBAL:
+            case DEFINE_GLOBAL:
+            case SET_GLOBAL:
+            case GET_PROPERTY:
+            case SET_PROPERTY:
+            case GET_SUPER:
+            case CLASS:
+            case METHOD:
+            case IMPORT:
+                if (!name(operand))
+                    return false;
+                break;
+            case GET_UPVALUE:
+            case SET_UPVALUE:
+                if (operand >= function->upvalueCount)
+                    return false;
+                break;
+            case JUMP:
+            case JUMP_IF_FALSE:
+            case LOOP: {
+                size_t distance = (size_t)((code[offset + 1] << 8) | code[offset + 2]);
+                size_t next = offset + 3;
+                if (op == LOOP && distance > next)
+                    return false;
+                targets.push_back(op == LOOP ? next - distance : next + distance);
+                break;
+            }
+            case ITER_NEXT: {
+                size_t distance = (size_t)((code[offset + 2] << 8) | code[offset + 3]);
+                targets.push_back(offset + 4 + distance);
+                break;
+            }
+            case CLOSURE:
+                for (size_t i = offset + 2; i < offset + length; i += 2) {
+                    uint8_t isLocal = code[i];
+                    uint8_t index = code[i + 1];
+                    if (isLocal > 1 || (!isLocal && index >= function->upvalueCount))
+                        return false;
+                }
+                break;
+            default:
+                break;
+        }
+        offset += length;
+    }
+
+    for (size_t target : targets) {
+        if (target >= size || !starts[target])
+            return false;
+    }
+    // Running past the end of the code must not be possible.
+    return size > 0 && (last == RETURN || last == JUMP || last == LOOP);
+}
+
+bool SnapshotReader::shell() {
+    uint8_t kind = get<uint8_t>();
+    if (kind >= SNAP_KIND_COUNT)
+        corrupt = true;
+    if (corrupt)
+        return false;
+
+    SnapshotEntry entry{(SnapshotKind)kind, NIL_VAL, nullptr};
+    switch (entry.kind) {
+        case SNAP_FUNCTION: {
+            uint32_t upvalueCount = get<uint32_t>();
+            // Upvalues are indexed by one byte operands.
+            if (upvalueCount > UINT8_MAX) {
+                corrupt = true;
+                return false;
+            }
+            Function function = std::make_shared<ObjFunction>();
+            function->upvalueCount = (int)upvalueCount;
+            entry.value = FUNCTION_VAL(function);
+            break;
+        }
+        case SNAP_CLOSURE: {
+            SnapshotEntry *function = object(SNAP_FUNCTION);
+            if (function == nullptr)
+                return false;
+            entry.value = CLOSURE_VAL(std::make_shared<ObjClosure>(AS_FUNCTION(function->value)));
+            break;
+        }
+        case SNAP_UPVALUE:
+            entry.upvalue = new ObjUpvalue(nullptr);
+            entry.upvalue->location = &entry.upvalue->closed;
+            break;
+        case SNAP_CLASS:
+            entry.value = CLASS_VAL(std::make_shared<ObjClass>(""));
+            break;
+        case SNAP_INSTANCE:
+            entry.value = INSTANCE_VAL(std::make_shared<ObjInstance>(nullptr));
+            break;
+        case SNAP_BOUND_METHOD:
+            entry.value = BOUND_METHOD_VAL(std::make_shared<ObjBoundMethod>(NIL_VAL, NIL_VAL));
+            break;
+        case SNAP_MODULE:
+            entry.value = MODULE_VAL(std::make_shared<ObjModule>(""));
+            break;
+        default:
+            break;
+    }
+    objects.push_back(entry);
+    return !corrupt;
+}
+
+Value SnapshotReader::value() {
+    switch (get<uint8_t>()) {
+        case SNAP_NIL:
+            return NIL_VAL;
+        case SNAP_FALSE:
+            return BOOL_VAL(false);
+        case SNAP_TRUE:
+            return BOOL_VAL(true);
+        case SNAP_NUMBER:
+            return NUMBER_VAL(get<double>());
+        case SNAP_STRING:
+            return STRING_VAL(getString());
+        case SNAP_RANGE: {
+            double from = get<double>();
+            double to = get<double>();
+            return RANGE_VAL(std::make_shared<ObjRange>(from, to));
+        }
+        case SNAP_NO_MODULE:
+            return MODULE_VAL(Module(nullptr));
+        case SNAP_BUILTIN: {
+            String name(getString());
+            auto it = vm->globals.find(name);
+            if (!corrupt && it == vm->globals.end()) {
+                fprintf(stderr, "Snapshot needs builtin '%s'.\n", name.c_str());
+                corrupt = true;
+            }
+            return corrupt ? NIL_VAL : it->second;
+        }
+        case SNAP_OBJECT: {
+            uint32_t id = get<uint32_t>();
+            if (corrupt || id >= objects.size() || objects[id].kind == SNAP_UPVALUE) {
+                corrupt = true;
+                return NIL_VAL;
+            }
+            return objects[id].value;
+        }
+        default:
+            corrupt = true;
+            return NIL_VAL;
+    }
+}
+
+void SnapshotReader::body(SnapshotEntry &entry) {
+    switch (entry.kind) {
+        case SNAP_FUNCTION: {
+            Function function = AS_FUNCTION(entry.value);
+            Chunk *chunk = function->chunk;
+            function->name = getString();
+            function->arity = get<int32_t>();
+            if (function->arity < 0 || function->arity > MAX_ARGS)
+                corrupt = true;
+            function->optionalArgCount = get<uint8_t>();
+            for (int i = 0; i < function->optionalArgCount; i++) {
+                function->optionalArguments[i] = get<uint16_t>();
+            }
+            Value module = value();
+            if (IS_MODULE(module))
+                function->module = AS_MODULE(module);
+            else if (!IS_NIL(module))
+                corrupt = true;
+            std::string_view code = getString();
+            chunk->code.assign(code.begin(), code.end());
+            chunk->lines.resize(code.size());
+            for (size_t i = 0; i < code.size() && !corrupt; i++) {
+                chunk->lines[i] = get<int32_t>();
+            }
+            chunk->feedback.assign(code.size(), 0);
+            uint32_t constantCount = get<uint32_t>();
+            for (uint32_t i = 0; i < constantCount && !corrupt; i++) {
+                chunk->constants.push_back(value());
+            }
+            for (int i = 0; i < function->optionalArgCount; i++) {
+                uint16_t constant = function->optionalArguments[i];
+                if (constant != NEW_LIST_PARAM_VALUE && constant != NEW_HASH_PARAM_VALUE &&
+                    constant >= chunk->constants.size())
+                    corrupt = true;
+            }
+            if (!corrupt && !validCode(function.get()))
+                corrupt = true;
+            break;
+        }
+        case SNAP_CLOSURE: {
+            Closure closure = AS_CLOSURE(entry.value);
+            for (int i = 0; i < closure->upvalueCount && !corrupt; i++) {
+                SnapshotEntry *upvalue = object(SNAP_UPVALUE);
+                if (upvalue != nullptr)
+                    closure->upvalues[i] = upvalue->upvalue;
+            }
+            break;
+        }
+        case SNAP_UPVALUE:
+            entry.upvalue->closed = value();
+            break;
+        case SNAP_CLASS: {
+            Klass klass = AS_CLASS(entry.value);
+            klass->name = getString();
+            klass->final = get<uint8_t>() != 0;
+            uint32_t methodCount = get<uint32_t>();
+            for (uint32_t i = 0; i < methodCount && !corrupt; i++) {
+                String name(getString());
+                klass->methods[name] = value();
+            }
+            break;
+        }
+        case SNAP_INSTANCE: {
+            Instance instance = AS_INSTANCE(entry.value);
+            Value klass = value();
+            if (!IS_CLASS(klass)) {
+                corrupt = true;
+                break;
+            }
+            instance->klass = AS_CLASS(klass);
+            instance->frozen = get<uint8_t>() != 0;
+            uint32_t fieldCount = get<uint32_t>();
+            for (uint32_t i = 0; i < fieldCount && !corrupt; i++) {
+                String name(getString());
+                instance->fields[name] = value();
+            }
+            break;
+        }
+        case SNAP_BOUND_METHOD: {
+            BoundMethod bound = AS_BOUND_METHOD(entry.value);
+            bound->receiver = value();
+            bound->method = value();
+            break;
+        }
+        case SNAP_MODULE: {
+            Module module = AS_MODULE(entry.value);
+            module->name = getString();
+            uint32_t variableCount = get<uint32_t>();
+            for (uint32_t i = 0; i < variableCount && !corrupt; i++) {
+                module->variableNames.emplace_back(getString());
+                module->variables.push_back(value());
+            }
+            break;
+        }
+        default:
+            corrupt = true;
+            break;
+    }
+}
+
+bool restoreSnapshot(VM *vm, const std::string &bytes) {
+    SnapshotReader reader{vm, bytes.data(), bytes.data() + bytes.size()};
+    if (bytes.size() < sizeof(SNAPSHOT_MAGIC) || memcmp(bytes.data(), SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+        fprintf(stderr, "Not a snapshot.\n");
+        return false;
+    }
+    reader.current += sizeof(SNAPSHOT_MAGIC);
+    uint32_t version = reader.get<uint32_t>();
+    uint32_t opcodeCount = reader.get<uint32_t>();
+    if (version != SNAPSHOT_VERSION || opcodeCount != OPCODE_COUNT) {
+        fprintf(stderr, "Snapshot was written by another version of izi.\n");
+        return false;
+    }
+
+    uint32_t objectCount = reader.get<uint32_t>();
+    uint64_t sum = reader.get<uint64_t>();
+    if (reader.corrupt || sum != checksum(std::string_view(reader.current, reader.end - reader.current))) {
+        fprintf(stderr, "Snapshot is corrupt.\n");
+        return false;
+    }
+    // A shell takes one byte at least.
+    if (objectCount <= bytes.size())
+        reader.objects.reserve(objectCount);
+    for (uint32_t i = 0; i < objectCount && reader.shell(); i++) {
+    }
+    for (size_t i = 0; i < reader.objects.size() && !reader.corrupt; i++) {
+        reader.body(reader.objects[i]);
+    }
+
+    std::vector<std::pair<String, Value>> globals;
+    uint32_t globalCount = reader.get<uint32_t>();
+    for (uint32_t i = 0; i < globalCount && !reader.corrupt; i++) {
+        String name(reader.getString());
+        globals.emplace_back(name, reader.value());
+    }
+    std::vector<std::pair<String, Value>> modules;
+    uint32_t moduleCount = reader.get<uint32_t>();
+    for (uint32_t i = 0; i < moduleCount && !reader.corrupt; i++) {
+        String name(reader.getString());
+        Value module = reader.value();
+        if (!IS_MODULE(module))
+            reader.corrupt = true;
+        modules.emplace_back(name, module);
+    }
+
+    if (reader.corrupt || reader.current != reader.end) {
+        // No closure owns the restored upvalues yet.
+        for (SnapshotEntry &entry : reader.objects) {
+            if (entry.kind == SNAP_UPVALUE)
+                delete entry.upvalue;
+        }
+        fprintf(stderr, "Snapshot is corrupt.\n");
+        return false;
+    }
+    // Register code isn't written, it comes from the restored bytecode.
+    if (usesRegisterCode()) {
+        for (SnapshotEntry &entry : reader.objects) {
+            if (entry.kind == SNAP_FUNCTION)
+                translateRegisters(AS_FUNCTION(entry.value).get());
+        }
+    }
+    for (auto &[name, value] : globals) {
+        vm->globals[name] = value;
+    }
+    for (auto &[name, module] : modules) {
+        vm->modules[name] = module;
+    }
+    vm->globalsVersion++;
+    return true;
+}
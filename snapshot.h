@@ -0,0 +1,40 @@
+#pragma once
+
+#include <string>
+
+// First bytes of a snapshot file
+#define SNAPSHOT_MAGIC "IZISNAP"
+// Bumped whenever the layout of a snapshot changes
+#define SNAPSHOT_VERSION 2
+
+struct VM;
+
+/**
+ * @brief Write the globals and loaded modules of [vm] to [path], with
+ * everything they reference
+ *
+ * Meant to be taken once a script has run its initialization, while the
+ * VM is not running. Builtins are written by the name of their global and
+ * taken from the VM restoring the snapshot. Fails on fibers, modules
+ * pending a lazy import and instances of builtin classes holding native
+ * state.
+ */
+bool saveSnapshot(VM *vm, const char *path);
+
+/**
+ * @brief Read the snapshot file at [path] into [bytes]
+ *
+ */
+bool readSnapshot(const char *path, std::string *bytes);
+
+/**
+ * @brief Recreate the objects of a snapshot in [vm] and install its
+ * globals and modules
+ *
+ * Every object is allocated from the table at the start of the snapshot,
+ * then filled in one pass with references resolved by index. A checksum
+ * covers everything past the header and the operands of every restored
+ * instruction are checked against its chunk. [vm] is left untouched when
+ * the snapshot can't be restored.
+ */
+bool restoreSnapshot(VM *vm, const std::string &bytes);
@@ -0,0 +1,628 @@
+#include "task.h"
+
+#include <algorithm>
+#include <unordered_set>
+
+#include "channel.h"
+#include "vm.h"
+
+// Hidden global holding the Task class, the space keeps it out of reach of
+// scripts.
+#define TASK_CLASS " Task"
+
+static const void *objectOf(const Value &value) {
+    switch (value.type) {
+        case VAL_CLOSURE:
+            return AS_CLOSURE(value).get();
+        case VAL_CLASS:
+            return AS_CLASS(value).get();
+        case VAL_INSTANCE:
+            return AS_INSTANCE(value).get();
+        case VAL_BOUND_METHOD:
+            return AS_BOUND_METHOD(value).get();
+        default:
+            return nullptr;
+    }
+}
+
+static bool copyClosure(Closure closure, Value *copy, CopyMap &copies) {
+    freezeFunction(closure->function);
+    Closure result = std::make_shared<ObjClosure>(closure->function);
+    *copy = CLOSURE_VAL(result);
+    copies.objects[closure.get()] = *copy;
+
+    for (int i = 0; i < closure->upvalueCount; i++) {
+        ObjUpvalue *upvalue = closure->upvalues[i];
+        auto it = copies.upvalues.find(upvalue);
+        if (it != copies.upvalues.end()) {
+            result->upvalues[i] = it->second;
+            continue;
+        }
+        // The copy is closed, whether the variable was still on the stack or not.
+        ObjUpvalue *moved = new ObjUpvalue(nullptr);
+        moved->location = &moved->closed;
+        copies.upvalues[upvalue] = moved;
+        result->upvalues[i] = moved;
+        if (!copyValue(*upvalue->location, &moved->closed, copies))
+            return false;
+    }
+    return true;
+}
+
+static bool copyClass(Klass klass, Value *copy, CopyMap &copies) {
+    Klass result = std::make_shared<ObjClass>(klass->name, klass->final);
+    result->classType = klass->classType;
+    *copy = CLASS_VAL(result);
+    copies.objects[klass.get()] = *copy;
+
+    for (auto &[name, method] : klass->methods) {
+        if (!copyValue(method, &result->methods[name], copies))
+            return false;
+    }
+    return true;
+}
+
+static bool copyInstance(Instance instance, Value *copy, CopyMap &copies) {
+    if (instance->frozen) {
+        *copy = INSTANCE_VAL(instance);
+        return true;
+    }
+    // Native state can't be duplicated.
+    if (instance->native != nullptr)
+        return false;
+
+    Value klass;
+    if (!copyValue(CLASS_VAL(instance->klass), &klass, copies))
+        return false;
+    Instance result = std::make_shared<ObjInstance>(AS_CLASS(klass));
+    *copy = INSTANCE_VAL(result);
+    copies.objects[instance.get()] = *copy;
+
+    for (auto &[name, field] : instance->fields) {
+        if (!copyValue(field, &result->fields[name], copies))
+            return false;
+    }
+    return true;
+}
+
+bool copyValue(const Value &value, Value *copy, CopyMap &copies) {
+    switch (value.type) {
+        case VAL_BOOL:
+        case VAL_NIL:
+        case VAL_NUMBER:
+        case VAL_RANGE:
+        case VAL_NATIVE:
+        case VAL_NATIVE_METHOD:
+            *copy = value;
+            return true;
+        case VAL_STRING:
+            // Flatten a rope while it has a single owner, the copy is only read.
+            AS_STR(value).view();
+            *copy = value;
+            return true;
+        case VAL_FUNCTION:
+            freezeFunction(AS_FUNCTION(value));
+            *copy = value;
+            return true;
+        default:
+            break;
+    }
+
+    auto it = copies.objects.find(objectOf(value));
+    if (it != copies.objects.end()) {
+        *copy = it->second;
+        return true;
+    }
+
+    switch (value.type) {
+        case VAL_CLOSURE:
+            return copyClosure(AS_CLOSURE(value), copy, copies);
+        case VAL_CLASS:
+            return copyClass(AS_CLASS(value), copy, copies);
+        case VAL_INSTANCE:
+            return copyInstance(AS_INSTANCE(value), copy, copies);
+        case VAL_BOUND_METHOD: {
+            BoundMethod bound = AS_BOUND_METHOD(value);
+            Value receiver, method;
+            if (!copyValue(bound->receiver, &receiver, copies) || !copyValue(bound->method, &method, copies))
+                return false;
+            *copy = BOUND_METHOD_VAL(std::make_shared<ObjBoundMethod>(receiver, method));
+            copies.objects[bound.get()] = *copy;
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+/**
+ * @brief Whether [value] and everything it references can be frozen,
+ * changing nothing
+ *
+ */
+static bool canFreeze(const Value &value, std::unordered_set<const ObjInstance *> &visited) {
+    switch (value.type) {
+        case VAL_BOOL:
+        case VAL_NIL:
+        case VAL_NUMBER:
+        case VAL_RANGE:
+        case VAL_NATIVE:
+        case VAL_NATIVE_METHOD:
+        case VAL_STRING:
+        case VAL_FUNCTION:
+            return true;
+        case VAL_INSTANCE:
+            break;
+        default:
+            return false;
+    }
+
+    Instance instance = AS_INSTANCE(value);
+    if (instance->frozen || !visited.insert(instance.get()).second)
+        return true;
+    if (instance->klass->classType != CLS_USER_DEF || instance->native != nullptr)
+        return false;
+
+    // Threads sharing the instance call the methods of its class.
+    for (auto &[name, method] : instance->klass->methods) {
+        if (IS_CLOSURE(method) && AS_CLOSURE(method)->upvalueCount > 0)
+            return false;
+    }
+    for (auto &[name, field] : instance->fields) {
+        if (!canFreeze(field, visited))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Freeze [value], which canFreeze() accepted
+ *
+ */
+static void freezeAccepted(const Value &value) {
+    switch (value.type) {
+        case VAL_STRING:
+            AS_STR(value).view();
+            return;
+        case VAL_FUNCTION:
+            freezeFunction(AS_FUNCTION(value));
+            return;
+        case VAL_INSTANCE:
+            break;
+        default:
+            return;
+    }
+
+    Instance instance = AS_INSTANCE(value);
+    if (instance->frozen)
+        return;
+    for (auto &[name, method] : instance->klass->methods) {
+        if (IS_CLOSURE(method))
+            freezeFunction(AS_CLOSURE(method)->function);
+    }
+    instance->frozen = true;
+    for (auto &[name, field] : instance->fields) {
+        freezeAccepted(field);
+    }
+}
+
+bool freezeValue(const Value &value) {
+    // Checked first, an instance frozen halfway would be shared by threads
+    // while still referencing mutable objects.
+    std::unordered_set<const ObjInstance *> visited;
+    if (!canFreeze(value, visited))
+        return false;
+    freezeAccepted(value);
+    return true;
+}
+
+/**
+ * @brief VM of a worker thread, one per level of nested task
+ *
+ */
+struct Isolate {
+    VM vm;
+    //! Globals of [vm] before any task ran, the natives
+    std::unordered_map<std::string, Value> builtins = vm.globals;
+};
+
+static thread_local TaskPool *currentPool = nullptr;
+static thread_local size_t currentWorker = 0;
+// A task joining another one runs tasks itself, in the next isolate.
+static thread_local std::vector<std::unique_ptr<Isolate>> isolates;
+static thread_local size_t isolateDepth = 0;
+
+static void runTask(std::shared_ptr<Task> task) {
+    if (isolates.size() == isolateDepth)
+        isolates.push_back(std::make_unique<Isolate>());
+    Isolate &isolate = *isolates[isolateDepth];
+    isolateDepth++;
+
+    // Every task starts from the globals of its spawn, whatever the tasks run
+    // before it in this isolate wrote.
+    isolate.vm.globals = isolate.builtins;
+    isolate.vm.globalsVersion++;
+    CopyMap globalCopies;
+    for (auto &[name, value] : task->globals->values) {
+        Value copy;
+        if (copyValue(value, &copy, globalCopies))
+            isolate.vm.globals[name] = copy;
+    }
+
+    Value result = NIL_VAL;
+    bool failed = isolate.vm.callFunction(task->callee, task->args, &result) != INTERPRET_OK;
+    Value copy = NIL_VAL;
+    CopyMap copies;
+    if (!failed && !copyValue(result, &copy, copies)) {
+        fprintf(stderr, "Can't return a fiber, module or task from a task.\n");
+        failed = true;
+    }
+    isolateDepth--;
+
+    task->callee = NIL_VAL;
+    task->args.clear();
+    {
+        std::lock_guard<std::mutex> guard(task->lock);
+        task->done = true;
+        task->failed = failed;
+        task->result = copy;
+    }
+    task->finished.notify_all();
+}
+
+TaskPool::TaskPool(size_t size)
+    : workers(new Worker[TASK_POOL_MAX_WORKERS]), workerCount(0), size(size), pending(0), nextWorker(0), stopping(false) {
+    std::lock_guard<std::mutex> guard(sleepLock);
+    while (workerCount < size) {
+        startWorker();
+    }
+}
+
+TaskPool::~TaskPool() {
+    // Workers parked on a channel would never come back to be joined.
+    stopChannels();
+    {
+        std::lock_guard<std::mutex> guard(sleepLock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (size_t i = 0; i < workerCount; i++) {
+        workers[i].thread.join();
+    }
+}
+
+TaskPool &TaskPool::shared() {
+    static TaskPool pool(std::max(1u, std::thread::hardware_concurrency()));
+    return pool;
+}
+
+// Called with sleepLock held.
+void TaskPool::startWorker() {
+    size_t index = workerCount;
+    workers[index].thread = std::thread(&TaskPool::work, this, index);
+    workerCount++;
+}
+
+/**
+ * @brief Start workers while tasks wait, no worker is idle and some are
+ * blocked, so blocked workers can't starve the pool
+ *
+ * Called with sleepLock held.
+ */
+void TaskPool::compensate() {
+    while (pending > 0 && idle == 0 && workerCount < size + blocked && workerCount < TASK_POOL_MAX_WORKERS) {
+        startWorker();
+    }
+}
+
+void TaskPool::submit(std::shared_ptr<Task> task) {
+    size_t index = currentPool == this ? currentWorker : nextWorker++ % workerCount;
+    {
+        std::lock_guard<std::mutex> guard(workers[index].lock);
+        workers[index].queue.push_back(task);
+    }
+    {
+        std::lock_guard<std::mutex> guard(sleepLock);
+        pending++;
+        compensate();
+    }
+    wake.notify_one();
+}
+
+/**
+ * @brief Newest task of worker [index], or the oldest of another worker
+ *
+ */
+std::shared_ptr<Task> TaskPool::take(size_t index) {
+    size_t count = workerCount;
+    for (size_t i = 0; i < count; i++) {
+        Worker &worker = workers[(index + i) % count];
+        std::lock_guard<std::mutex> guard(worker.lock);
+        if (worker.queue.empty())
+            continue;
+
+        std::shared_ptr<Task> task;
+        if (i == 0) {
+            task = worker.queue.back();
+            worker.queue.pop_back();
+        } else {
+            task = worker.queue.front();
+            worker.queue.pop_front();
+        }
+        pending--;
+        return task;
+    }
+    return nullptr;
+}
+
+/**
+ * @brief Run [task] on the calling worker, then wake the workers joining
+ * tasks, it may be theirs
+ *
+ */
+void TaskPool::run(std::shared_ptr<Task> task) {
+    runTask(task);
+    std::lock_guard<std::mutex> guard(sleepLock);
+    if (joining > 0)
+        wake.notify_all();
+}
+
+void TaskPool::work(size_t index) {
+    currentPool = this;
+    currentWorker = index;
+    for (;;) {
+        std::shared_ptr<Task> task = take(index);
+        if (task != nullptr) {
+            run(task);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> guard(sleepLock);
+        idle++;
+        wake.wait(guard, [this] { return stopping || pending > 0; });
+        idle--;
+        if (stopping)
+            return;
+    }
+}
+
+/**
+ * @brief Tell the pool the calling worker is about to block, or is done
+ * blocking, outside of a join
+ *
+ * Does nothing outside of a worker.
+ */
+void TaskPool::blocking(bool isBlocked) {
+    TaskPool *pool = currentPool;
+    if (pool == nullptr)
+        return;
+
+    std::lock_guard<std::mutex> guard(pool->sleepLock);
+    if (isBlocked) {
+        pool->blocked++;
+        pool->compensate();
+    } else {
+        pool->blocked--;
+    }
+}
+
+/**
+ * @brief Block until [task] is done
+ *
+ * A worker keeps running queued tasks meanwhile, the task it waits for may
+ * be one of them. It sleeps with the idle workers in between, woken by
+ * submit() and by every task finishing.
+ */
+void TaskPool::wait(std::shared_ptr<Task> task) {
+    if (currentPool != this) {
+        std::unique_lock<std::mutex> guard(task->lock);
+        task->finished.wait(guard, [&] { return task->done.load(); });
+        return;
+    }
+
+    while (!task->done) {
+        std::shared_ptr<Task> other = take(currentWorker);
+        if (other != nullptr) {
+            run(other);
+            continue;
+        }
+        std::unique_lock<std::mutex> guard(sleepLock);
+        joining++;
+        wake.wait(guard, [&] { return task->done || pending > 0 || stopping; });
+        joining--;
+        // Left to itself once the pool stops, the task never finishes.
+        if (stopping)
+            return;
+    }
+}
+
+/**
+ * @brief Names of the globals a spawned call can use
+ *
+ * The code of every function reachable from the callee and its arguments
+ * is scanned for global instructions, then the functions held by the
+ * globals found, until no new name turns up.
+ */
+struct GlobalNames {
+    VM *vm;
+    std::unordered_set<std::string> names;
+    std::unordered_set<const void *> visited;
+    std::vector<Value> pending;
+
+    void collect(const Value &root);
+    void scan(ObjFunction *function);
+};
+
+void GlobalNames::collect(const Value &root) {
+    pending.push_back(root);
+    while (!pending.empty()) {
+        Value value = pending.back();
+        pending.pop_back();
+        const void *object = value.type == VAL_FUNCTION ? AS_FUNCTION(value).get() : objectOf(value);
+        if (object == nullptr || !visited.insert(object).second)
+            continue;
+        switch (value.type) {
+            case VAL_FUNCTION:
+                scan(AS_FUNCTION(value).get());
+                break;
+            case VAL_CLOSURE: {
+                Closure closure = AS_CLOSURE(value);
+                pending.push_back(FUNCTION_VAL(closure->function));
+                for (int i = 0; i < closure->upvalueCount; i++) {
+                    pending.push_back(*closure->upvalues[i]->location);
+                }
+                break;
+            }
+            case VAL_CLASS:
+                for (auto &[name, method] : AS_CLASS(value)->methods) {
+                    pending.push_back(method);
+                }
+                break;
+            case VAL_INSTANCE: {
+                Instance instance = AS_INSTANCE(value);
+                pending.push_back(CLASS_VAL(instance->klass));
+                for (auto &[name, field] : instance->fields) {
+                    pending.push_back(field);
+                }
+                break;
+            }
+            case VAL_BOUND_METHOD:
+                pending.push_back(AS_BOUND_METHOD(value)->receiver);
+                pending.push_back(AS_BOUND_METHOD(value)->method);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+void GlobalNames::scan(ObjFunction *function) {
+    Chunk *chunk = function->chunk;
+    for (const Value &constant : chunk->constants) {
+        if (IS_FUNCTION(constant))
+            pending.push_back(constant);
+    }
+    const std::vector<uint8_t> &code = chunk->code;
+    size_t offset = 0;
+    while (offset < code.size()) {
+        uint8_t op = code[offset];
+        if ((op == GET_GLOBAL || op == DEFINE_GLOBAL || op == SET_GLOBAL) && offset + 1 < code.size()) {
+            std::string name(AS_STRING(chunk->constants[code[offset + 1]]));
+            if (names.insert(name).second) {
+                auto global = vm->globals.find(name);
+                if (global != vm->globals.end())
+                    pending.push_back(global->second);
+            }
+        }
+        size_t length = instructionLength(*chunk, offset);
+        if (length == 0)
+            break;
+        offset += length;
+    }
+}
+
+/**
+ * @brief Copy of the globals of [vm] named in [names]
+ *
+ * The last copy is handed out again while no global changed and it holds
+ * every name, otherwise a new one is made with the names of both, in one
+ * pass so objects shared between globals stay shared.
+ */
+static std::shared_ptr<const TaskGlobals> globalsForTasks(VM *vm, std::unordered_set<std::string> &names) {
+    std::shared_ptr<const TaskGlobals> last = vm->taskGlobals;
+    if (last != nullptr && last->version == vm->globalsVersion) {
+        bool covered = std::all_of(names.begin(), names.end(),
+                                   [&](const std::string &name) { return last->names.count(name) != 0; });
+        if (covered)
+            return last;
+        names.insert(last->names.begin(), last->names.end());
+    }
+
+    std::shared_ptr<TaskGlobals> globals = std::make_shared<TaskGlobals>();
+    globals->version = vm->globalsVersion;
+    CopyMap copies;
+    for (const std::string &name : names) {
+        auto global = vm->globals.find(name);
+        Value copy;
+        if (global != vm->globals.end() && copyValue(global->second, &copy, copies))
+            globals->values[name] = copy;
+    }
+    globals->names = std::move(names);
+    vm->taskGlobals = globals;
+    return globals;
+}
+
+/**
+ * @brief spawn(fn, args...) calls [fn] on the task pool and returns a Task
+ *
+ * The task gets copies of the function, the arguments and the globals its
+ * code names, and runs in a VM of its own.
+ */
+static Value spawnNative(VM *vm, int argCount, Value *args) {
+    if (argCount < 1 || !(IS_CLOSURE(args[0]) || IS_NATIVE(args[0]) || IS_BOUND_METHOD(args[0]))) {
+        vm->runtimeError("spawn() expects a function and its arguments.");
+        return NIL_VAL;
+    }
+
+    std::shared_ptr<Task> task = std::make_shared<Task>();
+    CopyMap copies;
+    bool copied = copyValue(args[0], &task->callee, copies);
+    for (int i = 1; copied && i < argCount; i++) {
+        task->args.emplace_back();
+        copied = copyValue(args[i], &task->args.back(), copies);
+    }
+    if (!copied) {
+        vm->runtimeError("Can't send a fiber, module or task to a task.");
+        return NIL_VAL;
+    }
+    GlobalNames names{vm};
+    for (int i = 0; i < argCount; i++) {
+        names.collect(args[i]);
+    }
+    task->globals = globalsForTasks(vm, names.names);
+
+    Instance instance = std::make_shared<ObjInstance>(AS_CLASS(vm->globals[TASK_CLASS]));
+    instance->native = task;
+    TaskPool::shared().submit(task);
+    return INSTANCE_VAL(instance);
+}
+
+/**
+ * @brief freeze(instance) makes it immutable and returns it
+ *
+ */
+static Value freezeNative(VM *vm, int argCount, Value *args) {
+    if (argCount != 1 || !freezeValue(args[0])) {
+        vm->runtimeError("Only instances of classes whose methods capture no variable, with immutable fields, can be frozen.");
+        return NIL_VAL;
+    }
+    return args[0];
+}
+
+/**
+ * @brief task.join() waits for the task and returns its result
+ *
+ */
+static Value taskJoin(VM *vm, Value receiver, int argCount, Value *args) {
+    std::shared_ptr<Task> task = std::static_pointer_cast<Task>(AS_INSTANCE(receiver)->native);
+    if (task == nullptr) {
+        vm->runtimeError("Tasks are created by spawn().");
+        return NIL_VAL;
+    }
+
+    TaskPool::shared().wait(task);
+    if (task->failed) {
+        vm->runtimeError("Task failed.");
+        return NIL_VAL;
+    }
+    return task->result;
+}
+
+void defineTasks(VM *vm) {
+    vm->defineNative("spawn", spawnNative);
+    vm->defineNative("freeze", freezeNative);
+
+    Value task = vm->defineBuiltinClass("Task", CLS_THREAD);
+    vm->defineNativeMethod(task, taskJoin, "join", 0, false);
+    vm->globals[TASK_CLASS] = task;
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "value.h"
+
+// Bound on the threads a pool starts to replace blocked workers
+#define TASK_POOL_MAX_WORKERS 256
+
+struct VM;
+
+/**
+ * @brief Objects already copied by one copyValue() pass, so shared and
+ * cyclic references stay shared in the copy
+ *
+ */
+struct CopyMap {
+    std::unordered_map<const void *, Value> objects;
+    std::unordered_map<ObjUpvalue *, ObjUpvalue *> upvalues;
+};
+
+/**
+ * @brief Copy [value] so that it can move to another thread
+ *
+ * Mutable objects are copied deeply; immutable ones, like strings,
+ * functions and frozen instances, are shared. Functions get frozen. Fails
+ * on values tied to one VM, such as fibers, modules and tasks.
+ */
+bool copyValue(const Value &value, Value *copy, CopyMap &copies);
+
+/**
+ * @brief Make [value] and everything it references immutable
+ *
+ * Only instances of script classes whose methods capture no variable, with
+ * fields holding immutable values, can be frozen. Nothing is frozen when
+ * it fails.
+ */
+bool freezeValue(const Value &value);
+
+/**
+ * @brief Globals of a VM as copied for its tasks
+ *
+ * Only the globals named by the code a task can reach are copied. The
+ * copies are never run, each task gets copies of them of its own.
+ */
+struct TaskGlobals {
+    //! globalsVersion of the VM when copied
+    size_t version;
+    //! Globals asked for, [values] holds the ones defined and copyable
+    std::unordered_set<std::string> names;
+    std::unordered_map<std::string, Value> values;
+};
+
+/**
+ * @brief Call run by a pool worker, and its outcome
+ *
+ * The callee, arguments and result are copies owned by the task alone.
+ */
+struct Task {
+    Value callee;
+    std::vector<Value> args;
+    std::shared_ptr<const TaskGlobals> globals;
+
+    std::mutex lock;
+    std::condition_variable finished;
+    //! Set once [result] is, read without the lock by joining workers
+    std::atomic<bool> done{false};
+    bool failed = false;
+    Value result;
+};
+
+/**
+ * @brief Work-stealing pool of threads, each owning a VM isolate
+ *
+ * A worker runs the tasks of its own queue last in first out and steals
+ * the oldest task of another queue when its own is empty. Tasks submitted
+ * from a worker go to its own queue. A worker joining a task runs queued
+ * tasks meanwhile; one blocking on anything else is replaced by a new
+ * worker while tasks are waiting.
+ */
+struct TaskPool {
+    explicit TaskPool(size_t size);
+    ~TaskPool();
+    void submit(std::shared_ptr<Task> task);
+    void wait(std::shared_ptr<Task> task);
+
+    //! Pool shared by every VM of the process, started on first use
+    static TaskPool &shared();
+    static void blocking(bool isBlocked);
+
+   private:
+    struct Worker {
+        std::mutex lock;
+        std::deque<std::shared_ptr<Task>> queue;
+        std::thread thread;
+    };
+
+    //! Slots for every worker the pool may start, only [workerCount] run
+    std::unique_ptr<Worker[]> workers;
+    std::atomic<size_t> workerCount;
+    //! Workers running when none is blocked
+    size_t size;
+    std::mutex sleepLock;
+    std::condition_variable wake;
+    std::atomic<size_t> pending;
+    std::atomic<size_t> nextWorker;
+    std::atomic<bool> stopping;
+    // Guarded by sleepLock
+    size_t idle = 0;
+    size_t blocked = 0;
+    //! Workers sleeping in wait() on [wake]
+    size_t joining = 0;
+
+    std::shared_ptr<Task> take(size_t index);
+    void run(std::shared_ptr<Task> task);
+    void work(size_t index);
+    void startWorker();
+    void compensate();
+};
+
+/**
+ * @brief Register spawn() and the Task class
+ *
+ * @param vm the VM receiving the globals
+ */
+void defineTasks(VM *vm);
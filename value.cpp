@@ -1,14 +1,149 @@
 #include "value.h"
 
+#include <cstring>
 #include <iterator>
 #include <string>
+#include <vector>
 
 #include "chunk.h"
+#include "jit.h"
+#include "regcode.h"
+
+// Concatenations shorter than this are copied right away, a rope node
+// costs more than the bytes it would save.
+#define ROPE_MIN_LENGTH 64
+
+Str::Str(std::string_view chars) {
+    if (chars.size() <= STR_INLINE_MAX) {
+        size = (uint8_t)chars.size();
+        memcpy(data, chars.data(), chars.size());
+    } else {
+        body = std::make_shared<ObjString>(std::string(chars));
+    }
+}
+
+Str::Str(std::string &&chars) {
+    if (chars.size() <= STR_INLINE_MAX) {
+        size = (uint8_t)chars.size();
+        memcpy(data, chars.data(), chars.size());
+    } else {
+        body = std::make_shared<ObjString>(std::move(chars));
+    }
+}
+
+Str::Str(StringBody body) {
+    this->body = std::move(body);
+}
+
+size_t Str::length() const {
+    return body == nullptr ? size : body->length;
+}
+
+std::string_view Str::view() const {
+    if (body == nullptr)
+        return std::string_view(data, size);
+    return body->flatten();
+}
+
+bool operator==(const Str &a, const Str &b) {
+    if (a.body != nullptr && a.body == b.body)
+        return true;
+    return a.length() == b.length() && a.view() == b.view();
+}
+
+ObjString::ObjString(std::string chars) {
+    this->length = chars.size();
+    this->chars = std::move(chars);
+    heapAllocated(HEAP_STRING, sizeof(ObjString) + length);
+}
+
+ObjString::ObjString(Str left, Str right) {
+    length = left.length() + right.length();
+    this->left = left;
+    this->right = right;
+    // The characters are counted once flatten() allocates them.
+    heapAllocated(HEAP_STRING, sizeof(ObjString));
+}
+
+/**
+ * @brief Drop the children of a rope without recursing
+ *
+ * A string built by appending in a loop is a left-leaning chain as deep as
+ * the number of appends, the default destructor would recurse that deep.
+ */
+static void releaseRope(Str &left, Str &right) {
+    std::vector<StringBody> pending;
+    pending.push_back(std::move(left.body));
+    pending.push_back(std::move(right.body));
+    while (!pending.empty()) {
+        StringBody node = std::move(pending.back());
+        pending.pop_back();
+        if (node != nullptr && node.use_count() == 1) {
+            pending.push_back(std::move(node->left.body));
+            pending.push_back(std::move(node->right.body));
+        }
+    }
+    left = Str();
+    right = Str();
+}
+
+ObjString::~ObjString() {
+    if (isRope())
+        releaseRope(left, right);
+    heapFreed(HEAP_STRING, sizeof(ObjString) + chars.size());
+}
+
+const std::string &ObjString::flatten() {
+    if (!isRope())
+        return chars;
+
+    chars.reserve(length);
+    heapResized(HEAP_STRING, (int64_t)length);
+    std::vector<const Str *> pending;
+    pending.push_back(&right);
+    pending.push_back(&left);
+    while (!pending.empty()) {
+        const Str *node = pending.back();
+        pending.pop_back();
+        if (node->body != nullptr && node->body->isRope()) {
+            pending.push_back(&node->body->right);
+            pending.push_back(&node->body->left);
+        } else {
+            chars += node->view();
+        }
+    }
+    releaseRope(left, right);
+    return chars;
+}
+
+Str concatStrings(const Str &a, const Str &b) {
+    if (a.length() == 0)
+        return b;
+    if (b.length() == 0)
+        return a;
+
+    size_t length = a.length() + b.length();
+    if (length < ROPE_MIN_LENGTH) {
+        std::string chars;
+        chars.reserve(length);
+        chars += a.view();
+        chars += b.view();
+        return Str(std::move(chars));
+    }
+    return Str(std::make_shared<ObjString>(a, b));
+}
 
 ObjNative::ObjNative(NativeFn native) {
     function = native;
 }
 
+ObjNativeMethod::ObjNativeMethod(NativeMethod function, uint8_t arity, bool isStatic, Value name) {
+    this->function = function;
+    this->arity = arity;
+    this->isStatic = isStatic;
+    this->name = name;
+}
+
 ObjUpvalue::ObjUpvalue(Value *slot) {
     location = slot;
     next = nullptr;
@@ -24,9 +159,14 @@ ObjFunction::ObjFunction() {
     upvalueCount = 0;
     module = nullptr;
     chunk = new Chunk();
+    registers = nullptr;
+    jit = nullptr;
+    calls = 0;
 }
 ObjFunction::~ObjFunction() {
     delete chunk;
+    delete registers;
+    delete jit;
 }
 
 ObjClosure::ObjClosure(Function fn) {
@@ -44,6 +184,7 @@ ObjClosure::~ObjClosure() {
 ObjClass::ObjClass(std::string name, bool final) {
     this->name = name;
     this->final = final;
+    classType = CLS_USER_DEF;
 }
 ObjNativeClass::ObjNativeClass(std::string name,
                                NativeConstructor constructor,
@@ -65,19 +206,31 @@ ObjInstance::ObjInstance(Klass k) {
     klass = k;
 }
 
-ObjBoundMethod::ObjBoundMethod(Value receiver, Closure method) {
+ObjBoundMethod::ObjBoundMethod(Value receiver, Value method) {
     this->receiver = receiver;
     this->method = method;
 }
 
+ObjRange::ObjRange(double from, double to) {
+    this->from = from;
+    this->to = to;
+}
+
 inline std::ostream &operator<<(std::ostream &os, const Value &v) {
-    std::visit(OutputVisitor(), v.as);
+    std::visit(OutputVisitor{os}, v.as);
     return os;
 }
 void printValue(Value value) {
     std::cout << value;
     return;
 }
+std::string toString(Value value) {
+    if (IS_STRING(value))
+        return std::string(AS_STRING(value));
+    std::ostringstream out;
+    out << value;
+    return out.str();
+}
 struct FalsinessVisitor {
     bool operator()(const bool b) const { return !b; }
     bool operator()(const std::monostate n) const { return true; }
@@ -91,7 +244,12 @@ bool isFalsey(Value value) {
     // return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
+bool Value::operator==(const Value &rhs) {
+    return valuesEqual(*this, rhs);
+}
+
 bool valuesEqual(Value a, Value b) {
+    // Strings compare by contents, every other value by identity.
     return a.as == b.as;
 
     if (a.type != b.type)
@@ -1,17 +1,24 @@
 #pragma once
 
+#include <cstdlib>
 #include <functional>
 #include <iostream>
 #include <iterator>
 #include <memory>
+#include <sstream>
 #include <string>
+#include <string_view>
+#include <typeinfo>
 #include <unordered_map>
 #include <variant>
 
 #include "common.h"
+#include "memstats.h"
 
 class Chunk;
+struct ObjString;
 struct ObjNative;
+struct ObjNativeMethod;
 struct ObjNativeClass;
 struct ObjFunction;
 struct ObjClosure;
@@ -20,11 +27,18 @@ struct ObjInstance;
 struct ObjNativeInstance;
 struct ObjBoundMethod;
 struct ObjModule;
+struct ObjRange;
+struct ObjFiber;
+struct VM;
+struct RegisterCode;
+struct JitCode;
 
 using Nil = std::monostate;
 using String = std::string;
+using StringBody = std::shared_ptr<ObjString>;
 using Function = std::shared_ptr<ObjFunction>;
 using NativeFunction = std::shared_ptr<ObjNative>;
+using NativeMethodFunction = std::shared_ptr<ObjNativeMethod>;
 using Closure = std::shared_ptr<ObjClosure>;
 using Klass = std::shared_ptr<ObjClass>;
 using NativeClass = std::shared_ptr<ObjNativeClass>;
@@ -32,6 +46,8 @@ using Instance = std::shared_ptr<ObjInstance>;
 using NativeInstance = std::shared_ptr<ObjNativeInstance>;
 using BoundMethod = std::shared_ptr<ObjBoundMethod>;
 using Module = std::shared_ptr<ObjModule>;
+using Range = std::shared_ptr<ObjRange>;
+using Fiber = std::shared_ptr<ObjFiber>;
 
 enum ValueType {
     VAL_NIL,
@@ -41,16 +57,20 @@ enum ValueType {
     VAL_FUNCTION,
     VAL_CLOSURE,
     VAL_NATIVE,
+    VAL_NATIVE_METHOD,
     VAL_CLASS,
     VAL_NATIVE_CLASS,
     VAL_INSTANCE,
     VAL_BOUND_METHOD,
     VAL_MODULE,
+    VAL_RANGE,
+    VAL_FIBER,
 };
 
 enum ClassType
 {
     CLS_BOOLEAN,
+    CLS_CHANNEL,
     CLS_COND_VAR,
     CLS_DATETIME,
     CLS_DURATION,
@@ -100,6 +120,40 @@ enum Operator
     OPERATOR_UNKNOWN,
 } ;
 
+// Longest string stored inline in a Str, one byte is kept for the '\0'.
+#define STR_INLINE_MAX 14
+
+/**
+ * @brief String held by a Value
+ *
+ * Short strings live inline and never touch the heap; longer ones share an
+ * immutable ObjString body. Either way view() borrows the characters, which
+ * stay valid as long as the Str does.
+ */
+struct Str {
+    StringBody body;
+    uint8_t size = 0;
+    char data[STR_INLINE_MAX + 1] = {};
+
+    Str() = default;
+    Str(std::string_view chars);
+    Str(std::string &&chars);
+    Str(const char *chars) : Str(std::string_view(chars)) {}
+    Str(StringBody body);
+
+    size_t length() const;
+    std::string_view view() const;
+};
+
+bool operator==(const Str &a, const Str &b);
+
+template <>
+struct std::hash<Str> {
+    std::size_t operator()(const Str &s) const noexcept {
+        return std::hash<std::string_view>{}(s.view());
+    }
+};
+
 /**
  * @brief IZI Value type
  *
@@ -107,44 +161,82 @@ enum Operator
 struct Value {
     ValueType type;
 
-    using value_t = std::variant<bool, double, Nil, String,
-                                 Function, NativeFunction,
-                                 Closure, Klass, NativeClass, Instance, NativeInstance, BoundMethod, Module>;
+    using value_t = std::variant<bool, double, Nil, Str,
+                                 Function, NativeFunction, NativeMethodFunction,
+                                 Closure, Klass, NativeClass, Instance, NativeInstance, BoundMethod, Module, Range, Fiber>;
     value_t as;
 
+    /**
+     * @brief Borrow the payload, the caller has checked [type]
+     *
+     * Release builds read the variant without any check; with
+     * DEBUG_VERIFY_VALUES a mismatch aborts instead of handing back garbage.
+     */
     template <class T>
-    T get() {
-        T val;
-
-        try {
-            val = std::get<T>(as);  // w contains int, not float: will throw
-        } catch (const std::bad_variant_access &ex) {
-            std::cout << "Execption :" << ex.what() << " : " << typeid(T).name() << '\n';
-        }
+    T &get() {
+#ifdef DEBUG_VERIFY_VALUES
+        verify<T>();
+#endif
+        return *std::get_if<T>(&as);
+    }
 
-        return val;
+    template <class T>
+    const T &get() const {
+#ifdef DEBUG_VERIFY_VALUES
+        verify<T>();
+#endif
+        return *std::get_if<T>(&as);
     }
 
-    bool operator==(const Value &rhs) {
-        return as == rhs.as;
+#ifdef DEBUG_VERIFY_VALUES
+    template <class T>
+    void verify() const {
+        if (std::get_if<T>(&as) == nullptr) {
+            fprintf(stderr, "Value of type %d read as %s.\n", type, typeid(T).name());
+            abort();
+        }
     }
+#endif
+
+    bool operator==(const Value &rhs);
+};
+
+/**
+ * @brief Immutable string body shared between values
+ *
+ * Concatenating long strings builds a rope node holding both operands;
+ * the characters are only copied into [chars] the first time the string
+ * is read, so appending in a loop stays linear.
+ */
+struct ObjString {
+    //! Flat contents, filled lazily for a rope node
+    std::string chars;
+    //! Pending concatenation, empty once flattened
+    Str left;
+    Str right;
+    size_t length;
+    ObjString(std::string chars);
+    ObjString(Str left, Str right);
+    ~ObjString();
+    bool isRope() const { return chars.size() != length; }
+    const std::string &flatten();
 };
 
-typedef Value (*NativeFn)(int argCount, Value *args);
+typedef Value (*NativeFn)(VM *vm, int argCount, Value *args);
 
-struct ObjNative {
+struct ObjNative : HeapTracked<ObjNative, HEAP_NATIVE> {
     NativeFn function;
     ObjNative(NativeFn native);
 };
 
-struct ObjUpvalue {
+struct ObjUpvalue : HeapTracked<ObjUpvalue, HEAP_UPVALUE> {
     Value *location;
     Value closed;
     struct ObjUpvalue *next;
     ObjUpvalue(Value *slot);
 };
 
-struct ObjModule {
+struct ObjModule : HeapTracked<ObjModule, HEAP_MODULE> {
     std::vector<Value> variables;
     // Symbol table for the names of all module variables. Indexes here directly
     // correspond to entries in [variables].
@@ -153,7 +245,7 @@ struct ObjModule {
     ObjModule(String name);
 };
 
-struct ObjFunction {
+struct ObjFunction : HeapTracked<ObjFunction, HEAP_FUNCTION> {
     int arity;
     Chunk *chunk;
     std::string name;
@@ -161,6 +253,12 @@ struct ObjFunction {
     Module module;
     uint16_t optionalArguments[MAX_ARGS];
     uint8_t optionalArgCount;
+    //! Register form of the chunk, null when it runs on the stack loop
+    RegisterCode *registers;
+    //! Machine code of the chunk once it is hot, see compileJit()
+    JitCode *jit;
+    //! Calls counted towards JIT_THRESHOLD
+    uint32_t calls;
     ObjFunction();
     ~ObjFunction();
 };
@@ -172,7 +270,7 @@ enum FunctionType {
     TYPE_CONSTRUCTOR,
 };
 
-struct ObjClosure {
+struct ObjClosure : HeapTracked<ObjClosure, HEAP_CLOSURE> {
     Function function;
     ObjUpvalue **upvalues;
     int upvalueCount;
@@ -181,7 +279,7 @@ struct ObjClosure {
 };
 
 using StringMap = std::unordered_map<String, Value>;
-struct ObjClass {
+struct ObjClass : HeapTracked<ObjClass, HEAP_CLASS> {
     std::string name;
     StringMap methods;
     ClassType classType;
@@ -191,9 +289,9 @@ struct ObjClass {
 
 typedef void (*NativeConstructor)(void *data);
 typedef void (*NativeDestructor)(void *data);
-typedef Value (*NativeMethod)(Value receiver, int argCount, Value *args);
+typedef Value (*NativeMethod)(VM *vm, Value receiver, int argCount, Value *args);
 
-struct ObjNativeClass {
+struct ObjNativeClass : HeapTracked<ObjNativeClass, HEAP_NATIVE> {
     Klass klass;
     NativeConstructor constructor;
     NativeDestructor destructor;
@@ -207,16 +305,21 @@ struct ObjNativeClass {
         bool final);
 };
 
-struct ObjNativeMethod {
+struct ObjNativeMethod : HeapTracked<ObjNativeMethod, HEAP_NATIVE> {
     NativeMethod function;
     uint8_t arity;
     bool isStatic;
     Value name;
+    ObjNativeMethod(NativeMethod function, uint8_t arity, bool isStatic, Value name);
 };
 
-struct ObjInstance {
+struct ObjInstance : HeapTracked<ObjInstance, HEAP_INSTANCE> {
     Klass klass;
     StringMap fields;
+    //! State of an instance of a builtin class, out of reach of scripts
+    std::shared_ptr<void> native;
+    //! Fields can't change, so threads share the instance instead of copying it
+    bool frozen = false;
     ObjInstance(Klass k);
 };
 
@@ -224,10 +327,20 @@ struct ObjNativeInstance {
     ObjInstance instance;
 };
 
-struct ObjBoundMethod {
+struct ObjBoundMethod : HeapTracked<ObjBoundMethod, HEAP_BOUND_METHOD> {
     Value receiver;
-    Closure method;
-    ObjBoundMethod(Value receiver, Closure method);
+    Value method;
+    ObjBoundMethod(Value receiver, Value method);
+};
+
+/**
+ * @brief Half-open numeric range `from..to`
+ *
+ */
+struct ObjRange : HeapTracked<ObjRange, HEAP_RANGE> {
+    double from;
+    double to;
+    ObjRange(double from, double to);
 };
 
 // custom specialization of std::hash can be injected in namespace std
@@ -248,18 +361,20 @@ extern ObjNativeInstance *boolean_false;
 
 #define BOOL_VAL(value) \
     Value { VAL_BOOL, value }
-#define NIL_VAL     \
-    Value {         \
-        VAL_NIL, {} \
+#define NIL_VAL        \
+    Value {            \
+        VAL_NIL, Nil{} \
     }
 #define NUMBER_VAL(value) \
     Value { VAL_NUMBER, value }
 #define STRING_VAL(value) \
-    Value { VAL_STRING, value }
+    Value { VAL_STRING, Str(value) }
 #define FUNCTION_VAL(value) \
     Value { VAL_FUNCTION, value }
 #define NATIVE_VAL(value) \
     Value { VAL_NATIVE, value }
+#define NATIVE_METHOD_VAL(value) \
+    Value { VAL_NATIVE_METHOD, value }
 #define CLOSURE_VAL(value) \
     Value { VAL_CLOSURE, value }
 #define CLASS_VAL(value) \
@@ -272,65 +387,84 @@ extern ObjNativeInstance *boolean_false;
     Value { VAL_BOUND_METHOD, value }
 #define MODULE_VAL(value) \
     Value { VAL_MODULE, value }
-
-#define IS_BOOL(value) (value.type == VAL_BOOL)
-#define IS_NIL(value) (value.type == VAL_NIL)
-#define IS_NUMBER(value) (value.type == VAL_NUMBER)
-#define IS_STRING(value) (value.type == VAL_STRING)
-#define IS_FUNCTION(value) (value.type == VAL_FUNCTION)
-#define IS_NATIVE(value) (value.type == VAL_NATIVE)
-#define IS_CLOSURE(value) (value.type == VAL_CLOSURE)
-#define IS_CLASS(value) (value.type == VAL_CLASS)
-#define IS_INSTANCE(value) (value.type == VAL_INSTANCE)
-#define IS_BOUND_METHOD(value) (value.type == VAL_BOUND_METHOD)
-#define IS_MODULE(value) (value.type == VAL_MODULE)
-
-#define AS_BOOL(value) (value.get<bool>())
-#define AS_NUMBER(value) (value.get<double>())
-#define AS_STRING(value) (value.get<std::string>())
-#define AS_CSTRING(value) (value.get<std::string>().c_str())
-#define AS_FUNCTION(value) (value.get<Function>())
-#define AS_NATIVEFN(value) (value.get<NativeFunction>()->function)
-#define AS_CLOSURE(value) (value.get<Closure>())
-#define AS_CLASS(value) (value.get<Klass>())
-#define AS_INSTANCE(value) (value.get<Instance>())
-#define AS_BOUND_METHOD(value) (value.get<BoundMethod>())
-#define AS_MODULE(value) (value.get<Module>())
+#define RANGE_VAL(value) \
+    Value { VAL_RANGE, value }
+#define FIBER_VAL(value) \
+    Value { VAL_FIBER, value }
+
+#define IS_BOOL(value) ((value).type == VAL_BOOL)
+#define IS_NIL(value) ((value).type == VAL_NIL)
+#define IS_NUMBER(value) ((value).type == VAL_NUMBER)
+#define IS_STRING(value) ((value).type == VAL_STRING)
+#define IS_FUNCTION(value) ((value).type == VAL_FUNCTION)
+#define IS_NATIVE(value) ((value).type == VAL_NATIVE)
+#define IS_NATIVE_METHOD(value) ((value).type == VAL_NATIVE_METHOD)
+#define IS_CLOSURE(value) ((value).type == VAL_CLOSURE)
+#define IS_CLASS(value) ((value).type == VAL_CLASS)
+#define IS_INSTANCE(value) ((value).type == VAL_INSTANCE)
+#define IS_BOUND_METHOD(value) ((value).type == VAL_BOUND_METHOD)
+#define IS_MODULE(value) ((value).type == VAL_MODULE)
+#define IS_RANGE(value) ((value).type == VAL_RANGE)
+#define IS_FIBER(value) ((value).type == VAL_FIBER)
+
+#define AS_BOOL(value) ((value).get<bool>())
+#define AS_NUMBER(value) ((value).get<double>())
+// Strings are borrowed from the Value, never copied.
+#define AS_STR(value) ((value).get<Str>())
+#define AS_STRING(value) (AS_STR(value).view())
+#define AS_CSTRING(value) (AS_STR(value).view().data())
+#define AS_FUNCTION(value) ((value).get<Function>())
+#define AS_NATIVEFN(value) ((value).get<NativeFunction>()->function)
+#define AS_NATIVE_METHOD(value) ((value).get<NativeMethodFunction>())
+#define AS_CLOSURE(value) ((value).get<Closure>())
+#define AS_CLASS(value) ((value).get<Klass>())
+#define AS_INSTANCE(value) ((value).get<Instance>())
+#define AS_BOUND_METHOD(value) ((value).get<BoundMethod>())
+#define AS_MODULE(value) ((value).get<Module>())
+#define AS_RANGE(value) ((value).get<Range>())
+#define AS_FIBER(value) ((value).get<Fiber>())
 
 struct OutputVisitor {
-    void operator()(const double d) const { std::cout << d; }
-    void operator()(const bool b) const { std::cout << (b ? "true" : "false"); }
-    void operator()(const std::monostate n) const { std::cout << "nil"; }
-    void operator()(const std::string &s) const { std::cout << s; }
-    void operator()(const NativeFunction &n) const { std::cout << "<native fn>"; }
+    std::ostream &os;
+    void operator()(const double d) const { os << d; }
+    void operator()(const bool b) const { os << (b ? "true" : "false"); }
+    void operator()(const std::monostate n) const { os << "nil"; }
+    void operator()(const std::string &s) const { os << s; }
+    void operator()(const Str &s) const { os << s.view(); }
+    void operator()(const NativeFunction &n) const { os << "<native fn>"; }
+    void operator()(const NativeMethodFunction &n) const { os << "<native method>"; }
     void operator()(const Closure &c) const {
         operator()(c->function);
     }
     void operator()(const Function &f) const {
         if (f->name != "")
-            std::cout << "<fn " << f->name << ">";
+            os << "<fn " << f->name << ">";
         else
-            std::cout << "<srcipt>";
+            os << "<srcipt>";
     }
-    void operator()(const Klass &k) const { std::cout << k->name; }
-    void operator()(const NativeClass &k) const { std::cout << k->klass->name; }
-    void operator()(const Instance &i) const { std::cout << i->klass->name << " instance"; }
-    void operator()(const NativeInstance &i) const { std::cout << i->instance.klass->name << " instance"; }
+    void operator()(const Klass &k) const { os << k->name; }
+    void operator()(const NativeClass &k) const { os << k->klass->name; }
+    void operator()(const Instance &i) const { os << i->klass->name << " instance"; }
+    void operator()(const NativeInstance &i) const { os << i->instance.klass->name << " instance"; }
     void operator()(const BoundMethod &b) const {
-        operator()(b->method->function);
+        std::visit(*this, b->method.as);
         ;
     }
     void operator()(const Module &n) const {
         operator()("module " + n->name);
         ;
     }
+    void operator()(const Range &r) const { os << r->from << ".." << r->to; }
+    void operator()(const Fiber &f) const { os << "<fiber>"; }
 };
 
 std::ostream &operator<<(std::ostream &os, const Value &v);
 void printValue(Value value);
+std::string toString(Value value);
 
 bool isFalsey(Value value);
 
 bool valuesEqual(Value a, Value b);
 
-std::string copyString(const char *chars, int length);
\ No newline at end of file
+std::string copyString(const char *chars, int length);
+Str concatStrings(const Str &a, const Str &b);
\ No newline at end of file
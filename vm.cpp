@@ -2,12 +2,45 @@
 
 #include <stdarg.h>
 
+#include <algorithm>
+
+#include "channel.h"
+#include "core.h"
 #include "debug.h"
+#include "imports.h"
+#include "io.h"
+#include "memstats.h"
+#include "profile.h"
+#include "program.h"
+#include "task.h"
+
+ObjFiber::ObjFiber(Closure closure) {
+    stackCapacity = STACK_INITIAL;
+    stack = std::make_unique<Value[]>(stackCapacity);
+    stackTop = stack.get();
+    frameCount = 0;
+    openUpvalues = nullptr;
+    this->closure = closure;
+    caller = nullptr;
+    state = FIBER_NEW;
+    transfer = NIL_VAL;
+    if (closure != nullptr) {
+        // Slot zero of the first frame.
+        *stackTop++ = CLOSURE_VAL(closure);
+    }
+}
 
 VM::VM() {
     constructName = "new";
+    rootFiber = std::make_shared<ObjFiber>(nullptr);
+    rootFiber->state = FIBER_RUNNING;
     resetStack();
     defineNative("clock", clockNative);
+    defineCore(this);
+    defineIo(this);
+    defineTasks(this);
+    defineChannels(this);
+    defineHeapStats(this);
 }
 
 InterpretResult VM::interpret(const char *source) {
@@ -20,6 +53,13 @@ InterpretResult VM::interpret(const char *source) {
     // Closure closure = std::make_shared<ObjClosure>(function);
     // pop();
 
+    // Lazy modules are compiled on first use only.
+    if (!lazyImports) {
+        for (auto &[name, function] : compileImports(source)) {
+            precompiled.emplace(name, function);
+        }
+    }
+
     Closure closure = compileInModule(STRING_VAL(copyString("___", 2)), source);
     if (closure == nullptr)
         return INTERPRET_COMPILE_ERROR;
@@ -31,7 +71,350 @@ InterpretResult VM::interpret(const char *source) {
     return run();
 }
 
+/**
+ * @brief Call [callee] with [args] from outside of the VM
+ *
+ * Only valid while the VM is not running, [result] receives the value the
+ * callee returned.
+ */
+InterpretResult VM::callFunction(Value callee, const std::vector<Value> &args, Value *result) {
+    return callFunction(callee, args.data(), (int)args.size(), result);
+}
+
+InterpretResult VM::callFunction(Value callee, const Value *args, int argCount, Value *result) {
+    push(callee);
+    for (int i = 0; i < argCount; i++) {
+        push(args[i]);
+    }
+    if (!callValue(callee, argCount))
+        return INTERPRET_RUNTIME_ERROR;
+
+    // A native already left its result on the stack.
+    if (frameCount == 0) {
+        *result = pop();
+        return INTERPRET_OK;
+    }
+
+    InterpretResult status = run();
+    if (status == INTERPRET_OK)
+        *result = rootFiber->transfer;
+    return status;
+}
+
+/**
+ * @brief Run a program compiled once for many VMs
+ *
+ */
+InterpretResult VM::interpret(std::shared_ptr<Program> program) {
+    this->program = program;
+    Closure closure = std::make_shared<ObjClosure>(program->script);
+    push(CLOSURE_VAL(closure));
+
+    call(closure, 0);
+
+    return run();
+}
+
+/**
+ * @brief Run the frame on top as machine code or on the dispatch loop for
+ * its code, moving to another one whenever a call or a return changes the
+ * kind of frame
+ *
+ */
 InterpretResult VM::run() {
+    for (;;) {
+        ObjFunction *function = frames[frameCount - 1].closure->function.get();
+        InterpretResult result;
+        if (function->jit != nullptr && !jitBailout) {
+            result = runJit();
+        } else if (function->registers != nullptr) {
+            result = runRegisters();
+        } else {
+            jitBailout = false;
+            result = runStack();
+        }
+        if (result != INTERPRET_SWITCH)
+            return result;
+    }
+}
+
+/**
+ * @brief Run frames having machine code, see compileJit()
+ *
+ * Calls and returns between them stay here. An instruction the machine
+ * code leaves to the stack loop runs there, which switches back at the
+ * next call or return.
+ */
+InterpretResult VM::runJit() {
+    for (;;) {
+        if (profiler != nullptr && Profiler::due.load(std::memory_order_relaxed)) {
+            Profiler::due = false;
+            profiler->sample(this);
+        }
+        CallFrame *frame = &frames[frameCount - 1];
+        JitCode *jit = frame->closure->function->jit;
+        if (jit == nullptr)
+            return INTERPRET_SWITCH;
+        switch (jit->run(this, frame)) {
+            case JIT_FRAME:
+                break;
+            case JIT_INTERPRET:
+                jitBailout = true;
+                return INTERPRET_SWITCH;
+            default:
+                return INTERPRET_RUNTIME_ERROR;
+        }
+    }
+}
+
+/**
+ * @brief Dispatch loop of frames running register code
+ *
+ * [frame->index] is the next register instruction. While a frame runs,
+ * stackTop stays past its registers so anything pushed by a call or a
+ * lazy import lands above them.
+ */
+InterpretResult VM::runRegisters() {
+    CallFrame *frame;
+    RegisterCode *registers;
+    const RegInstruction *code;
+    const Value *constants;
+    Value *slots;
+
+#define LOAD_FRAME()                                     \
+    do {                                                 \
+        frame = &frames[frameCount - 1];                 \
+        registers = frame->closure->function->registers; \
+        if (registers == nullptr)                        \
+            return INTERPRET_SWITCH;                     \
+        code = registers->code.data();                   \
+        constants = registers->constants.data();         \
+        slots = frame->slots;                            \
+        stackTop = slots + registers->frameSize;         \
+    } while (false)
+#define RK(operand) \
+    ((operand) < REG_CONSTANT ? slots[operand] : constants[(operand) - REG_CONSTANT])
+#define READ_NAME(operand) \
+    AS_STRING(constants[(operand) - REG_CONSTANT])
+#define BINARY_OP(valueType, op)                                               \
+    do {                                                                       \
+        const Value &left = RK(instruction.b);                                 \
+        const Value &right = RK(instruction.c);                                \
+        if (!IS_NUMBER(left) || !IS_NUMBER(right)) {                           \
+            runtimeError("Operands must be numbers.");                         \
+            return INTERPRET_RUNTIME_ERROR;                                    \
+        }                                                                      \
+        slots[instruction.a] = valueType(AS_NUMBER(left) op AS_NUMBER(right)); \
+    } while (false)
+
+    LOAD_FRAME();
+    for (;;) {
+        if (profiler != nullptr && Profiler::due.load(std::memory_order_relaxed)) {
+            Profiler::due = false;
+            profiler->sample(this);
+        }
+#ifdef OPSTATS
+        opStats.recordRegister(frame->closure->function, code[frame->index].op);
+#endif
+        RegInstruction instruction = code[frame->index++];
+        switch (instruction.op) {
+            case R_MOVE:
+                slots[instruction.a] = RK(instruction.b);
+                break;
+            case R_GET_GLOBAL: {
+                std::string_view name = READ_NAME(instruction.b);
+                auto it = globals.find(String(name));
+                if (it == globals.end()) {
+                    Value body;
+                    if (!importDeclaring(String(name), &body)) {
+                        runtimeError("Undefined variable '%s'.", name.data());
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    // Run the module, then this instruction again.
+                    frame->index--;
+                    if (!runModuleBody(body))
+                        return INTERPRET_RUNTIME_ERROR;
+                    LOAD_FRAME();
+                    break;
+                }
+                slots[instruction.a] = it->second;
+                break;
+            }
+            case R_DEFINE_GLOBAL:
+                globals[String(READ_NAME(instruction.b))] = RK(instruction.c);
+                globalsVersion++;
+                break;
+            case R_SET_GLOBAL: {
+                std::string_view name = READ_NAME(instruction.b);
+                auto it = globals.find(String(name));
+                if (it == globals.end()) {
+                    Value body;
+                    if (!importDeclaring(String(name), &body)) {
+                        runtimeError("Undefined variable '%s'.", name.data());
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    frame->index--;
+                    if (!runModuleBody(body))
+                        return INTERPRET_RUNTIME_ERROR;
+                    LOAD_FRAME();
+                    break;
+                }
+                it->second = RK(instruction.c);
+                globalsVersion++;
+                break;
+            }
+            case R_GET_UPVALUE:
+                slots[instruction.a] = *frame->closure->upvalues[instruction.b]->location;
+                break;
+            case R_SET_UPVALUE:
+                *frame->closure->upvalues[instruction.b]->location = RK(instruction.c);
+                break;
+            case R_EQUAL: {
+                bool equal = valuesEqual(RK(instruction.b), RK(instruction.c));
+                slots[instruction.a] = BOOL_VAL(equal);
+                break;
+            }
+            case R_GREATER:
+                BINARY_OP(BOOL_VAL, >);
+                break;
+            case R_LESS:
+                BINARY_OP(BOOL_VAL, <);
+                break;
+            case R_ADD: {
+                const Value &left = RK(instruction.b);
+                const Value &right = RK(instruction.c);
+                if (IS_NUMBER(left) && IS_NUMBER(right)) {
+                    slots[instruction.a] = NUMBER_VAL(AS_NUMBER(left) + AS_NUMBER(right));
+                } else if (IS_STRING(left) && IS_STRING(right)) {
+                    slots[instruction.a] = Value{VAL_STRING, concatStrings(AS_STR(left), AS_STR(right))};
+                } else {
+                    runtimeError(
+                        "Operands must be two numbers or two strings.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                break;
+            }
+            case R_SUBTRACT:
+                BINARY_OP(NUMBER_VAL, -);
+                break;
+            case R_MULTIPLY:
+                BINARY_OP(NUMBER_VAL, *);
+                break;
+            case R_DIVIDE:
+                BINARY_OP(NUMBER_VAL, /);
+                break;
+            case R_NOT: {
+                bool falsey = isFalsey(RK(instruction.b));
+                slots[instruction.a] = BOOL_VAL(falsey);
+                break;
+            }
+            case R_NEGATE: {
+                const Value &operand = RK(instruction.b);
+                if (!IS_NUMBER(operand)) {
+                    runtimeError("Operand must be a number.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                slots[instruction.a] = NUMBER_VAL(-AS_NUMBER(operand));
+                break;
+            }
+            case R_PRINT:
+                printValue(RK(instruction.b));
+                printf("\n");
+                break;
+            case R_JUMP:
+            case R_LOOP:
+                frame->index = instruction.b;
+                break;
+            case R_JUMP_IF_FALSE:
+                if (isFalsey(RK(instruction.b)))
+                    frame->index = instruction.c;
+                break;
+            case R_CALL:
+                // The callee and its arguments are the top of the stack.
+                stackTop = slots + instruction.a + instruction.b + 1;
+                if (!callValue(slots[instruction.a], instruction.b)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                LOAD_FRAME();
+                break;
+            case R_TAIL_CALL: {
+                int argCount = instruction.b;
+                Value callee = slots[instruction.a];
+                stackTop = slots + instruction.a + argCount + 1;
+                if (IS_BOUND_METHOD(callee) && IS_CLOSURE(AS_BOUND_METHOD(callee)->method)) {
+                    BoundMethod bound = AS_BOUND_METHOD(callee);
+                    slots[instruction.a] = bound->receiver;
+                    callee = bound->method;
+                }
+                if (!IS_CLOSURE(callee) || frame->discardResult) {
+                    if (!callValue(callee, argCount)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    LOAD_FRAME();
+                    break;
+                }
+
+                closeUpvalues(slots);
+                std::copy(slots + instruction.a, stackTop, slots);
+                stackTop = slots + argCount + 1;
+                frameCount--;
+                if (!call(AS_CLOSURE(callee), argCount)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                LOAD_FRAME();
+                break;
+            }
+            case R_CLOSURE: {
+                Function function = AS_FUNCTION(constants[instruction.b - REG_CONSTANT]);
+                Closure closure = std::make_shared<ObjClosure>(function);
+                slots[instruction.a] = CLOSURE_VAL(closure);
+                // Upvalues are described by the operands of the stack instruction.
+                const uint8_t *upvalues = frame->closure->function->chunk->code.data() + instruction.c;
+                for (int i = 0; i < closure->upvalueCount; i++) {
+                    uint8_t isLocal = upvalues[2 * i];
+                    uint8_t index = upvalues[2 * i + 1];
+                    if (isLocal) {
+                        closure->upvalues[i] = captureUpvalue(slots + index);
+                    } else {
+                        closure->upvalues[i] = frame->closure->upvalues[index];
+                    }
+                }
+                break;
+            }
+            case R_CLOSE_UPVALUE:
+                closeUpvalues(slots + instruction.a);
+                break;
+            case R_RETURN: {
+                Value result = RK(instruction.b);
+                closeUpvalues(slots);
+                frameCount--;
+                stackTop = slots;
+                if (frameCount == 0) {
+                    if (!finishFiber(result)) {
+                        if (rootFiber->state != FIBER_DONE)
+                            return INTERPRET_RUNTIME_ERROR;
+                        resetStack();
+                        return INTERPRET_OK;
+                    }
+                    LOAD_FRAME();
+                    break;
+                }
+
+                if (!frame->discardResult)
+                    push(result);
+                LOAD_FRAME();
+                break;
+            }
+        }
+    }
+
+#undef LOAD_FRAME
+#undef RK
+#undef READ_NAME
+#undef BINARY_OP
+}
+
+InterpretResult VM::runStack() {
     CallFrame *frame = &frames[frameCount - 1];
 
 // #define READ_BYTE() *frame->ip++
@@ -44,15 +427,39 @@ InterpretResult VM::run() {
     (frame->index += 2, (uint16_t)((frame->getIp()[-2] << 8) | frame->getIp()[-1]))
 #define READ_STRING() \
     AS_STRING(READ_CONSTANT())
-#define BINARY_OP(valueType, op)                          \
-    do {                                                  \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-            runtimeError("Operands must be numbers.");    \
-            return INTERPRET_RUNTIME_ERROR;               \
-        }                                                 \
-        double b = AS_NUMBER(pop());                      \
-        double a = AS_NUMBER(pop());                      \
-        push(valueType(a op b));                          \
+// Continue with the frame now on top, elsewhere if it has register or
+// machine code
+#define LOAD_FRAME()                                          \
+    do {                                                      \
+        frame = &frames[frameCount - 1];                      \
+        if (frame->closure->function->registers != nullptr || \
+            frame->closure->function->jit != nullptr)         \
+            return INTERPRET_SWITCH;                          \
+    } while (false)
+#define BINARY_OP(valueType, op, quickened)                         \
+    do {                                                            \
+        if (!IS_NUMBER(stackTop[-1]) || !IS_NUMBER(stackTop[-2])) { \
+            runtimeError("Operands must be numbers.");              \
+            return INTERPRET_RUNTIME_ERROR;                         \
+        }                                                           \
+        quicken(frame, quickened);                                  \
+        double b = AS_NUMBER(stackTop[-1]);                         \
+        double a = AS_NUMBER(stackTop[-2]);                         \
+        stackTop--;                                                 \
+        stackTop[-1] = valueType(a op b);                           \
+    } while (false)
+// Guarded numeric form, a type miss restores the generic instruction and
+// runs it again.
+#define NUMBER_OP(valueType, op, generic)                           \
+    do {                                                            \
+        if (!IS_NUMBER(stackTop[-1]) || !IS_NUMBER(stackTop[-2])) { \
+            dequicken(frame, generic);                              \
+            break;                                                  \
+        }                                                           \
+        double b = AS_NUMBER(stackTop[-1]);                         \
+        double a = AS_NUMBER(stackTop[-2]);                         \
+        stackTop--;                                                 \
+        stackTop[-1] = valueType(a op b);                           \
     } while (false)
 
     for (;;) {
@@ -70,6 +477,13 @@ InterpretResult VM::run() {
         // frame->closure->function->chunk->disassembleInstruction((int)(frame->ip - frame->closure->function->chunk->code.begin()));
         frame->closure->function->chunk->disassembleInstruction((int)(frame->getIp() - frame->closure->function->chunk->code.data()));
 #endif  // DEBUG
+        if (profiler != nullptr && Profiler::due.load(std::memory_order_relaxed)) {
+            Profiler::due = false;
+            profiler->sample(this);
+        }
+#ifdef OPSTATS
+        opStats.record(frame->closure->function, *frame->getIp());
+#endif
         uint8_t instruction;
         switch (instruction = READ_BYTE()) {
             case CONSTANT: {
@@ -103,31 +517,51 @@ InterpretResult VM::run() {
                 break;
             }
             case GET_GLOBAL: {
-                std::string name = READ_STRING();
+                std::string_view name = READ_STRING();
                 Value value;
-                auto it = globals.find(name);
+                auto it = globals.find(String(name));
                 if (it == globals.end()) {
-                    runtimeError("Undefined variable '%s'.", name.c_str());
-                    return INTERPRET_RUNTIME_ERROR;
+                    Value body;
+                    if (!importDeclaring(String(name), &body)) {
+                        runtimeError("Undefined variable '%s'.", name.data());
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    // Run the module, then this instruction again.
+                    frame->index -= 2;
+                    if (!runModuleBody(body))
+                        return INTERPRET_RUNTIME_ERROR;
+                    LOAD_FRAME();
+                    break;
                 }
                 value = it->second;
                 push(value);
                 break;
             }
             case DEFINE_GLOBAL: {
-                auto name = READ_STRING();
-                globals[name] = peek(0);
+                std::string_view name = READ_STRING();
+                globals[String(name)] = peek(0);
+                globalsVersion++;
                 pop();
                 break;
             }
             case SET_GLOBAL: {
-                auto name = READ_STRING();
+                std::string_view name = READ_STRING();
 
-                if (globals.find(name) == globals.end()) {
-                    runtimeError("Undefined variable '%s'.", name.c_str());
-                    return INTERPRET_RUNTIME_ERROR;
+                auto it = globals.find(String(name));
+                if (it == globals.end()) {
+                    Value body;
+                    if (!importDeclaring(String(name), &body)) {
+                        runtimeError("Undefined variable '%s'.", name.data());
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    frame->index -= 2;
+                    if (!runModuleBody(body))
+                        return INTERPRET_RUNTIME_ERROR;
+                    LOAD_FRAME();
+                    break;
                 }
-                globals[name] = peek(0);
+                it->second = peek(0);
+                globalsVersion++;
                 break;
             }
             case GET_UPVALUE: {
@@ -146,7 +580,7 @@ InterpretResult VM::run() {
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 Instance instance = AS_INSTANCE(peek(0));
-                String name = READ_STRING();
+                String name(READ_STRING());
 
                 auto it = instance->fields.find(name);
                 if (it != instance->fields.end()) {
@@ -165,14 +599,18 @@ InterpretResult VM::run() {
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 Instance instance = AS_INSTANCE(peek(1));
-                instance->fields[READ_STRING()] = peek(0);
+                if (instance->frozen) {
+                    runtimeError("Can't set a field of a frozen instance.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                instance->fields[String(READ_STRING())] = peek(0);
                 Value value = pop();
                 pop();
                 push(value);
                 break;
             }
             case GET_SUPER: {
-                String name = READ_STRING();
+                String name(READ_STRING());
                 Klass superclass = AS_CLASS(pop());
 
                 if (!bindMethod(superclass, name)) {
@@ -187,17 +625,22 @@ InterpretResult VM::run() {
                 break;
             }
             case GREATER:
-                BINARY_OP(BOOL_VAL, >);
+                BINARY_OP(BOOL_VAL, >, GREATER_NUM);
                 break;
             case LESS:
-                BINARY_OP(BOOL_VAL, <);
+                BINARY_OP(BOOL_VAL, <, LESS_NUM);
                 break;
             case ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    std::string b = AS_STRING(pop());
-                    std::string a = AS_STRING(pop());
-                    push(STRING_VAL(a + b));
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+                if (IS_STRING(stackTop[-1]) && IS_STRING(stackTop[-2])) {
+                    // Only written when set, frozen chunks stay untouched.
+                    uint8_t &feedback = frame->closure->function->chunk->feedback[frame->index - 1];
+                    if (feedback != 0)
+                        feedback = 0;
+                    Value b = pop();
+                    Value a = pop();
+                    push(Value{VAL_STRING, concatStrings(AS_STR(a), AS_STR(b))});
+                } else if (IS_NUMBER(stackTop[-1]) && IS_NUMBER(stackTop[-2])) {
+                    quicken(frame, ADD_NUM);
                     double b = AS_NUMBER(pop());
                     double a = AS_NUMBER(pop());
                     push(NUMBER_VAL(a + b));
@@ -209,13 +652,31 @@ InterpretResult VM::run() {
                 break;
             }
             case SUBTRACT:
-                BINARY_OP(NUMBER_VAL, -);
+                BINARY_OP(NUMBER_VAL, -, SUBTRACT_NUM);
                 break;
             case MULTIPLY:
-                BINARY_OP(NUMBER_VAL, *);
+                BINARY_OP(NUMBER_VAL, *, MULTIPLY_NUM);
                 break;
             case DIVIDE:
-                BINARY_OP(NUMBER_VAL, /);
+                BINARY_OP(NUMBER_VAL, /, DIVIDE_NUM);
+                break;
+            case ADD_NUM:
+                NUMBER_OP(NUMBER_VAL, +, ADD);
+                break;
+            case SUBTRACT_NUM:
+                NUMBER_OP(NUMBER_VAL, -, SUBTRACT);
+                break;
+            case MULTIPLY_NUM:
+                NUMBER_OP(NUMBER_VAL, *, MULTIPLY);
+                break;
+            case DIVIDE_NUM:
+                NUMBER_OP(NUMBER_VAL, /, DIVIDE);
+                break;
+            case GREATER_NUM:
+                NUMBER_OP(BOOL_VAL, >, GREATER);
+                break;
+            case LESS_NUM:
+                NUMBER_OP(BOOL_VAL, <, LESS);
                 break;
             case NOT:
                 push(BOOL_VAL(isFalsey(pop())));
@@ -246,9 +707,12 @@ InterpretResult VM::run() {
                 break;
             }
             case LOOP: {
+                int edge = frame->index - 1;
                 uint16_t offset = READ_SHORT();
                 // frame->ip -= offset;
                 frame->inc(-offset);
+                if (takeBackEdge(frame, edge))
+                    return INTERPRET_SWITCH;
                 break;
             }
             case CALL: {
@@ -256,7 +720,37 @@ InterpretResult VM::run() {
                 if (!callValue(peek(argCount), argCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &frames[frameCount - 1];
+                LOAD_FRAME();
+                break;
+            }
+
+            case TAIL_CALL: {
+                int argCount = READ_BYTE();
+                Value callee = peek(argCount);
+                if (IS_BOUND_METHOD(callee) && IS_CLOSURE(AS_BOUND_METHOD(callee)->method)) {
+                    BoundMethod bound = AS_BOUND_METHOD(callee);
+                    stackTop[-argCount - 1] = bound->receiver;
+                    callee = bound->method;
+                }
+                // Anything but a script function is a plain call, the RETURN
+                // after this instruction hands its result back.
+                if (!IS_CLOSURE(callee) || frame->discardResult) {
+                    if (!callValue(callee, argCount)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    LOAD_FRAME();
+                    break;
+                }
+
+                // Slide the callee and its arguments down over this frame.
+                closeUpvalues(frame->slots);
+                std::copy(stackTop - argCount - 1, stackTop, frame->slots);
+                stackTop = frame->slots + argCount + 1;
+                frameCount--;
+                if (!call(AS_CLOSURE(callee), argCount)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                LOAD_FRAME();
                 break;
             }
 
@@ -287,19 +781,27 @@ InterpretResult VM::run() {
                 frameCount--;
                 if (frameCount == 0) {
                     pop();
-                    return INTERPRET_OK;
+                    if (!finishFiber(result)) {
+                        if (rootFiber->state != FIBER_DONE)
+                            return INTERPRET_RUNTIME_ERROR;
+                        resetStack();
+                        return INTERPRET_OK;
+                    }
+                    LOAD_FRAME();
+                    break;
                 }
 
                 stackTop = frame->slots;
-                push(result);
-                frame = &frames[frameCount - 1];
+                if (!frame->discardResult)
+                    push(result);
+                LOAD_FRAME();
                 break;
             }
             case CLASS:
-                push(CLASS_VAL(std::make_shared<ObjClass>(READ_STRING())));
+                push(CLASS_VAL(std::make_shared<ObjClass>(String(READ_STRING()))));
                 break;
             case METHOD:
-                defineMethod(READ_STRING());
+                defineMethod(String(READ_STRING()));
                 break;
             case INHERIT: {
                 Value superclass = peek(1);
@@ -316,11 +818,67 @@ InterpretResult VM::run() {
                 break;
             }
             case IMPORT: {
+                if (lazyImports) {
+                    Value name = READ_CONSTANT();
+                    if (std::find(lazyModules.begin(), lazyModules.end(), name) == lazyModules.end())
+                        lazyModules.push_back(name);
+                    push(NIL_VAL);
+                    break;
+                }
                 push(importModule(READ_CONSTANT()));
+                if (IS_NIL(peek(0)))
+                    return INTERPRET_RUNTIME_ERROR;
                 // If we get a closure, call it to execute the module body.
                 if (IS_CLOSURE(peek(0))) {
-                    callValue(peek(0), 0);
+                    if (!callValue(peek(0), 0))
+                        return INTERPRET_RUNTIME_ERROR;
+                    LOAD_FRAME();
+                }
+                break;
+            }
+            case RANGE: {
+                if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+                    runtimeError("Range bounds must be numbers.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                double to = AS_NUMBER(pop());
+                double from = AS_NUMBER(pop());
+                push(RANGE_VAL(std::make_shared<ObjRange>(from, to)));
+                break;
+            }
+            case ITER_INIT: {
+                // Push the initial iteration state next to the sequence.
+                Value seq = peek(0);
+                if (IS_RANGE(seq)) {
+                    push(NUMBER_VAL(AS_RANGE(seq)->from));
+                } else if (IS_STRING(seq)) {
+                    push(NUMBER_VAL(0.0));
+                } else {
+                    runtimeError("Can only iterate over ranges and strings.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                break;
+            }
+            case ITER_NEXT: {
+                Value *seq = &frame->slots[READ_BYTE()];
+                Value *state = seq + 1;
+                uint16_t offset = READ_SHORT();
+                double index = AS_NUMBER(*state);
+                if (seq->type == VAL_RANGE) {
+                    if (index >= AS_RANGE(*seq)->to) {
+                        frame->inc(offset);
+                        break;
+                    }
+                    push(NUMBER_VAL(index));
+                } else {
+                    std::string_view chars = AS_STRING(*seq);
+                    if (index >= chars.size()) {
+                        frame->inc(offset);
+                        break;
+                    }
+                    push(STRING_VAL(chars.substr((size_t)index, 1)));
                 }
+                *state = NUMBER_VAL(index + 1);
                 break;
             }
         }
@@ -330,12 +888,25 @@ InterpretResult VM::run() {
 #undef READ_CONSTANT
 #undef READ_SHORT
 #undef BINARY_OP
+#undef NUMBER_OP
+#undef LOAD_FRAME
 }
 
 void VM::resetStack() {
+    loadFiber(rootFiber);
+    rootFiber->state = FIBER_RUNNING;
     stackTop = stack;
     frameCount = 0;
     openUpvalues = nullptr;
+    nextFiber = nullptr;
+}
+
+int CallFrame::line() {
+    ObjFunction *function = closure->function.get();
+    size_t instruction = index > 0 ? index - 1 : 0;
+    if (function->registers != nullptr)
+        return function->registers->lines[instruction];
+    return function->chunk->lines[instruction];
 }
 
 void VM::runtimeError(const char *format, ...) {
@@ -348,10 +919,7 @@ void VM::runtimeError(const char *format, ...) {
     for (int i = frameCount - 1; i >= 0; i--) {
         CallFrame *frame = &frames[i];
         Function function = frame->closure->function;
-        // size_t instruction = frame->ip - function->chunk->code.begin() - 1;
-        size_t instruction = frame->getIp() - function->chunk->code.data() - 1;
-        fprintf(stderr, "[line %d] in ",
-                function->chunk->lines[instruction]);
+        fprintf(stderr, "[line %d] in ", frame->line());
         if (function->name == "") {
             fprintf(stderr, "script\n");
         } else {
@@ -376,7 +944,125 @@ Value VM::peek(int distance) {
     return stackTop[-1 - distance];
 }
 
+/**
+ * @brief Count a numeric execution of the instruction just read
+ *
+ * Once it has only seen numbers QUICKEN_THRESHOLD times the instruction is
+ * rewritten in place to its [quickened] form, which skips the generic
+ * type dispatch.
+ */
+void VM::quicken(CallFrame *frame, OpCode quickened) {
+    Chunk *chunk = frame->closure->function->chunk;
+    if (chunk->frozen)
+        return;
+    int offset = frame->index - 1;
+    if (++chunk->feedback[offset] == QUICKEN_THRESHOLD) {
+        chunk->code[offset] = quickened;
+        quickenedSites++;
+    }
+}
+
+/**
+ * @brief Count a jump back by the LOOP at offset [edge], true when [frame]
+ * goes on as machine code from the loop's start
+ *
+ * Once a back-edge is taken OSR_THRESHOLD times the function is compiled
+ * in the middle of the loop. Machine code works on the same frame and
+ * stack, the slots, the values pushed and frame->index carry over as they
+ * are. A frame handed to the stack loop for one instruction goes back at
+ * its next back-edge.
+ */
+bool VM::takeBackEdge(CallFrame *frame, int edge) {
+    ObjFunction *function = frame->closure->function.get();
+    if (function->jit != nullptr)
+        return true;
+    Chunk *chunk = function->chunk;
+    // Stays at the threshold when the function can't be compiled.
+    if (chunk->frozen || chunk->feedback[edge] == OSR_THRESHOLD || !usesJit())
+        return false;
+    if (++chunk->feedback[edge] < OSR_THRESHOLD)
+        return false;
+    return compileJit(function);
+}
+
+/**
+ * @brief Make [function] and the functions it contains safe to share
+ * between threads
+ *
+ * Quickened instructions go back to their generic form, frozen chunks are
+ * never rewritten again.
+ */
+void freezeFunction(Function function) {
+    Chunk *chunk = function->chunk;
+    if (chunk->frozen)
+        return;
+
+    chunk->frozen = true;
+    for (size_t offset = 0; offset < chunk->code.size(); offset++) {
+        // Only quickened sites have reached the threshold.
+        if (chunk->feedback[offset] != QUICKEN_THRESHOLD)
+            continue;
+        switch (chunk->code[offset]) {
+            case ADD_NUM: chunk->code[offset] = ADD; break;
+            case SUBTRACT_NUM: chunk->code[offset] = SUBTRACT; break;
+            case MULTIPLY_NUM: chunk->code[offset] = MULTIPLY; break;
+            case DIVIDE_NUM: chunk->code[offset] = DIVIDE; break;
+            case GREATER_NUM: chunk->code[offset] = GREATER; break;
+            case LESS_NUM: chunk->code[offset] = LESS; break;
+            default: break;
+        }
+        chunk->feedback[offset] = 0;
+    }
+
+    for (Value &constant : chunk->constants) {
+        if (IS_FUNCTION(constant))
+            freezeFunction(AS_FUNCTION(constant));
+        // Reading a rope flattens it, threads sharing the chunk only read.
+        else if (IS_STRING(constant))
+            AS_STR(constant).view();
+    }
+}
+
+/**
+ * @brief Undo quicken() after a type miss and re-run the [generic] form
+ *
+ */
+void VM::dequicken(CallFrame *frame, OpCode generic) {
+    Chunk *chunk = frame->closure->function->chunk;
+    int offset = frame->index - 1;
+    chunk->code[offset] = generic;
+    chunk->feedback[offset] = 0;
+    dequickenedSites++;
+    frame->index = offset;
+}
+
+/**
+ * @brief Double the running fiber's stack, moving every pointer into it
+ *
+ */
+void VM::growStack() {
+    size_t capacity = fiber->stackCapacity * 2;
+    std::unique_ptr<Value[]> grown = std::make_unique<Value[]>(capacity);
+    Value *base = grown.get();
+    for (Value *slot = stack; slot < stackTop; slot++) {
+        base[slot - stack] = std::move(*slot);
+    }
+    for (int i = 0; i < frameCount; i++) {
+        frames[i].slots = base + (frames[i].slots - stack);
+    }
+    for (ObjUpvalue *upvalue = openUpvalues; upvalue != nullptr; upvalue = upvalue->next) {
+        upvalue->location = base + (upvalue->location - stack);
+    }
+    stackTop = base + (stackTop - stack);
+    stack = base;
+    fiber->stack = std::move(grown);
+    fiber->stackCapacity = capacity;
+}
+
 bool VM::call(Closure closure, int argCount) {
+    if (stackTop + STACK_HEADROOM > stack + fiber->stackCapacity) {
+        growStack();
+    }
     if (argCount + closure->function->optionalArgCount < closure->function->arity) {
         runtimeError("'%s' Expects a minimum of %d arguments to but got %d.",
                      closure->function->name.c_str(),
@@ -422,6 +1108,12 @@ bool VM::call(Closure closure, int argCount) {
     // frame->ip = closure->function->chunk->code.begin();
     frame->index = 0;
     frame->slots = stackTop - argCount - 1;
+    frame->discardResult = false;
+
+    // Shared chunks aren't counted, their functions run on several threads.
+    ObjFunction *function = closure->function.get();
+    if (function->jit == nullptr && !function->chunk->frozen && ++function->calls == JIT_THRESHOLD)
+        compileJit(function);
     return true;
 }
 
@@ -430,7 +1122,7 @@ bool VM::callValue(Value callee, int argCount) {
         case VAL_BOUND_METHOD: {
             BoundMethod bound = AS_BOUND_METHOD(callee);
             stackTop[-argCount - 1] = bound->receiver;
-            return call(bound->method, argCount);
+            return callValue(bound->method, argCount);
         }
         case VAL_CLASS: {
             Klass klass = AS_CLASS(callee);
@@ -438,7 +1130,7 @@ bool VM::callValue(Value callee, int argCount) {
 
             auto it = klass->methods.find(constructName);
             if (it != klass->methods.end()) {
-                return call(AS_CLOSURE(it->second), argCount);
+                return callValue(it->second, argCount);
             } else if (argCount != 0) {  // Defaut constructor
                 runtimeError("Expected 0 arguments but got %d.",
                              argCount);
@@ -450,10 +1142,18 @@ bool VM::callValue(Value callee, int argCount) {
             return call(AS_CLOSURE(callee), argCount);
         case VAL_NATIVE: {
             NativeFn native = AS_NATIVEFN(callee);
-            Value result = native(argCount, stackTop - argCount);
-            stackTop -= argCount + 1;
-            push(result);
-            return true;
+            Value result = native(this, argCount, stackTop - argCount);
+            return returnFromNative(result, argCount);
+        }
+        case VAL_NATIVE_METHOD: {
+            NativeMethodFunction method = AS_NATIVE_METHOD(callee);
+            if (argCount != method->arity) {
+                runtimeError("Expected %d arguments but got %d.",
+                             method->arity, argCount);
+                return false;
+            }
+            Value result = method->function(this, stackTop[-argCount - 1], argCount, stackTop - argCount);
+            return returnFromNative(result, argCount);
         }
         default:
             break;  // Non-callable object type.
@@ -461,6 +1161,153 @@ bool VM::callValue(Value callee, int argCount) {
     runtimeError("Can only call functions and classes.");
     return false;
 }
+/**
+ * @brief Replace a native's callee and arguments by its [result]
+ *
+ */
+bool VM::returnFromNative(Value result, int argCount) {
+    // runtimeError() unwinds every frame and empties the stack, the callee
+    // at least is left otherwise, even when called from outside the VM.
+    if (stackTop == stack)
+        return false;
+
+    stackTop -= argCount + 1;
+    if (nextFiber != nullptr) {
+        Fiber next = std::move(nextFiber);
+        nextFiber = nullptr;
+        return enterFiber(next, next->transfer);
+    }
+    push(result);
+    return true;
+}
+
+void VM::saveFiber() {
+    fiber->stackTop = stackTop;
+    fiber->frameCount = frameCount;
+    fiber->openUpvalues = openUpvalues;
+}
+
+void VM::loadFiber(Fiber next) {
+    fiber = next;
+    frames = next->frames;
+    stack = next->stack.get();
+    stackTop = next->stackTop;
+    frameCount = next->frameCount;
+    openUpvalues = next->openUpvalues;
+}
+
+/**
+ * @brief Make [next] the running fiber and hand it [value]
+ *
+ * A new fiber starts its function, with [value] as argument if it takes
+ * one; a suspended fiber gets [value] as the result of the call that
+ * suspended it.
+ */
+bool VM::enterFiber(Fiber next, Value value) {
+    saveFiber();
+    loadFiber(next);
+    FiberState state = fiber->state;
+    fiber->state = FIBER_RUNNING;
+    if (state == FIBER_NEW) {
+        int argCount = 0;
+        if (fiber->closure->function->arity == 1) {
+            push(value);
+            argCount = 1;
+        }
+        return call(fiber->closure, argCount);
+    }
+    push(value);
+    return true;
+}
+
+/**
+ * @brief Ask to switch to [next] once the running native returns
+ *
+ */
+void VM::switchFiber(Fiber next, Value value) {
+    next->transfer = value;
+    nextFiber = next;
+}
+
+bool VM::resumeFiber(Fiber next, Value value) {
+    switch (next->state) {
+        case FIBER_DONE:
+            runtimeError("Can't resume a finished fiber.");
+            return false;
+        case FIBER_RUNNING:
+            runtimeError("Fiber is already running.");
+            return false;
+        case FIBER_WAITING:
+            runtimeError("Can't resume a fiber waiting on the scheduler.");
+            return false;
+        default:
+            break;
+    }
+    next->caller = fiber;
+    switchFiber(next, value);
+    return true;
+}
+
+/**
+ * @brief Give [value] back to the fiber that resumed the running one
+ *
+ * Without a caller the fiber is handed to the scheduler.
+ */
+bool VM::yieldFiber(Value value) {
+    Fiber caller = fiber->caller;
+    if (caller == nullptr && scheduler == nullptr) {
+        runtimeError("Can't yield from the main fiber.");
+        return false;
+    }
+
+    fiber->caller = nullptr;
+    fiber->state = FIBER_SUSPENDED;
+    if (caller != nullptr) {
+        switchFiber(caller, value);
+        return true;
+    }
+    return suspendFiber();
+}
+
+/**
+ * @brief Let the scheduler pick what runs after the running fiber
+ *
+ * The caller sets the fiber's state first: FIBER_SUSPENDED after a yield,
+ * FIBER_WAITING while it waits on an event.
+ */
+bool VM::suspendFiber() {
+    Fiber next = scheduler != nullptr ? scheduler(this, fiber) : nullptr;
+    if (next == nullptr) {
+        runtimeError("No fiber left to run.");
+        return false;
+    }
+    switchFiber(next, next->transfer);
+    return true;
+}
+
+/**
+ * @brief Return [result] from a fiber whose function completed
+ *
+ * Returns false when nothing is left to run, which is only an error while
+ * the root fiber has not finished.
+ */
+bool VM::finishFiber(Value result) {
+    fiber->state = FIBER_DONE;
+    fiber->transfer = result;
+    Fiber caller = fiber->caller;
+    fiber->caller = nullptr;
+    if (caller != nullptr)
+        return enterFiber(caller, result);
+
+    Fiber next = scheduler != nullptr ? scheduler(this, nullptr) : nullptr;
+    if (next == nullptr) {
+        if (rootFiber->state != FIBER_DONE)
+            runtimeError("No fiber left to run.");
+        return false;
+    }
+    return enterFiber(next, next->transfer);
+}
+
 bool VM::bindMethod(Klass klass, String name) {
     auto it = klass->methods.find(name);
     if (it == klass->methods.end()) {
@@ -468,8 +1315,7 @@ bool VM::bindMethod(Klass klass, String name) {
         return false;
     }
 
-    BoundMethod bound = std::make_shared<ObjBoundMethod>(peek(0),
-                                                         AS_CLOSURE(it->second));
+    BoundMethod bound = std::make_shared<ObjBoundMethod>(peek(0), it->second);
     pop();
     push(BOUND_METHOD_VAL(bound));
     return true;
@@ -515,42 +1361,105 @@ void VM::defineMethod(String name) {
     pop();
 }
 
+/**
+ * @brief Closure running the body of module [name], the module itself if it
+ * is already loaded and nil if it can't be found or does not compile
+ *
+ * Modules are keyed by the canonical path of their file, so a body runs
+ * once per VM whatever name reaches it. A module is registered before its
+ * body runs, so cyclic imports see it as loaded.
+ */
 Value VM::importModule(Value name) {
-    // todo:  name = resolver de module(name)
-    // If the module is already loaded
-    auto it = modules.find(AS_STRING(name));
+    String nameString(AS_STRING(name));
+    String path;
+    if (!resolveModule(nameString, &path)) {
+        runtimeError("Could not find module '%s'.", nameString.c_str());
+        return NIL_VAL;
+    }
+    auto it = modules.find(path);
     if (it != modules.end()) return it->second;
 
-    // todo:  expose api to load module exemple pkg managr folder
-
-    String nameString = AS_STRING(name);
-    char *source;
-    if (nameString == "core") {
-        source = R"(
-            class System{
-                println(val){
-                    print val;
-                }
-            }
-        )";
+    Function function = nullptr;
+    if (program != nullptr) {
+        function = program->module(path);
     } else {
-        nameString = "./" + nameString + ".izi";
-        source = readFile(nameString.c_str());
+        auto compiled = precompiled.find(path);
+        if (compiled != precompiled.end()) {
+            function = compiled->second;
+            precompiled.erase(compiled);
+        } else {
+            std::string source;
+            if (!readModuleSource(path, &source)) {
+                runtimeError("Could not read module '%s'.", path.c_str());
+                return NIL_VAL;
+            }
+            function = compiler.compile(source.c_str(), std::make_shared<ObjModule>(path));
+        }
+    }
+
+    if (function == nullptr) {
+        runtimeError("Could not compile module '%s'.", nameString.c_str());
+        return NIL_VAL;
     }
+    modules[path] = MODULE_VAL(function->module);
+    return CLOSURE_VAL(std::make_shared<ObjClosure>(function));
+}
+/**
+ * @brief Import the first lazy module declaring [global]
+ *
+ * [body] receives the closure running the module, or nil when the import
+ * failed with a runtime error. False if no pending module declares it.
+ */
+bool VM::importDeclaring(const String &global, Value *body) {
+    for (size_t i = 0; i < lazyModules.size();) {
+        Value name = lazyModules[i];
+        String path;
+        if (!resolveModule(String(AS_STRING(name)), &path)) {
+            i++;
+            continue;
+        }
+        auto declared = declarations.find(path);
+        if (declared == declarations.end())
+            declared = declarations.emplace(path, moduleDeclarations(path)).first;
+        if (declared->second.count(global) == 0) {
+            i++;
+            continue;
+        }
 
-    auto moduleClosure = compileInModule(name, source);
-    return CLOSURE_VAL(moduleClosure);
+        lazyModules.erase(lazyModules.begin() + i);
+        *body = importModule(name);
+        // Already loaded through another name, it did not define [global].
+        if (IS_MODULE(*body))
+            continue;
+        return true;
+    }
+    return false;
 }
+
+/**
+ * @brief Call the closure of a module body, its result is dropped
+ *
+ */
+bool VM::runModuleBody(Value body) {
+    if (IS_NIL(body))
+        return false;
+    push(body);
+    if (!callValue(body, 0))
+        return false;
+    frames[frameCount - 1].discardResult = true;
+    return true;
+}
+
 Module VM::getModule(Value name) {
-    auto it = modules.find(AS_STRING(name));
+    auto it = modules.find(String(AS_STRING(name)));
 
     return it != modules.end() ? AS_MODULE(it->second) : nullptr;
 }
 Closure VM::compileInModule(Value name, const char *source) {
     Module module = getModule(name);
     if (module == nullptr) {
-        module = std::make_shared<ObjModule>(AS_STRING(name));
-        modules[AS_STRING(name)] = MODULE_VAL(module);
+        module = std::make_shared<ObjModule>(String(AS_STRING(name)));
+        modules[module->name] = MODULE_VAL(module);
 
         // Implicitly import the core module.
         // Module coreModule = getModule(STRING_VAL(""));
@@ -578,11 +1487,7 @@ bool VM::createInstance(Klass klass, int argCount) {
     stackTop[-argCount - 1] = instance;
     auto it = klass->methods.find(constructName);
     if (it != klass->methods.end()) {
-#define IS_NATIVE_METHOD(value) false
-        if (IS_NATIVE_METHOD(it->second)) {
-        } else {
-            return call(AS_CLOSURE(it->second), argCount);
-        }
+        return callValue(it->second, argCount);
     } else if (argCount != 0) {
         runtimeError("'%s()' expects 0 arguments but got %d.", klass->name.c_str(), argCount);
         return false;
@@ -595,7 +1500,7 @@ void VM::defineNative(const char *name, NativeFn function) {
     push(STRING_VAL(copyString(name, (int)strlen(name))));
     NativeFunction nf = std::make_shared<ObjNative>(function);
     push(NATIVE_VAL(nf));
-    globals[AS_STRING(stack[0])] = stack[1];
+    globals[String(AS_STRING(stack[0]))] = stack[1];
     pop();
     pop();
 }
@@ -605,17 +1510,30 @@ void VM::defineNativeFunction(const char *name, NativeFn function) {
     NativeFunction nf = std::make_shared<ObjNative>(function);
     push(NATIVE_VAL(nf));
     push(STRING_VAL(copyString(name, (int)strlen(name))));
-    globals[AS_STRING(stack[0])] = stack[1];
+    globals[String(AS_STRING(stack[0]))] = stack[1];
     // addGlobal(peek(vm, 0), peek(vm, 1));
     pop();
     pop();
 }
 
+Value VM::defineBuiltinClass(const char *name, ClassType classType) {
+    Klass klass = std::make_shared<ObjClass>(name, true);
+    klass->classType = classType;
+    globals[name] = CLASS_VAL(klass);
+    return CLASS_VAL(klass);
+}
+
+void VM::defineNativeMethod(Value klass, NativeMethod function, const char *name, uint8_t arity, bool isStatic) {
+    Value methodName = STRING_VAL(copyString(name, (int)strlen(name)));
+    NativeMethodFunction method = std::make_shared<ObjNativeMethod>(function, arity, isStatic, methodName);
+    AS_CLASS(klass)->methods[name] = NATIVE_METHOD_VAL(method);
+}
+
 Value VM::bootstrapNativeClass(const char *name, NativeConstructor constructor, NativeDestructor destructor, ClassType classType, size_t dataSize, bool final) {
     NativeClass nc = std::make_shared<ObjNativeClass>(name, constructor, destructor, classType, dataSize, final);
     return NATIVE_CLASS_VAL(nc);
 }
 
-Value clockNative(int argCount, Value *args) {
+Value clockNative(VM *vm, int argCount, Value *args) {
     return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
\ No newline at end of file
@@ -1,16 +1,28 @@
 #pragma once
 
+#include <functional>
+#include <unordered_set>
+
 #include "chunk.h"
 #include "compiler.h"
+#include "jit.h"
+#include "opstats.h"
+#include "regcode.h"
 #include "value.h"
 
 #define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_MAX)
+// Slots a call may use, a fiber's stack grows to keep this much free
+#define STACK_HEADROOM UINT8_MAX
+#define STACK_INITIAL (STACK_HEADROOM * 2)
+// Numeric executions before an arithmetic instruction is quickened
+#define QUICKEN_THRESHOLD 8
 
 enum InterpretResult {
     INTERPRET_OK,
     INTERPRET_COMPILE_ERROR,
-    INTERPRET_RUNTIME_ERROR
+    INTERPRET_RUNTIME_ERROR,
+    //! Only between the dispatch loops, the top frame runs on another one
+    INTERPRET_SWITCH
 };
 
 using IPType = uint8_t *;  // std::vector<uint8_t>::iterator;
@@ -20,6 +32,8 @@ struct CallFrame {
     IPType ip;
     int index;
     Value *slots;
+    //! Drop the value returned, set for module bodies run by a lazy import
+    bool discardResult;
     inline IPType getIp() {
         return closure->function->chunk->code.data() + index;
     }
@@ -32,52 +46,185 @@ struct CallFrame {
 
         return (uint16_t)((getIp()[-2] << 8) | getIp()[-1]);
     }
+    //! Source line of the instruction run last, [index] counts register
+    //! instructions in a frame running register code
+    int line();
 };
 
-struct VM {
+enum FiberState {
+    FIBER_NEW,
+    FIBER_RUNNING,
+    FIBER_SUSPENDED,
+    FIBER_WAITING,
+    FIBER_DONE,
+};
+
+/**
+ * @brief Coroutine with its own value stack and call frames
+ *
+ * Only the running fiber's registers live in the VM, switching fibers
+ * saves them here and loads the other fiber's.
+ */
+struct ObjFiber : HeapTracked<ObjFiber, HEAP_FIBER> {
+    std::unique_ptr<Value[]> stack;
+    size_t stackCapacity;
+    Value *stackTop;
     CallFrame frames[FRAMES_MAX];
     int frameCount;
+    ObjUpvalue *openUpvalues;
+    //! Function run on first resume
+    Closure closure;
+    //! Fiber that resumed this one, it gets control back on yield
+    Fiber caller;
+    FiberState state;
+    //! Value handed over the next time the fiber is switched to
+    Value transfer;
+    ObjFiber(Closure closure);
+};
+
+/**
+ * @brief Pick the fiber to run once [suspended] gives up the VM without a
+ * caller to return to
+ *
+ * [suspended] is null when the fiber finished. The returned fiber gets its
+ * transfer value; returning null stops the VM.
+ */
+using FiberScheduler = std::function<Fiber(VM *vm, Fiber suspended)>;
+
+/**
+ * @brief Value held by the host embedding a VM, see VM::getHandle()
+ *
+ * Keeps the value alive; calling through it looks nothing up.
+ */
+struct Handle {
+    Value value;
+};
+
+struct EventLoop;
+struct Program;
+struct TaskGlobals;
+struct Profiler;
+
+struct VM {
+    // Registers of the running fiber
+    CallFrame *frames;
+    int frameCount;
     std::vector<uint8_t>::iterator itip;
-    Value stack[STACK_MAX];
+    Value *stack;
     Value *stackTop;
     ObjUpvalue *openUpvalues;
 
+    Fiber fiber;
+    Fiber rootFiber;
+    //! Switch requested by a native, made once it returns
+    Fiber nextFiber;
+    FiberScheduler scheduler;
+    std::shared_ptr<EventLoop> eventLoop;
+
     std::unordered_map<std::string, Value> globals; /* hash table global variables*/
+    //! Bumped on every global assignment
+    size_t globalsVersion = 0;
+    //! Copy of the globals handed to tasks, see spawn()
+    std::shared_ptr<const TaskGlobals> taskGlobals;
     // cache string in memoire chap. 20
     // Table strings;
 
+    //! Loaded modules by canonical path
     std::unordered_map<String, Value> modules;
     Module lastModule;
 
     Compiler compiler;
+    //! Shared code being run, modules are taken from it when set
+    std::shared_ptr<Program> program;
+    //! Modules compiled ahead of their import, by canonical path
+    std::unordered_map<String, Function> precompiled;
+#ifdef OPSTATS
+    OpStats opStats;
+#endif
+    //! Samples the call stack between instructions when set
+    Profiler *profiler = nullptr;
+    //! Run module bodies on the first use of a global they declare
+    bool lazyImports = false;
+    //! Names of the modules imported lazily and not loaded yet
+    std::vector<Value> lazyModules;
+    //! Globals declared by modules, with their imports, by canonical path
+    std::unordered_map<String, std::unordered_set<String>> declarations;
 
     String constructName;
 
+    //! Arguments and result of callHandle(), see the slot functions
+    std::vector<Value> slots;
+
+    //! Instructions rewritten to their numeric form, and undone on a miss
+    size_t quickenedSites = 0;
+    size_t dequickenedSites = 0;
+    //! Machine code left the instruction at frame->index to the stack loop
+    bool jitBailout = false;
+
     VM();
 
     InterpretResult interpret(Chunk *chunk);
     InterpretResult interpret(const char *source);
+    InterpretResult interpret(std::shared_ptr<Program> program);
+    InterpretResult callFunction(Value callee, const std::vector<Value> &args, Value *result);
+    InterpretResult callFunction(Value callee, const Value *args, int argCount, Value *result);
     InterpretResult run();
+    InterpretResult runStack();
+    InterpretResult runRegisters();
+    InterpretResult runJit();
     void resetStack();
     void runtimeError(const char *format, ...);
     void push(Value value);
     Value pop();
     Value peek(int distance);
+    void quicken(CallFrame *frame, OpCode quickened);
+    void dequicken(CallFrame *frame, OpCode generic);
+    bool takeBackEdge(CallFrame *frame, int edge);
+    void growStack();
     bool call(Closure closure, int argCount);
     bool callValue(Value callee, int argCount);
+
+    /** Fibers **/
+    void saveFiber();
+    void loadFiber(Fiber next);
+    bool enterFiber(Fiber next, Value value);
+    void switchFiber(Fiber next, Value value);
+    bool resumeFiber(Fiber next, Value value);
+    bool yieldFiber(Value value);
+    bool suspendFiber();
+    bool finishFiber(Value result);
+    bool returnFromNative(Value result, int argCount);
     bool bindMethod(Klass klass, String name);
     ObjUpvalue *captureUpvalue(Value *local);
     void closeUpvalues(Value *last);
     void defineMethod(String name);
     Value importModule(Value name);
+    bool importDeclaring(const String &global, Value *body);
+    bool runModuleBody(Value body);
     Closure compileInModule(Value name, const char *source);
     Module getModule(Value name);
 
     bool createInstance(Klass klass, int argCount);
 
+    /** Embedding **/
+    bool getHandle(const char *name, Handle *handle);
+    InterpretResult callHandle(const Handle &function, int argCount);
+    void ensureSlots(int count);
+    ValueType getSlotType(int slot);
+    bool getSlotBool(int slot);
+    double getSlotNumber(int slot);
+    std::string_view getSlotString(int slot);
+    Handle getSlotHandle(int slot);
+    void setSlotNil(int slot);
+    void setSlotBool(int slot, bool value);
+    void setSlotNumber(int slot, double value);
+    void setSlotString(int slot, std::string_view value);
+    void setSlotHandle(int slot, const Handle &handle);
+
     /** Native **/
     void defineNative(const char *name, NativeFn function);
     void defineNativeFunction(const char *name, NativeFn function);
+    Value defineBuiltinClass(const char *name, ClassType classType);
     Value defineNativeClass(const char *name, NativeConstructor constructor, NativeDestructor destructor, const char *super_name, ClassType classType, size_t dataSize, bool final);
     void defineNativeMethod(Value klass, NativeMethod function, const char *name, uint8_t arity, bool isStatic);
     void defineNativeOperator(Value klass, NativeMethod function, uint8_t arity, Operator operator_);
@@ -88,7 +235,8 @@ struct VM {
     Value completeNativeClassDefinition(Value klass_, const char *super_name);
 };
 
-Value clockNative(int argCount, Value *args);
+Value clockNative(VM *vm, int argCount, Value *args);
+void freezeFunction(Function function);
 
 static char *readFile(const char *path) {
     FILE *file = fopen(path, "rb");